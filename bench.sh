@@ -0,0 +1,85 @@
+#!/bin/bash
+# set -x
+
+# End to end benchmark of stm32mp1sign.
+# Generates synthetic stm32 images and keys, signs and verifies them,
+# and prints one line of key=value pairs per run on stdout.
+#
+# Environment:
+# BENCH_SIZES   : Payload sizes to run. K, M and G suffixes are allowed.
+# BENCH_CURVES  : EC curves to run.
+# BENCH_RUNS    : Repetitions per size, curve and operation.
+# BENCH_DIR     : Scratch directory. Removed afterwards if created here.
+# STM32MP1SIGN  : stm32mp1sign binary.
+# STM32MKIMAGE  : stm32mkimage binary.
+
+BENCH_SIZES=${BENCH_SIZES:-"4K 64K 256K 1M 16M 256M 1G"}
+BENCH_CURVES=${BENCH_CURVES:-"prime256v1 brainpoolP256r1"}
+BENCH_RUNS=${BENCH_RUNS:-3}
+STM32MP1SIGN=${STM32MP1SIGN:-./stm32mp1sign}
+STM32MKIMAGE=${STM32MKIMAGE:-./stm32mkimage}
+BENCH_PWD="bench"
+
+REQ_PROGRAM_LIST=(
+    "openssl"
+    "${STM32MP1SIGN}"
+    "${STM32MKIMAGE}"
+)
+
+# Check for needed programs.
+for PROGRAM in "${REQ_PROGRAM_LIST[@]}"; do
+    command -v ${PROGRAM} > /dev/null 2>&1
+    if [ $? -ne 0 ]; then
+	echo "Missing a needed program: ${PROGRAM}" >&2
+	exit 1
+    fi
+done
+
+if [ -z "${BENCH_DIR}" ]; then
+    BENCH_DIR=$(mktemp -d)
+    trap "rm -rf ${BENCH_DIR}" EXIT
+fi
+
+# Keys. Encrypted, so the key phase includes the PBE decryption.
+for CURVE in ${BENCH_CURVES}; do
+    openssl ecparam -name ${CURVE} -genkey -noout | \
+	openssl ec -aes256 -passout pass:${BENCH_PWD} \
+		-out ${BENCH_DIR}/${CURVE}.pem > /dev/null 2>&1 && \
+    openssl ec -in ${BENCH_DIR}/${CURVE}.pem -passin pass:${BENCH_PWD} \
+	    -pubout -out ${BENCH_DIR}/${CURVE}.pub > /dev/null 2>&1
+    if [ $? -ne 0 ]; then
+	echo "openssl: ${CURVE} key generation failed" >&2
+	exit 1
+    fi
+done
+
+echo "# openssl=\"$(openssl version)\" nproc=$(nproc)"
+for SIZE in ${BENCH_SIZES}; do
+    IMAGE=${BENCH_DIR}/bench-${SIZE}.stm32
+    ${STM32MKIMAGE} --output ${IMAGE} --size ${SIZE}
+    if [ $? -ne 0 ]; then
+	echo "stm32mkimage: ${SIZE} image failed" >&2
+	exit 1
+    fi
+    for CURVE in ${BENCH_CURVES}; do
+	for RUN in $(seq 1 ${BENCH_RUNS}); do
+	    STATS=$(${STM32MP1SIGN} --stats --image ${IMAGE} \
+				    --key ${BENCH_DIR}/${CURVE}.pem \
+				    --password ${BENCH_PWD} --sign)
+	    if [ $? -ne 0 ]; then
+		echo "stm32mp1sign: ${SIZE} ${CURVE} signing failed" >&2
+		exit 1
+	    fi
+	    echo "size=${SIZE} curve=${CURVE} run=${RUN} ${STATS}"
+
+	    STATS=$(${STM32MP1SIGN} --stats --image ${IMAGE} \
+				    --key ${BENCH_DIR}/${CURVE}.pub --verify)
+	    if [ $? -ne 0 ]; then
+		echo "stm32mp1sign: ${SIZE} ${CURVE} verification failed" >&2
+		exit 1
+	    fi
+	    echo "size=${SIZE} curve=${CURVE} run=${RUN} ${STATS}"
+	done
+    done
+    rm -f ${IMAGE}
+done
@@ -0,0 +1,230 @@
+// SPDX-License-Identifier: GPL-2.0+ OR BSD-3-Clause
+/*
+ * Copyright (C) 2022, Christian Melki
+ *
+ * Persistent result cache.
+ * A fixed size open addressing hash table in a mapped file. Keys are
+ * already hashes, so their first bytes pick the slot. Lookups probe a
+ * few neighbouring slots and never touch more than a page or two.
+ * When all of them are taken, the first one is overwritten. It is a
+ * cache, losing an entry only costs a recomputation.
+ * Threads of a process serialize on a mutex, processes on flock.
+ * Every slot carries a check of its contents, a torn slot is a miss.
+ */
+
+#define _DEFAULT_SOURCE
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "cache.h"
+
+#define CACHE_MAGIC                     "STM32C01"
+/* 128 byte slots, 16 MiB. The file is sparse until slots are used. */
+#define CACHE_SLOTS                     (1 << 17)
+#define CACHE_PROBE                     16
+#define CACHE_HEADER_SIZE               4096
+
+struct cache_header {
+        char magic[8];
+        uint32_t nslots;
+        uint32_t slot_size;
+};
+
+struct cache_slot {
+        uint8_t key[CACHE_KEY_SIZE];
+        uint8_t val[CACHE_VAL_SIZE];
+        uint64_t check;
+        uint32_t used;
+        uint8_t reserved[20];
+};
+
+struct cache {
+        int fd;
+        size_t size;
+        uint8_t *map;
+        struct cache_slot *slots;
+        pthread_mutex_t lock;
+};
+
+/* FNV-1a over key and value. */
+static uint64_t
+cache_check(const uint8_t *key, const uint8_t *val)
+{
+        uint64_t h = 0xcbf29ce484222325ULL;
+        size_t i;
+
+        for (i = 0; i < CACHE_KEY_SIZE; i++)
+                h = (h ^ key[i]) * 0x100000001b3ULL;
+        for (i = 0; i < CACHE_VAL_SIZE; i++)
+                h = (h ^ val[i]) * 0x100000001b3ULL;
+
+        return h | 1;
+}
+
+static size_t
+cache_home(const uint8_t *key)
+{
+        size_t h;
+
+        memcpy(&h, key, sizeof(h));
+
+        return h % CACHE_SLOTS;
+}
+
+/* Create or validate the file. An unknown layout is started over. */
+static int
+cache_init(struct cache *c)
+{
+        struct cache_header h;
+        struct stat st;
+
+        if (fstat(c->fd, &st))
+                return -1;
+        if ((size_t)st.st_size == c->size &&
+            pread(c->fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) &&
+            !memcmp(h.magic, CACHE_MAGIC, sizeof(h.magic)) &&
+            h.nslots == CACHE_SLOTS &&
+            h.slot_size == sizeof(struct cache_slot)) {
+                return 0;
+        }
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+        h.nslots = CACHE_SLOTS;
+        h.slot_size = sizeof(struct cache_slot);
+        if (ftruncate(c->fd, 0) || ftruncate(c->fd, c->size) ||
+            pwrite(c->fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+                return -1;
+        }
+
+        return 0;
+}
+
+void
+cache_close(struct cache *c)
+{
+        if (!c)
+                return;
+
+        if (c->map) munmap(c->map, c->size);
+        if (c->fd >= 0) close(c->fd);
+        pthread_mutex_destroy(&c->lock);
+        free(c);
+}
+
+struct cache *
+cache_open(const char *path)
+{
+        struct cache *c = NULL;
+        struct stat st;
+        int ret;
+
+        if (!(c = calloc(1, sizeof(*c)))) {
+                fprintf(stderr, "Unable to allocate cache.\n");
+                return NULL;
+        }
+        pthread_mutex_init(&c->lock, NULL);
+        c->size = CACHE_HEADER_SIZE + CACHE_SLOTS * sizeof(struct cache_slot);
+        /* Verdicts are only as good as the file. Keep it private. */
+        if ((c->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+                fprintf(stderr, "Cannot open cache %s: %s\n", path,
+                        strerror(errno));
+                goto err_out;
+        }
+        /* A cache someone else can write hands out their verdicts. */
+        if (fstat(c->fd, &st) || !S_ISREG(st.st_mode) ||
+            st.st_uid != geteuid() || (st.st_mode & 077)) {
+                fprintf(stderr, "Cache %s is not a private file of the user.\n",
+                        path);
+                goto err_out;
+        }
+        flock(c->fd, LOCK_EX);
+        ret = cache_init(c);
+        flock(c->fd, LOCK_UN);
+        if (ret) {
+                fprintf(stderr, "Unable to set up cache %s: %s\n", path,
+                        strerror(errno));
+                goto err_out;
+        }
+        c->map = mmap(NULL, c->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      c->fd, 0);
+        if (c->map == MAP_FAILED) {
+                c->map = NULL;
+                fprintf(stderr, "Unable to map cache %s: %s\n", path,
+                        strerror(errno));
+                goto err_out;
+        }
+        c->slots = (struct cache_slot *)&c->map[CACHE_HEADER_SIZE];
+
+        return c;
+
+ err_out:
+        cache_close(c);
+        return NULL;
+}
+
+bool
+cache_get(struct cache *c, const uint8_t *key, uint8_t *val)
+{
+        struct cache_slot *s;
+        size_t i, home;
+        bool hit = false;
+
+        if (!c)
+                return false;
+
+        home = cache_home(key);
+        pthread_mutex_lock(&c->lock);
+        flock(c->fd, LOCK_SH);
+        for (i = 0; i < CACHE_PROBE; i++) {
+                s = &c->slots[(home + i) % CACHE_SLOTS];
+                if (!s->used)
+                        break;
+                if (!memcmp(s->key, key, CACHE_KEY_SIZE) &&
+                    s->check == cache_check(s->key, s->val)) {
+                        memcpy(val, s->val, CACHE_VAL_SIZE);
+                        hit = true;
+                        break;
+                }
+        }
+        flock(c->fd, LOCK_UN);
+        pthread_mutex_unlock(&c->lock);
+
+        return hit;
+}
+
+void
+cache_put(struct cache *c, const uint8_t *key, const uint8_t *val)
+{
+        struct cache_slot *s = NULL;
+        size_t i, home;
+
+        if (!c)
+                return;
+
+        home = cache_home(key);
+        pthread_mutex_lock(&c->lock);
+        flock(c->fd, LOCK_EX);
+        for (i = 0; i < CACHE_PROBE; i++) {
+                s = &c->slots[(home + i) % CACHE_SLOTS];
+                if (!s->used || !memcmp(s->key, key, CACHE_KEY_SIZE))
+                        break;
+        }
+        if (i == CACHE_PROBE)
+                s = &c->slots[home];
+        memcpy(s->key, key, CACHE_KEY_SIZE);
+        memcpy(s->val, val, CACHE_VAL_SIZE);
+        s->check = cache_check(key, val);
+        s->used = 1;
+        flock(c->fd, LOCK_UN);
+        pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: GPL-2.0+ OR BSD-3-Clause
+/*
+ * Copyright (C) 2022, Christian Melki
+ *
+ * Persistent result cache. A mapped open addressing hash table.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CACHE_KEY_SIZE                  32
+#define CACHE_VAL_SIZE                  64
+
+struct cache;
+
+struct cache *cache_open(const char *path);
+void cache_close(struct cache *c);
+bool cache_get(struct cache *c, const uint8_t *key, uint8_t *val);
+void cache_put(struct cache *c, const uint8_t *key, const uint8_t *val);
+
+#endif /* CACHE_H */
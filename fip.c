@@ -0,0 +1,462 @@
+// SPDX-License-Identifier: GPL-2.0+ OR BSD-3-Clause
+/*
+ * Copyright (C) 2022, Christian Melki
+ *
+ * TF-A Firmware Image Package (FIP) reader and writer.
+ * A FIP is a ToC header, a ToC of UUID, offset, size and flags
+ * entries ended by a null UUID, and the constituents after it.
+ * Everything is little endian.
+ * The FIP is mapped read-only and the ToC parsed in place.
+ * Constituents are slices of the mapping, nothing is copied.
+ * A new FIP is the ToC, built in memory, and the slices, written
+ * with a single pwritev to a temporary file put in place by outfile.
+ * UUIDs and names are the ones of fiptool in TF-A.
+ */
+
+#define _DEFAULT_SOURCE
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "config.h"
+#include "fip.h"
+#include "outfile.h"
+
+struct fip_toc_header {
+        uint32_t name;
+        uint32_t serial;
+        uint64_t flags;
+};
+
+struct fip_toc_entry {
+        uint8_t uuid[FIP_UUID_SIZE];
+        uint64_t offset;
+        uint64_t size;
+        uint64_t flags;
+};
+
+static const struct {
+        const char *name;
+        uint8_t uuid[FIP_UUID_SIZE];
+} fip_names[] = {
+        { "tb-fw", { 0x5f, 0xf9, 0xec, 0x0b, 0x4d, 0x22, 0x3e, 0x4d,
+                     0xa5, 0x44, 0xc3, 0x9d, 0x81, 0xc7, 0x3f, 0x0a } },
+        { "scp-fw", { 0x97, 0x66, 0xfd, 0x3d, 0x89, 0xbe, 0xe8, 0x49,
+                      0xae, 0x5d, 0x78, 0xa1, 0x40, 0x60, 0x82, 0x13 } },
+        { "soc-fw", { 0x47, 0xd4, 0x08, 0x6d, 0x4c, 0xfe, 0x98, 0x46,
+                      0x9b, 0x95, 0x29, 0x50, 0xcb, 0xbd, 0x5a, 0x00 } },
+        { "tos-fw", { 0x05, 0xd0, 0xe1, 0x89, 0x53, 0xdc, 0x13, 0x47,
+                      0x8d, 0x2b, 0x50, 0x0a, 0x4b, 0x7a, 0x3e, 0x38 } },
+        { "tos-fw-extra1", { 0x0b, 0x70, 0xc2, 0x9b, 0x2a, 0x5a, 0x78, 0x40,
+                             0x9f, 0x65, 0x0a, 0x56, 0x82, 0x73, 0x82, 0x88 } },
+        { "tos-fw-extra2", { 0x8e, 0xa8, 0x7b, 0xb1, 0xcf, 0xa2, 0x3f, 0x4d,
+                             0x85, 0xfd, 0xe7, 0xbb, 0xa5, 0x02, 0x20, 0xd9 } },
+        { "nt-fw", { 0xd6, 0xd0, 0xee, 0xa7, 0xfc, 0xea, 0xd5, 0x4b,
+                     0x97, 0x82, 0x99, 0x34, 0xf2, 0x34, 0xb6, 0xe4 } },
+        { "fw-config", { 0x58, 0x07, 0xe1, 0x6a, 0x84, 0x59, 0x47, 0xbe,
+                         0x8e, 0xd5, 0x64, 0x8e, 0x8d, 0xdd, 0xab, 0x0e } },
+        { "hw-config", { 0x08, 0xb8, 0xf1, 0xd9, 0xc9, 0xcf, 0x93, 0x49,
+                         0xa9, 0x62, 0x6f, 0xbc, 0x6b, 0x72, 0x65, 0xcc } },
+        { "tb-fw-config", { 0x6c, 0x04, 0x58, 0xff, 0xaf, 0x6b, 0x7d, 0x4f,
+                            0x82, 0xed, 0xaa, 0x27, 0xbc, 0x69, 0xbf, 0xd2 } },
+        { "soc-fw-config", { 0x99, 0x79, 0x81, 0x4b, 0x03, 0x76, 0xfb, 0x46,
+                             0x8c, 0x8e, 0x8d, 0x26, 0x7f, 0x78, 0x59, 0xe0 } },
+        { "tos-fw-config", { 0x26, 0x25, 0x7c, 0x1a, 0xdb, 0xc6, 0x7f, 0x47,
+                             0x8d, 0x96, 0xc4, 0xc4, 0xb0, 0x24, 0x80, 0x21 } },
+        { "nt-fw-config", { 0x28, 0xda, 0x98, 0x15, 0x93, 0xe8, 0x7e, 0x44,
+                            0xac, 0x66, 0x1a, 0xaf, 0x80, 0x15, 0x50, 0xf9 } },
+        { "rot-cert", { 0x86, 0x2d, 0x1d, 0x72, 0xf8, 0x60, 0xe4, 0x11,
+                        0x92, 0x0b, 0x8b, 0xe7, 0x62, 0x16, 0x0f, 0x24 } },
+        { "trusted-key-cert", { 0x82, 0x7e, 0xe8, 0x90, 0xf8, 0x60, 0xe4, 0x11,
+                                0xa1, 0xb4, 0x77, 0x7a, 0x21, 0xb4, 0xf9, 0x4c } },
+        { "scp-fw-key-cert", { 0x02, 0x42, 0x21, 0xa1, 0xf8, 0x60, 0xe4, 0x11,
+                               0x8d, 0x9b, 0xf3, 0x3c, 0x0e, 0x15, 0xa0, 0x14 } },
+        { "soc-fw-key-cert", { 0x8a, 0xb8, 0xbe, 0xcc, 0xf9, 0x60, 0xe4, 0x11,
+                               0x9a, 0xd0, 0xeb, 0x48, 0x22, 0xd8, 0xdc, 0xf8 } },
+        { "tos-fw-key-cert", { 0x94, 0x77, 0xd6, 0x03, 0xfb, 0x60, 0xe4, 0x11,
+                               0x85, 0xdd, 0xb7, 0x10, 0x5b, 0x8c, 0xee, 0x04 } },
+        { "nt-fw-key-cert", { 0x8a, 0xd5, 0x83, 0x2a, 0xfb, 0x60, 0xe4, 0x11,
+                              0x8a, 0xaf, 0xdf, 0x30, 0xbb, 0xc4, 0x98, 0x59 } },
+        { "tb-fw-cert", { 0xd6, 0xe2, 0x69, 0xea, 0x5d, 0x63, 0xe4, 0x11,
+                          0x8d, 0x8c, 0x9f, 0xba, 0xbe, 0x99, 0x56, 0xa5 } },
+        { "scp-fw-cert", { 0x44, 0xbe, 0x6f, 0x04, 0x5e, 0x63, 0xe4, 0x11,
+                           0xb2, 0x8b, 0x73, 0xd8, 0xea, 0xae, 0x96, 0x56 } },
+        { "soc-fw-cert", { 0xe2, 0xb2, 0x0c, 0x20, 0x5e, 0x63, 0xe4, 0x11,
+                           0x9c, 0xe8, 0xab, 0xcc, 0xf9, 0x2b, 0xb6, 0x66 } },
+        { "tos-fw-cert", { 0xa4, 0x9f, 0x44, 0x11, 0x5e, 0x63, 0xe4, 0x11,
+                           0x87, 0x28, 0x3f, 0x05, 0x72, 0x2a, 0xf3, 0x3d } },
+        { "nt-fw-cert", { 0x8e, 0xc4, 0xc1, 0xf3, 0x5d, 0x63, 0xe4, 0x11,
+                          0xa7, 0xa9, 0x87, 0xee, 0x40, 0xb2, 0x3f, 0xa7 } },
+};
+
+#define FIP_NAMES                       (sizeof(fip_names) / sizeof(fip_names[0]))
+
+static const char *
+fip_uuid_to_name(const uint8_t *uuid)
+{
+        size_t i;
+
+        for (i = 0; i < FIP_NAMES; i++)
+                if (!memcmp(fip_names[i].uuid, uuid, FIP_UUID_SIZE))
+                        return fip_names[i].name;
+
+        return NULL;
+}
+
+const uint8_t *
+fip_name_to_uuid(const char *name)
+{
+        size_t i;
+
+        for (i = 0; i < FIP_NAMES; i++)
+                if (!strcmp(fip_names[i].name, name))
+                        return fip_names[i].uuid;
+
+        return NULL;
+}
+
+/* File name of an unpacked entry, as fiptool names it. */
+void
+fip_entry_file_name(const struct fip_entry *e, char *buf, size_t len)
+{
+        const uint8_t *u = e->uuid;
+
+        if (e->name) {
+                snprintf(buf, len, "%s.bin", e->name);
+                return;
+        }
+        snprintf(buf, len, "%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-"
+                 "%02X%02X%02X%02X%02X%02X.bin", u[0], u[1], u[2], u[3],
+                 u[4], u[5], u[6], u[7], u[8], u[9], u[10], u[11], u[12],
+                 u[13], u[14], u[15]);
+}
+
+static void
+fip_entry_release(struct fip_entry *e)
+{
+        if (e->map) munmap(e->map, e->map_len);
+        e->map = NULL;
+        e->map_len = 0;
+}
+
+void
+fip_close(struct fip *fip)
+{
+        size_t i;
+
+        if (!fip)
+                return;
+
+        for (i = 0; i < fip->count; i++)
+                fip_entry_release(&fip->entries[i]);
+        if (fip->map) munmap(fip->map, fip->len);
+        memset(fip, 0, sizeof(*fip));
+}
+
+int
+fip_open(struct fip *fip, const char *path)
+{
+        static const uint8_t null_uuid[FIP_UUID_SIZE];
+        struct fip_toc_header h;
+        struct fip_toc_entry te;
+        struct fip_entry *e;
+        struct stat st;
+        size_t off;
+        int fd;
+
+        memset(fip, 0, sizeof(*fip));
+        if ((fd = open(path, O_RDONLY)) < 0) {
+                fprintf(stderr, "Cannot open FIP %s: %s\n", path,
+                        strerror(errno));
+                return -1;
+        }
+        if (fstat(fd, &st)) {
+                fprintf(stderr, "Cannot stat FIP %s: %s\n", path,
+                        strerror(errno));
+                close(fd);
+                return -1;
+        }
+        if ((size_t)st.st_size < sizeof(h) + sizeof(te)) {
+                fprintf(stderr, "FIP %s too small for a ToC.\n", path);
+                close(fd);
+                return -1;
+        }
+        fip->len = st.st_size;
+        fip->map = mmap(NULL, fip->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (fip->map == MAP_FAILED) {
+                fip->map = NULL;
+                fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+                return -1;
+        }
+
+        memcpy(&h, fip->map, sizeof(h));
+        if (le32toh(h.name) != FIP_TOC_HEADER_NAME) {
+                fprintf(stderr, "Invalid FIP ToC header in %s.\n", path);
+                goto err_out;
+        }
+        fip->serial = le32toh(h.serial);
+        fip->flags = le64toh(h.flags);
+        for (off = sizeof(h); ; off += sizeof(te)) {
+                if (off + sizeof(te) > fip->len) {
+                        fprintf(stderr, "Truncated FIP ToC in %s.\n", path);
+                        goto err_out;
+                }
+                memcpy(&te, &fip->map[off], sizeof(te));
+                if (!memcmp(te.uuid, null_uuid, sizeof(null_uuid)))
+                        break;
+                if (fip->count == FIP_MAX_ENTRIES) {
+                        fprintf(stderr, "Too many entries in FIP %s.\n",
+                                path);
+                        goto err_out;
+                }
+                te.offset = le64toh(te.offset);
+                te.size = le64toh(te.size);
+                if (te.offset > fip->len || te.size > fip->len - te.offset) {
+                        fprintf(stderr, "FIP entry past the end of %s.\n",
+                                path);
+                        goto err_out;
+                }
+                e = &fip->entries[fip->count++];
+                memcpy(e->uuid, te.uuid, sizeof(e->uuid));
+                e->name = fip_uuid_to_name(te.uuid);
+                e->data = &fip->map[te.offset];
+                e->size = te.size;
+                e->flags = le64toh(te.flags);
+        }
+
+        return 0;
+
+ err_out:
+        fip_close(fip);
+        return -1;
+}
+
+struct fip_entry *
+fip_find(struct fip *fip, const char *name)
+{
+        const uint8_t *uuid;
+        size_t i;
+
+        if (!(uuid = fip_name_to_uuid(name)))
+                return NULL;
+        for (i = 0; i < fip->count; i++)
+                if (!memcmp(fip->entries[i].uuid, uuid, FIP_UUID_SIZE))
+                        return &fip->entries[i];
+
+        return NULL;
+}
+
+/* Replace the payload of an entry, or add it.
+ * Entries keep their place, new ones go last.
+ * data must outlive fip_write.
+ */
+int
+fip_set(struct fip *fip, const char *name, const uint8_t *data, size_t len)
+{
+        const uint8_t *uuid;
+        struct fip_entry *e;
+
+        if (!(uuid = fip_name_to_uuid(name))) {
+                fprintf(stderr, "Unknown FIP entry: %s\n", name);
+                return -1;
+        }
+        if (!(e = fip_find(fip, name))) {
+                if (fip->count == FIP_MAX_ENTRIES) {
+                        fprintf(stderr, "Too many FIP entries.\n");
+                        return -1;
+                }
+                e = &fip->entries[fip->count++];
+                memset(e, 0, sizeof(*e));
+                memcpy(e->uuid, uuid, sizeof(e->uuid));
+                e->name = fip_uuid_to_name(uuid);
+        }
+        fip_entry_release(e);
+        e->data = data;
+        e->size = len;
+
+        return 0;
+}
+
+/* fip_set with the contents of a file, mapped. */
+int
+fip_set_file(struct fip *fip, const char *name, const char *path)
+{
+        struct fip_entry *e;
+        struct stat st;
+        void *map = NULL;
+        int fd;
+
+        if ((fd = open(path, O_RDONLY)) < 0) {
+                fprintf(stderr, "Cannot open %s: %s\n", path,
+                        strerror(errno));
+                return -1;
+        }
+        if (fstat(fd, &st)) {
+                fprintf(stderr, "Cannot stat %s: %s\n", path,
+                        strerror(errno));
+                close(fd);
+                return -1;
+        }
+        if (st.st_size &&
+            (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd,
+                        0)) == MAP_FAILED) {
+                fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+                close(fd);
+                return -1;
+        }
+        close(fd);
+        if (fip_set(fip, name, map, st.st_size)) {
+                if (map) munmap(map, st.st_size);
+                return -1;
+        }
+        e = fip_find(fip, name);
+        e->map = map;
+        e->map_len = st.st_size;
+
+        return 0;
+}
+
+/* Write every entry to dir, as fiptool unpack --force does. */
+int
+fip_unpack(const struct fip *fip, const char *dir)
+{
+        char path[PATH_MAX], name[64];
+        const uint8_t *p;
+        size_t i, left;
+        ssize_t n;
+        int fd;
+
+        for (i = 0; i < fip->count; i++) {
+                fip_entry_file_name(&fip->entries[i], name, sizeof(name));
+                snprintf(path, sizeof(path), "%s/%s", dir, name);
+                if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                               0666)) < 0) {
+                        fprintf(stderr, "Cannot create %s: %s\n", path,
+                                strerror(errno));
+                        return -1;
+                }
+                p = fip->entries[i].data;
+                left = fip->entries[i].size;
+                while (left) {
+                        if ((n = write(fd, p, left)) < 0 && errno == EINTR)
+                                continue;
+                        if (n <= 0)
+                                break;
+                        p += n;
+                        left -= n;
+                }
+                if (close(fd) || left) {
+                        fprintf(stderr, "Unable to write %s: %s\n", path,
+                                strerror(errno));
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+/* Write all of iov, however the kernel splits it.
+ * Nothing written for a non-empty iov is an error, not a retry.
+ */
+static int
+fip_pwritev_full(int fd, struct iovec *iov, int cnt)
+{
+        off_t off = 0;
+        ssize_t n;
+
+        while (cnt) {
+                if (!iov->iov_len) {
+                        iov++;
+                        cnt--;
+                        continue;
+                }
+                if ((n = pwritev(fd, iov, cnt, off)) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                if (!n) {
+                        errno = EIO;
+                        return -1;
+                }
+                off += n;
+                while (cnt && (size_t)n >= iov->iov_len) {
+                        n -= iov->iov_len;
+                        iov++;
+                        cnt--;
+                }
+                if (cnt) {
+                        iov->iov_base = (uint8_t *)iov->iov_base + n;
+                        iov->iov_len -= n;
+                }
+        }
+
+        return 0;
+}
+
+int
+fip_write(const struct fip *fip, const char *path)
+{
+        struct iovec iov[FIP_MAX_ENTRIES + 1];
+        struct fip_toc_header *h;
+        struct fip_toc_entry *te;
+        struct outfile of = { .fd = -1 };
+        uint8_t *toc = NULL;
+        size_t toc_len, i;
+        uint64_t off;
+
+        toc_len = sizeof(*h) + (fip->count + 1) * sizeof(*te);
+        if (!(toc = calloc(1, toc_len))) {
+                fprintf(stderr, "Unable to allocate FIP ToC.\n");
+                goto err_out;
+        }
+        h = (struct fip_toc_header *)toc;
+        h->name = htole32(FIP_TOC_HEADER_NAME);
+        h->serial = htole32(fip->serial);
+        h->flags = htole64(fip->flags);
+        te = (struct fip_toc_entry *)&toc[sizeof(*h)];
+        iov[0].iov_base = toc;
+        iov[0].iov_len = toc_len;
+        off = toc_len;
+        for (i = 0; i < fip->count; i++) {
+                memcpy(te[i].uuid, fip->entries[i].uuid, FIP_UUID_SIZE);
+                te[i].offset = htole64(off);
+                te[i].size = htole64(fip->entries[i].size);
+                te[i].flags = htole64(fip->entries[i].flags);
+                iov[i + 1].iov_base = (void *)fip->entries[i].data;
+                iov[i + 1].iov_len = fip->entries[i].size;
+                off += fip->entries[i].size;
+        }
+        /* The null entry points to the end, like fiptool does. */
+        te[i].offset = htole64(off);
+
+        if (outfile_open(&of, path, 0644)) {
+                fprintf(stderr, "Cannot create %s: %s\n", path,
+                        strerror(errno));
+                goto err_out;
+        }
+        if (fip_pwritev_full(of.fd, iov, fip->count + 1) ||
+            outfile_commit(&of, path)) {
+                fprintf(stderr, "Unable to write FIP %s: %s\n", path,
+                        strerror(errno));
+                goto err_out;
+        }
+
+        outfile_close(&of);
+        free(toc);
+        return 0;
+
+ err_out:
+        outfile_close(&of);
+        if (toc) free(toc);
+        return -1;
+}
@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: GPL-2.0+ OR BSD-3-Clause
+/*
+ * Copyright (C) 2022, Christian Melki
+ *
+ * TF-A Firmware Image Package (FIP) reader and writer.
+ */
+
+#ifndef FIP_H
+#define FIP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FIP_TOC_HEADER_NAME             0xAA640001
+#define FIP_UUID_SIZE                   16
+/* Far more than the TF-A table has names for. */
+#define FIP_MAX_ENTRIES                 64
+
+struct fip_entry {
+        uint8_t uuid[FIP_UUID_SIZE];
+        /* fiptool name, like nt-fw. NULL for unknown UUIDs. */
+        const char *name;
+        /* Slice of the FIP mapping, or of a mapping of its own. */
+        const uint8_t *data;
+        uint64_t size;
+        uint64_t flags;
+        /* Owned mapping, set by fip_set_file. */
+        void *map;
+        size_t map_len;
+};
+
+struct fip {
+        uint8_t *map;
+        size_t len;
+        uint32_t serial;
+        uint64_t flags;
+        size_t count;
+        struct fip_entry entries[FIP_MAX_ENTRIES];
+};
+
+const uint8_t *fip_name_to_uuid(const char *name);
+void fip_entry_file_name(const struct fip_entry *e, char *buf, size_t len);
+int fip_open(struct fip *fip, const char *path);
+void fip_close(struct fip *fip);
+struct fip_entry *fip_find(struct fip *fip, const char *name);
+int fip_set(struct fip *fip, const char *name, const uint8_t *data,
+            size_t len);
+int fip_set_file(struct fip *fip, const char *name, const char *path);
+int fip_unpack(const struct fip *fip, const char *dir);
+int fip_write(const struct fip *fip, const char *path);
+
+#endif /* FIP_H */
@@ -0,0 +1,131 @@
+// SPDX-License-Identifier: GPL-2.0+ OR BSD-3-Clause
+/*
+ * Copyright (C) 2022, Christian Melki
+ *
+ * Files replaced atomically.
+ * The new contents go to an unnamed O_TMPFILE in the directory of
+ * the target, or a named mkstemp temporary next to it where the
+ * filesystem has no O_TMPFILE. Once written, the file is synced and
+ * renamed over the target, and the directory synced. Readers see the
+ * old file or the new one, never a partial one, also after a crash.
+ * Errors are left in errno, nothing is printed.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "outfile.h"
+
+/* Make a new name in the directory of path durable. */
+static int
+fsync_parent(const char *path)
+{
+        char *dir;
+        int fd, ret = -1;
+
+        if (!(dir = strdup(path)))
+                return -1;
+        if ((fd = open(dirname(dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+                ret = fsync(fd);
+                close(fd);
+        }
+        free(dir);
+
+        return ret;
+}
+
+/* Start a new file for path, with exactly mode, umask or not.
+ * Nothing is visible at path until outfile_commit.
+ */
+int
+outfile_open(struct outfile *of, const char *path, mode_t mode)
+{
+        char *dir = NULL, *tmp = NULL;
+        int err;
+
+        of->fd = -1;
+        of->tmp = NULL;
+        if (!(dir = strdup(path)) || asprintf(&tmp, "%s.XXXXXX", path) < 0) {
+                tmp = NULL;
+                errno = ENOMEM;
+                goto err_out;
+        }
+        of->fd = open(dirname(dir), O_TMPFILE | O_RDWR | O_CLOEXEC, mode);
+        if (of->fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR)) {
+                if ((of->fd = mkostemp(tmp, O_CLOEXEC)) >= 0) {
+                        of->tmp = tmp;
+                        tmp = NULL;
+                }
+        }
+        if (of->fd < 0 || fchmod(of->fd, mode))
+                goto err_out;
+
+        free(dir);
+        free(tmp);
+        return 0;
+
+ err_out:
+        err = errno;
+        outfile_close(of);
+        if (dir) free(dir);
+        if (tmp) free(tmp);
+        errno = err;
+        return -1;
+}
+
+/* Put the file in place, replacing path. The fd stays open. */
+int
+outfile_commit(struct outfile *of, const char *path)
+{
+        char proc[64];
+
+        /* Data first, so a crash never leaves path half written. */
+        if (fdatasync(of->fd))
+                return -1;
+        if (!of->tmp) {
+                /* linkat does not replace. Link the unnamed file under
+                 * a name unique to this process and fd, then rename it.
+                 */
+                snprintf(proc, sizeof(proc), "/proc/self/fd/%d", of->fd);
+                if (asprintf(&of->tmp, "%s.%ld.%d", path,
+                             (long)getpid(), of->fd) < 0) {
+                        of->tmp = NULL;
+                        errno = ENOMEM;
+                        return -1;
+                }
+                unlink(of->tmp);
+                if (linkat(AT_FDCWD, proc, AT_FDCWD, of->tmp,
+                           AT_SYMLINK_FOLLOW)) {
+                        free(of->tmp);
+                        of->tmp = NULL;
+                        return -1;
+                }
+        }
+        if (rename(of->tmp, path))
+                return -1;
+        free(of->tmp);
+        of->tmp = NULL;
+
+        return fsync_parent(path);
+}
+
+/* Close, and remove a named temporary that never made it into place. */
+void
+outfile_close(struct outfile *of)
+{
+        if (of->fd >= 0) close(of->fd);
+        if (of->tmp) {
+                unlink(of->tmp);
+                free(of->tmp);
+        }
+        of->fd = -1;
+        of->tmp = NULL;
+}
@@ -0,0 +1,23 @@
+// SPDX-License-Identifier: GPL-2.0+ OR BSD-3-Clause
+/*
+ * Copyright (C) 2022, Christian Melki
+ *
+ * Files replaced atomically.
+ */
+
+#ifndef OUTFILE_H
+#define OUTFILE_H
+
+#include <sys/types.h>
+
+struct outfile {
+        int fd;
+        /* Named temporary. NULL while the file is unnamed. */
+        char *tmp;
+};
+
+int outfile_open(struct outfile *of, const char *path, mode_t mode);
+int outfile_commit(struct outfile *of, const char *path);
+void outfile_close(struct outfile *of);
+
+#endif /* OUTFILE_H */
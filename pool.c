@@ -0,0 +1,190 @@
+// SPDX-License-Identifier: GPL-2.0+ OR BSD-3-Clause
+/*
+ * Copyright (C) 2022, Christian Melki
+ *
+ * Small work stealing thread pool.
+ * Jobs are plain indexes. Every worker owns a range of them.
+ * The owner takes jobs from the front of its range,
+ * idle workers steal half of what remains from the back of a victim.
+ */
+
+#define _DEFAULT_SOURCE
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "pool.h"
+
+struct pool_worker {
+        pthread_mutex_t lock;
+        size_t head;
+        size_t tail;
+        long done;
+        long failed;
+        pthread_t thread;
+        struct pool *pool;
+};
+
+struct pool {
+        const struct pool_ops *ops;
+        void *arg;
+        unsigned int nworkers;
+        struct pool_worker *workers;
+};
+
+unsigned int
+pool_default_threads(void)
+{
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+        return n > 0 ? (unsigned int)n : 1;
+}
+
+static bool
+pool_take(struct pool_worker *w, size_t *job)
+{
+        bool taken = false;
+
+        pthread_mutex_lock(&w->lock);
+        if (w->head < w->tail) {
+                *job = w->head++;
+                taken = true;
+        }
+        pthread_mutex_unlock(&w->lock);
+
+        return taken;
+}
+
+/* Move half of the victims remaining range, rounded up,
+ * from its back to the thief.
+ */
+static bool
+pool_steal(struct pool_worker *thief, struct pool_worker *victim)
+{
+        size_t n, head = 0, tail = 0;
+
+        pthread_mutex_lock(&victim->lock);
+        if ((n = victim->tail - victim->head)) {
+                n = (n + 1) / 2;
+                tail = victim->tail;
+                head = victim->tail = tail - n;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (!n)
+                return false;
+
+        pthread_mutex_lock(&thief->lock);
+        thief->head = head;
+        thief->tail = tail;
+        pthread_mutex_unlock(&thief->lock);
+
+        return true;
+}
+
+static void *
+pool_worker_main(void *data)
+{
+        struct pool_worker *w = data;
+        struct pool *pool = w->pool;
+        const struct pool_ops *ops = pool->ops;
+        void *wctx = NULL;
+        unsigned int i, self = w - pool->workers;
+        size_t job;
+        bool stolen;
+
+        if (ops->init && !(wctx = ops->init(pool->arg))) {
+                /* Leave own jobs to the others. */
+                return NULL;
+        }
+        do {
+                while (pool_take(w, &job)) {
+                        if (ops->run(pool->arg, wctx, job))
+                                w->failed++;
+                        w->done++;
+                }
+                stolen = false;
+                for (i = 1; i < pool->nworkers && !stolen; i++) {
+                        stolen = pool_steal(w, &pool->workers[(self + i) %
+                                                              pool->nworkers]);
+                }
+        } while (stolen);
+        if (ops->fini)
+                ops->fini(wctx);
+
+        return NULL;
+}
+
+/* Run njobs jobs on up to nthreads threads.
+ * A single thread runs in the caller, without spawning.
+ * Returns the number of failed jobs, or -1 if the pool could not start.
+ * Jobs never run, because every worker failed to initialize,
+ * count as failed.
+ */
+long
+pool_run(size_t njobs, unsigned int nthreads,
+         const struct pool_ops *ops, void *arg)
+{
+        struct pool pool = { .ops = ops, .arg = arg };
+        struct pool_worker *w;
+        unsigned int i, started = 0;
+        long done = 0, failed = 0;
+
+        if (!ops || !ops->run) {
+                fprintf(stderr, "Invalid input.\n");
+                goto err_out;
+        }
+        if (!njobs) {
+                return 0;
+        }
+        if (!nthreads)
+                nthreads = 1;
+        if (nthreads > njobs)
+                nthreads = njobs;
+
+        if (!(pool.workers = calloc(nthreads, sizeof(*pool.workers)))) {
+                fprintf(stderr, "Unable to allocate thread pool.\n");
+                goto err_out;
+        }
+        pool.nworkers = nthreads;
+        /* Even split up front. Stealing evens out the rest. */
+        for (i = 0; i < nthreads; i++) {
+                w = &pool.workers[i];
+                pthread_mutex_init(&w->lock, NULL);
+                w->head = njobs * i / nthreads;
+                w->tail = njobs * (i + 1) / nthreads;
+                w->pool = &pool;
+        }
+        /* Worker 0 is the calling thread.
+         * Ranges of workers that fail to start are stolen by the others.
+         */
+        for (i = 1; i < nthreads; i++) {
+                if (pthread_create(&pool.workers[i].thread, NULL,
+                                   pool_worker_main, &pool.workers[i])) {
+                        fprintf(stderr,
+                                "Warn: Unable to start worker thread.\n");
+                        break;
+                }
+                started++;
+        }
+        pool_worker_main(&pool.workers[0]);
+        for (i = 1; i <= started; i++) {
+                pthread_join(pool.workers[i].thread, NULL);
+        }
+        for (i = 0; i < nthreads; i++) {
+                w = &pool.workers[i];
+                done += w->done;
+                failed += w->failed;
+                pthread_mutex_destroy(&w->lock);
+        }
+        failed += (long)njobs - done;
+
+        free(pool.workers);
+        return failed;
+
+ err_out:
+        return -1;
+}
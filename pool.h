@@ -0,0 +1,28 @@
+// SPDX-License-Identifier: GPL-2.0+ OR BSD-3-Clause
+/*
+ * Copyright (C) 2022, Christian Melki
+ *
+ * Small work stealing thread pool.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/* Per job callbacks.
+ * init is called once in every worker thread and returns the
+ * worker private context handed to run and fini.
+ * run returns 0 on success. Any other value counts as a failed job.
+ */
+struct pool_ops {
+        void *(*init)(void *arg);
+        int (*run)(void *arg, void *wctx, size_t job);
+        void (*fini)(void *wctx);
+};
+
+unsigned int pool_default_threads(void);
+long pool_run(size_t njobs, unsigned int nthreads,
+              const struct pool_ops *ops, void *arg);
+
+#endif /* POOL_H */
@@ -0,0 +1,36 @@
+// SPDX-License-Identifier: GPL-2.0+ OR BSD-3-Clause
+/*
+ * Copyright (C) 2022, Christian Melki
+ *
+ * Static tracing probes, provider stm32mp1sign.
+ * With sys/sdt.h every probe is a single nop and a note in the ELF
+ * file. bpftrace, perf or systemtap patch it in at runtime. Arguments
+ * are only read by an attached tracer, so keep them to values already
+ * at hand. Without sys/sdt.h probes compile to nothing.
+ *
+ * phase__start(name), phase__done(name, images, result)
+ * key__load__start(path), key__load__done(path, privkey, result)
+ * image__load__start(path), image__load__done(path, bytes, result)
+ * ecdsa__sign__start(path), ecdsa__sign__done(path, result)
+ * ecdsa__verify__start(path), ecdsa__verify__done(path, result)
+ *
+ * path is "-" where there is none, like for fds passed to the daemon.
+ * result is 0 on success.
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE1(name, a)                 DTRACE_PROBE1(stm32mp1sign, name, a)
+#define PROBE2(name, a, b)              DTRACE_PROBE2(stm32mp1sign, name, a, b)
+#define PROBE3(name, a, b, c)           DTRACE_PROBE3(stm32mp1sign, name, a, b, c)
+#else
+#define PROBE1(name, a)                 ((void)(a))
+#define PROBE2(name, a, b)              ((void)(a), (void)(b))
+#define PROBE3(name, a, b, c)           ((void)(a), (void)(b), (void)(c))
+#endif
+
+#endif /* PROBES_H */
@@ -0,0 +1,1046 @@
+// SPDX-License-Identifier: GPL-2.0+ OR BSD-3-Clause
+/*
+ * Copyright (C) 2022, Christian Melki
+ *
+ * SHA-256 with runtime selected kernels.
+ * The fastest kernel the CPU supports is picked on first use:
+ * x86 SHA extensions, ARMv8 crypto extensions or portable C.
+ * An AVX2 message schedule is kept for comparison. Every candidate
+ * must pass the known answer test before it is used. Digests are bit identical to
+ * any other SHA-256.
+ * A byte sum of the data can be taken in the same pass, piece by
+ * piece while each piece is still in cache.
+ */
+
+#define _DEFAULT_SOURCE
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <endian.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA256_X86
+#endif
+
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#include <arm_neon.h>
+#define SHA256_ARMV8
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2                      (1 << 6)
+#endif
+#endif
+
+#include "config.h"
+#include "sha256.h"
+
+/* Hash and byte sum pieces. Small enough to stay in L1. */
+#define SHA256_SUM_CHUNK                4096
+/* Blocks per lane per multi-buffer step, for the same reason. */
+#define SHA256_MB_CHUNK                 32
+
+#define ROR32(x, n)                     (((x) >> (n)) | ((x) << (32 - (n))))
+
+typedef void (*sha256_blocks_fn)(uint32_t *state, const uint8_t *data,
+                                 size_t nblocks);
+
+static const uint32_t sha256_k[64] __attribute__((aligned(16))) = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+        0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+        0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+        0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+        0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+        0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+        0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+        0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t sha256_h0[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+/* The round function, shared by all but the instruction set kernels.
+ * wk is the message word with the round constant already added.
+ * Works on scalars and on GCC vectors alike.
+ */
+#define SHA256_ROUND(a, b, c, d, e, f, g, h, wk)                        \
+        do {                                                            \
+                __typeof__(e) t1, t2;                                   \
+                t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +  \
+                        ((e & f) ^ (~e & g)) + (wk);                    \
+                t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) +      \
+                        ((a & b) ^ (a & c) ^ (b & c));                  \
+                d += t1;                                                \
+                h = t1 + t2;                                            \
+        } while (0)
+
+static inline void
+sha256_rounds(uint32_t *state, const uint32_t *wk)
+{
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        int i;
+
+        for (i = 0; i < 64; i += 8) {
+                SHA256_ROUND(a, b, c, d, e, f, g, h, wk[i + 0]);
+                SHA256_ROUND(h, a, b, c, d, e, f, g, wk[i + 1]);
+                SHA256_ROUND(g, h, a, b, c, d, e, f, wk[i + 2]);
+                SHA256_ROUND(f, g, h, a, b, c, d, e, wk[i + 3]);
+                SHA256_ROUND(e, f, g, h, a, b, c, d, wk[i + 4]);
+                SHA256_ROUND(d, e, f, g, h, a, b, c, wk[i + 5]);
+                SHA256_ROUND(c, d, e, f, g, h, a, b, wk[i + 6]);
+                SHA256_ROUND(b, c, d, e, f, g, h, a, wk[i + 7]);
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static void
+sha256_blocks_c(uint32_t *state, const uint8_t *data, size_t nblocks)
+{
+        uint32_t w[64], wk[64], s0, s1;
+        int i;
+
+        while (nblocks--) {
+                for (i = 0; i < 16; i++) {
+                        memcpy(&w[i], &data[4 * i], sizeof(w[i]));
+                        w[i] = be32toh(w[i]);
+                }
+                for (i = 16; i < 64; i++) {
+                        s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^
+                                (w[i - 15] >> 3);
+                        s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^
+                                (w[i - 2] >> 10);
+                        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+                }
+                for (i = 0; i < 64; i++)
+                        wk[i] = w[i] + sha256_k[i];
+                sha256_rounds(state, wk);
+                data += SHA256_BLOCK_SIZE;
+        }
+}
+
+#ifdef SHA256_X86
+/* x86 SHA extensions.
+ * The state is kept as ABEF and CDGH, which is what sha256rnds2 wants.
+ * Each step does four rounds and schedules four words ahead.
+ */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void
+sha256_blocks_shani(uint32_t *state, const uint8_t *data, size_t nblocks)
+{
+        const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                             0x0405060700010203ULL);
+        __m128i state0, state1, abef, cdgh, tmp, msg, x[4];
+        int i;
+
+        tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+        state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+        tmp = _mm_shuffle_epi32(tmp, 0xb1);                  /* CDAB */
+        state1 = _mm_shuffle_epi32(state1, 0x1b);            /* EFGH */
+        state0 = _mm_alignr_epi8(tmp, state1, 8);            /* ABEF */
+        state1 = _mm_blend_epi16(state1, tmp, 0xf0);         /* CDGH */
+
+        while (nblocks--) {
+                abef = state0;
+                cdgh = state1;
+                for (i = 0; i < 4; i++) {
+                        x[i] = _mm_loadu_si128((const __m128i *)&data[16 * i]);
+                        x[i] = _mm_shuffle_epi8(x[i], bswap);
+                }
+#pragma GCC unroll 16
+                for (i = 0; i < 16; i++) {
+                        msg = _mm_add_epi32(x[i & 3],
+                                            _mm_load_si128((const __m128i *)
+                                                           &sha256_k[4 * i]));
+                        state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+                        msg = _mm_shuffle_epi32(msg, 0x0e);
+                        state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+                        if (i >= 12)
+                                continue;
+                        /* W[t-16] + s0(W[t-15]) + W[t-7], then s1. */
+                        tmp = _mm_sha256msg1_epu32(x[i & 3], x[(i + 1) & 3]);
+                        tmp = _mm_add_epi32(tmp,
+                                            _mm_alignr_epi8(x[(i + 3) & 3],
+                                                            x[(i + 2) & 3], 4));
+                        x[i & 3] = _mm_sha256msg2_epu32(tmp, x[(i + 3) & 3]);
+                }
+                state0 = _mm_add_epi32(state0, abef);
+                state1 = _mm_add_epi32(state1, cdgh);
+                data += SHA256_BLOCK_SIZE;
+        }
+
+        tmp = _mm_shuffle_epi32(state0, 0x1b);               /* FEBA */
+        state1 = _mm_shuffle_epi32(state1, 0xb1);            /* DCHG */
+        state0 = _mm_blend_epi16(tmp, state1, 0xf0);         /* DCBA */
+        state1 = _mm_alignr_epi8(state1, tmp, 8);            /* HGFE */
+        _mm_storeu_si128((__m128i *)&state[0], state0);
+        _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+/* AVX2 message schedule.
+ * Two blocks are scheduled at once, one per 128 bit lane.
+ * Four words per step, where the last two words depend on
+ * the first two through s1. The rounds stay scalar.
+ */
+#define AVX2_ROR(x, n)                                                  \
+        _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+__attribute__((target("avx2,bmi2")))
+static inline __m256i
+sha256_avx2_s0(__m256i x)
+{
+        return _mm256_xor_si256(_mm256_xor_si256(AVX2_ROR(x, 7),
+                                                 AVX2_ROR(x, 18)),
+                                _mm256_srli_epi32(x, 3));
+}
+
+__attribute__((target("avx2,bmi2")))
+static inline __m256i
+sha256_avx2_s1(__m256i x)
+{
+        return _mm256_xor_si256(_mm256_xor_si256(AVX2_ROR(x, 17),
+                                                 AVX2_ROR(x, 19)),
+                                _mm256_srli_epi32(x, 10));
+}
+
+__attribute__((target("avx2,bmi2")))
+static void
+sha256_blocks_avx2(uint32_t *state, const uint8_t *data, size_t nblocks)
+{
+        const __m256i bswap = _mm256_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                                0x0405060700010203ULL,
+                                                0x0c0d0e0f08090a0bULL,
+                                                0x0405060700010203ULL);
+        uint32_t wk[2][64] __attribute__((aligned(32)));
+        const uint8_t *second;
+        __m256i x[4], k, t, s;
+        int i, g;
+
+        while (nblocks) {
+                /* A lone last block is scheduled twice, used once. */
+                second = nblocks > 1 ? data + SHA256_BLOCK_SIZE : data;
+#pragma GCC unroll 16
+                for (g = 0; g < 16; g++) {
+                        if (g < 4) {
+                                t = _mm256_loadu2_m128i(
+                                        (const __m128i *)&second[16 * g],
+                                        (const __m128i *)&data[16 * g]);
+                                t = _mm256_shuffle_epi8(t, bswap);
+                        } else {
+                                /* W[t-16] + s0(W[t-15]) + W[t-7] */
+                                t = _mm256_add_epi32(
+                                        x[g & 3],
+                                        sha256_avx2_s0(
+                                                _mm256_alignr_epi8(x[(g - 3) & 3],
+                                                                   x[g & 3], 4)));
+                                t = _mm256_add_epi32(
+                                        t, _mm256_alignr_epi8(x[(g - 1) & 3],
+                                                              x[(g - 2) & 3], 4));
+                                /* s1 of W[t-2], W[t-1] into words 0 and 1 */
+                                s = _mm256_shuffle_epi32(x[(g - 1) & 3], 0xee);
+                                s = sha256_avx2_s1(s);
+                                t = _mm256_add_epi32(
+                                        t, _mm256_blend_epi32(
+                                                _mm256_setzero_si256(), s, 0x33));
+                                /* s1 of the new words 0 and 1 into 2 and 3 */
+                                s = _mm256_shuffle_epi32(t, 0x44);
+                                s = sha256_avx2_s1(s);
+                                t = _mm256_add_epi32(
+                                        t, _mm256_blend_epi32(
+                                                _mm256_setzero_si256(), s, 0xcc));
+                        }
+                        x[g & 3] = t;
+                        k = _mm256_broadcastsi128_si256(
+                                _mm_load_si128((const __m128i *)
+                                               &sha256_k[4 * g]));
+                        t = _mm256_add_epi32(t, k);
+                        _mm_store_si128((__m128i *)&wk[0][4 * g],
+                                        _mm256_castsi256_si128(t));
+                        _mm_store_si128((__m128i *)&wk[1][4 * g],
+                                        _mm256_extracti128_si256(t, 1));
+                }
+                sha256_rounds(state, wk[0]);
+                data += SHA256_BLOCK_SIZE;
+                nblocks--;
+                if (nblocks) {
+                        sha256_rounds(state, wk[1]);
+                        data += SHA256_BLOCK_SIZE;
+                        nblocks--;
+                }
+        }
+        for (i = 0; i < 2; i++)
+                memset(wk[i], 0, sizeof(wk[i]));
+}
+
+static bool
+cpu_has_x86(bool *sha, bool *avx2, bool *avx512)
+{
+        unsigned int eax, ebx, ecx, edx, xcr0_lo = 0, xcr0_hi = 0;
+        bool ssse3, sse41, osxsave;
+
+        *sha = *avx2 = *avx512 = false;
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+                return false;
+        ssse3 = ecx & bit_SSSE3;
+        sse41 = ecx & bit_SSE4_1;
+        osxsave = ecx & bit_OSXSAVE;
+        if (osxsave)
+                __asm__ volatile ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi)
+                                  : "c" (0));
+        if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+                return false;
+        *sha = (ebx & bit_SHA) && ssse3 && sse41;
+        /* The OS must save the ymm state too. */
+        *avx2 = (ebx & bit_AVX2) && (ebx & bit_BMI2) &&
+                (xcr0_lo & 0x6) == 0x6;
+        /* And the opmask and zmm state for AVX-512. */
+        *avx512 = (ebx & bit_AVX512F) && (xcr0_lo & 0xe6) == 0xe6;
+
+        return true;
+}
+#endif /* SHA256_X86 */
+
+#ifdef SHA256_ARMV8
+/* ARMv8 crypto extensions.
+ * Plain ABCD and EFGH state, four rounds and four words per step.
+ */
+__attribute__((target("+crypto")))
+static void
+sha256_blocks_armv8(uint32_t *state, const uint8_t *data, size_t nblocks)
+{
+        uint32x4_t state0, state1, abcd, efgh, tmp, prev, x[4];
+        int i;
+
+        state0 = vld1q_u32(&state[0]);
+        state1 = vld1q_u32(&state[4]);
+
+        while (nblocks--) {
+                abcd = state0;
+                efgh = state1;
+                for (i = 0; i < 4; i++) {
+                        x[i] = vreinterpretq_u32_u8(
+                                vrev32q_u8(vld1q_u8(&data[16 * i])));
+                }
+#pragma GCC unroll 16
+                for (i = 0; i < 16; i++) {
+                        tmp = vaddq_u32(x[i & 3], vld1q_u32(&sha256_k[4 * i]));
+                        prev = state0;
+                        state0 = vsha256hq_u32(state0, state1, tmp);
+                        state1 = vsha256h2q_u32(state1, prev, tmp);
+                        if (i >= 12)
+                                continue;
+                        x[i & 3] = vsha256su1q_u32(
+                                vsha256su0q_u32(x[i & 3], x[(i + 1) & 3]),
+                                x[(i + 2) & 3], x[(i + 3) & 3]);
+                }
+                state0 = vaddq_u32(state0, abcd);
+                state1 = vaddq_u32(state1, efgh);
+                data += SHA256_BLOCK_SIZE;
+        }
+
+        vst1q_u32(&state[0], state0);
+        vst1q_u32(&state[4], state1);
+}
+#endif /* SHA256_ARMV8 */
+
+/* Multi-buffer kernels.
+ * One message per 32 bit vector lane, written once with GCC vector
+ * extensions and compiled per instruction set. The state is stored
+ * lane interleaved, state[word * lanes + lane]. A lane without data
+ * hashes zeros, which the caller ignores.
+ */
+typedef void (*sha256_mb_blocks_fn)(uint32_t *state, const uint8_t **data,
+                                    size_t nblocks);
+
+#define SSIG0(x)                        (ROR32(x, 7) ^ ROR32(x, 18) ^ ((x) >> 3))
+#define SSIG1(x)                        (ROR32(x, 17) ^ ROR32(x, 19) ^ ((x) >> 10))
+
+#define SHA256_MB_STEP(a, b, c, d, e, f, g, h, i)                       \
+        do {                                                            \
+                if ((i) >= 16)                                          \
+                        w[(i) & 15] += SSIG0(w[((i) + 1) & 15]) +       \
+                                w[((i) + 9) & 15] +                     \
+                                SSIG1(w[((i) + 14) & 15]);              \
+                SHA256_ROUND(a, b, c, d, e, f, g, h,                    \
+                             w[(i) & 15] + sha256_k[i]);                \
+        } while (0)
+
+#define SHA256_MB_KERNEL(fn, vec)                                       \
+static void                                                             \
+fn(uint32_t *state, const uint8_t **data, size_t nblocks)               \
+{                                                                       \
+        enum { lanes = sizeof(vec) / sizeof(uint32_t) };                \
+        uint32_t m[16 * lanes] __attribute__((aligned(sizeof(vec))));   \
+        vec s[8], w[16], a, b, c, d, e, f, g, h;                        \
+        size_t blk;                                                     \
+        int i;                                                          \
+                                                                        \
+        memcpy(s, state, sizeof(s));                                    \
+        for (blk = 0; blk < nblocks; blk++) {                           \
+                sha256_mb_load(m, lanes, data, blk);                    \
+                memcpy(w, m, sizeof(w));                                \
+                a = s[0]; b = s[1]; c = s[2]; d = s[3];                 \
+                e = s[4]; f = s[5]; g = s[6]; h = s[7];                 \
+                for (i = 0; i < 64; i += 8) {                           \
+                        SHA256_MB_STEP(a, b, c, d, e, f, g, h, i + 0);  \
+                        SHA256_MB_STEP(h, a, b, c, d, e, f, g, i + 1);  \
+                        SHA256_MB_STEP(g, h, a, b, c, d, e, f, i + 2);  \
+                        SHA256_MB_STEP(f, g, h, a, b, c, d, e, i + 3);  \
+                        SHA256_MB_STEP(e, f, g, h, a, b, c, d, i + 4);  \
+                        SHA256_MB_STEP(d, e, f, g, h, a, b, c, i + 5);  \
+                        SHA256_MB_STEP(c, d, e, f, g, h, a, b, i + 6);  \
+                        SHA256_MB_STEP(b, c, d, e, f, g, h, a, i + 7);  \
+                }                                                       \
+                s[0] += a; s[1] += b; s[2] += c; s[3] += d;             \
+                s[4] += e; s[5] += f; s[6] += g; s[7] += h;             \
+        }                                                               \
+        memcpy(state, s, sizeof(s));                                    \
+}
+
+/* Gather block blk of every lane, word major, byte swapped. */
+static inline void
+sha256_mb_load(uint32_t *m, size_t lanes, const uint8_t **data, size_t blk)
+{
+        const uint8_t *p;
+        uint32_t v;
+        size_t l;
+        int i;
+
+        for (l = 0; l < lanes; l++) {
+                if (!(p = data[l])) {
+                        for (i = 0; i < 16; i++)
+                                m[i * lanes + l] = 0;
+                        continue;
+                }
+                p += blk * SHA256_BLOCK_SIZE;
+                for (i = 0; i < 16; i++) {
+                        memcpy(&v, &p[4 * i], sizeof(v));
+                        m[i * lanes + l] = be32toh(v);
+                }
+        }
+}
+
+#if defined(__x86_64__) || defined(__aarch64__)
+/* SSE2 and NEON are always there. */
+typedef uint32_t v4u32 __attribute__((vector_size(16)));
+SHA256_MB_KERNEL(sha256_mb_blocks_x4, v4u32)
+#endif
+
+#ifdef SHA256_X86
+typedef uint32_t v8u32 __attribute__((vector_size(32)));
+typedef uint32_t v16u32 __attribute__((vector_size(64)));
+__attribute__((target("avx2")))
+SHA256_MB_KERNEL(sha256_mb_blocks_avx2, v8u32)
+__attribute__((target("avx512f")))
+SHA256_MB_KERNEL(sha256_mb_blocks_avx512, v16u32)
+#endif
+
+struct sha256_kernel {
+        const char *name;
+        sha256_blocks_fn blocks;
+        bool supported;
+};
+
+/* In order of preference, by measured throughput. The AVX2 schedule
+ * does not reliably beat plain C in sha256bench, somewhat slower on
+ * some runs and somewhat faster on others. So it comes after C and is
+ * only used when asked for by name, as sha256bench does.
+ */
+static struct sha256_kernel sha256_kernels[] = {
+#ifdef SHA256_X86
+        { "shani", sha256_blocks_shani, false },
+#endif
+#ifdef SHA256_ARMV8
+        { "armv8", sha256_blocks_armv8, false },
+#endif
+        { "c", sha256_blocks_c, true },
+#ifdef SHA256_X86
+        { "avx2", sha256_blocks_avx2, false },
+#endif
+};
+
+#define SHA256_NKERNELS (sizeof(sha256_kernels) / sizeof(sha256_kernels[0]))
+
+struct sha256_mb_kernel {
+        const char *name;
+        unsigned int lanes;
+        sha256_mb_blocks_fn blocks;
+        bool supported;
+};
+
+/* In order of preference. none hashes one message at a time. */
+static struct sha256_mb_kernel sha256_mb_kernels[] = {
+#ifdef SHA256_X86
+        { "avx512x16", 16, sha256_mb_blocks_avx512, false },
+        { "avx2x8", 8, sha256_mb_blocks_avx2, false },
+#endif
+#if defined(__x86_64__)
+        { "sse2x4", 4, sha256_mb_blocks_x4, true },
+#elif defined(__aarch64__)
+        { "neonx4", 4, sha256_mb_blocks_x4, true },
+#endif
+        { "none", 1, NULL, true },
+};
+
+#define SHA256_MB_NKERNELS (sizeof(sha256_mb_kernels) / sizeof(sha256_mb_kernels[0]))
+
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+static const struct sha256_kernel *sha256_active;
+static const struct sha256_mb_kernel *sha256_mb_active;
+
+static void sha256_mb_probe(void);
+
+/* Known answers, FIPS 180-2 examples.
+ * One block, an empty message, and a message padded to two blocks,
+ * which exercises the two block path of the AVX2 schedule.
+ */
+static const struct {
+        const char *msg;
+        uint8_t md[SHA256_HASH_SIZE];
+} sha256_kat[] = {
+        { "abc", {
+                0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+                0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+                0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+                0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad } },
+        { "", {
+                0xe3, 0xb0, 0xc4, 0x42, 0x98, 0xfc, 0x1c, 0x14,
+                0x9a, 0xfb, 0xf4, 0xc8, 0x99, 0x6f, 0xb9, 0x24,
+                0x27, 0xae, 0x41, 0xe4, 0x64, 0x9b, 0x93, 0x4c,
+                0xa4, 0x95, 0x99, 0x1b, 0x78, 0x52, 0xb8, 0x55 } },
+        { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", {
+                0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8,
+                0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39,
+                0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67,
+                0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1 } },
+        { "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+          "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu", {
+                0xcf, 0x5b, 0x16, 0xa7, 0x78, 0xaf, 0x83, 0x80,
+                0x03, 0x6c, 0xe5, 0x9e, 0x7b, 0x04, 0x92, 0x37,
+                0x0b, 0x24, 0x9b, 0x11, 0xe8, 0xf0, 0x7a, 0x51,
+                0xaf, 0xac, 0x45, 0x03, 0x7a, 0xfe, 0xe9, 0xd1 } },
+};
+
+static void sha256_final_with(struct sha256_ctx *ctx, uint8_t *md,
+                              sha256_blocks_fn blocks);
+static void sha256_update_with(struct sha256_ctx *ctx, const void *data,
+                               size_t len, sha256_blocks_fn blocks);
+
+static bool
+sha256_selftest(sha256_blocks_fn blocks)
+{
+        struct sha256_ctx ctx;
+        uint8_t md[SHA256_HASH_SIZE];
+        size_t i;
+
+        for (i = 0; i < sizeof(sha256_kat) / sizeof(sha256_kat[0]); i++) {
+                sha256_init(&ctx);
+                sha256_update_with(&ctx, sha256_kat[i].msg,
+                                   strlen(sha256_kat[i].msg), blocks);
+                sha256_final_with(&ctx, md, blocks);
+                if (memcmp(md, sha256_kat[i].md, sizeof(md)))
+                        return false;
+        }
+
+        return true;
+}
+
+static void
+sha256_probe(void)
+{
+        size_t i;
+#ifdef SHA256_X86
+        bool sha, avx2, avx512;
+
+        if (cpu_has_x86(&sha, &avx2, &avx512)) {
+                for (i = 0; i < SHA256_NKERNELS; i++) {
+                        if (!strcmp(sha256_kernels[i].name, "shani"))
+                                sha256_kernels[i].supported = sha;
+                        if (!strcmp(sha256_kernels[i].name, "avx2"))
+                                sha256_kernels[i].supported = avx2;
+                }
+                for (i = 0; i < SHA256_MB_NKERNELS; i++) {
+                        if (!strcmp(sha256_mb_kernels[i].name, "avx2x8"))
+                                sha256_mb_kernels[i].supported = avx2;
+                        if (!strcmp(sha256_mb_kernels[i].name, "avx512x16"))
+                                sha256_mb_kernels[i].supported = avx512;
+                }
+        }
+#endif
+#ifdef SHA256_ARMV8
+        for (i = 0; i < SHA256_NKERNELS; i++) {
+                if (!strcmp(sha256_kernels[i].name, "armv8"))
+                        sha256_kernels[i].supported =
+                                getauxval(AT_HWCAP) & HWCAP_SHA2;
+        }
+#endif
+        for (i = 0; i < SHA256_NKERNELS; i++) {
+                if (!sha256_kernels[i].supported)
+                        continue;
+                if (!sha256_selftest(sha256_kernels[i].blocks)) {
+                        fprintf(stderr,
+                                "Warn: sha256 %s kernel failed self test.\n",
+                                sha256_kernels[i].name);
+                        sha256_kernels[i].supported = false;
+                        continue;
+                }
+                if (!sha256_active)
+                        sha256_active = &sha256_kernels[i];
+        }
+        sha256_mb_probe();
+}
+
+static sha256_blocks_fn
+sha256_blocks(void)
+{
+        pthread_once(&sha256_once, sha256_probe);
+
+        return sha256_active->blocks;
+}
+
+/* Name of the kernel in use. */
+const char *
+sha256_kernel(void)
+{
+        sha256_blocks();
+
+        return sha256_active->name;
+}
+
+/* Names of the usable kernels, in order of preference.
+ * NULL past the last one.
+ */
+const char *
+sha256_kernel_list(unsigned int i)
+{
+        size_t n;
+
+        sha256_blocks();
+        for (n = 0; n < SHA256_NKERNELS; n++) {
+                if (!sha256_kernels[n].supported)
+                        continue;
+                if (!i--)
+                        return sha256_kernels[n].name;
+        }
+
+        return NULL;
+}
+
+/* Force a kernel. Not thread safe against running hashes.
+ * Returns -1 if the kernel is unknown or unusable here.
+ */
+int
+sha256_set_kernel(const char *name)
+{
+        size_t i;
+
+        sha256_blocks();
+        for (i = 0; i < SHA256_NKERNELS; i++) {
+                if (!strcmp(sha256_kernels[i].name, name) &&
+                    sha256_kernels[i].supported) {
+                        sha256_active = &sha256_kernels[i];
+                        return 0;
+                }
+        }
+
+        return -1;
+}
+
+void
+sha256_init(struct sha256_ctx *ctx)
+{
+        memcpy(ctx->state, sha256_h0, sizeof(ctx->state));
+        ctx->count = 0;
+}
+
+static void
+sha256_update_with(struct sha256_ctx *ctx, const void *data, size_t len,
+                   sha256_blocks_fn blocks)
+{
+        const uint8_t *p = data;
+        size_t fill = ctx->count % SHA256_BLOCK_SIZE, n;
+
+        ctx->count += len;
+        if (fill) {
+                n = SHA256_BLOCK_SIZE - fill < len ?
+                        SHA256_BLOCK_SIZE - fill : len;
+                memcpy(&ctx->buf[fill], p, n);
+                p += n;
+                len -= n;
+                if (fill + n < SHA256_BLOCK_SIZE)
+                        return;
+                blocks(ctx->state, ctx->buf, 1);
+        }
+        if ((n = len / SHA256_BLOCK_SIZE)) {
+                blocks(ctx->state, p, n);
+                p += n * SHA256_BLOCK_SIZE;
+                len -= n * SHA256_BLOCK_SIZE;
+        }
+        if (len)
+                memcpy(ctx->buf, p, len);
+}
+
+static void
+sha256_final_with(struct sha256_ctx *ctx, uint8_t *md, sha256_blocks_fn blocks)
+{
+        size_t fill = ctx->count % SHA256_BLOCK_SIZE;
+        uint64_t bits = htobe64(ctx->count * 8);
+        uint32_t v;
+        int i;
+
+        ctx->buf[fill++] = 0x80;
+        if (fill > SHA256_BLOCK_SIZE - sizeof(bits)) {
+                memset(&ctx->buf[fill], 0, SHA256_BLOCK_SIZE - fill);
+                blocks(ctx->state, ctx->buf, 1);
+                fill = 0;
+        }
+        memset(&ctx->buf[fill], 0, SHA256_BLOCK_SIZE - sizeof(bits) - fill);
+        memcpy(&ctx->buf[SHA256_BLOCK_SIZE - sizeof(bits)], &bits,
+               sizeof(bits));
+        blocks(ctx->state, ctx->buf, 1);
+        for (i = 0; i < 8; i++) {
+                v = htobe32(ctx->state[i]);
+                memcpy(&md[4 * i], &v, sizeof(v));
+        }
+        memset(ctx, 0, sizeof(*ctx));
+}
+
+void
+sha256_update(struct sha256_ctx *ctx, const void *data, size_t len)
+{
+        sha256_update_with(ctx, data, len, sha256_blocks());
+}
+
+void
+sha256_final(struct sha256_ctx *ctx, uint8_t *md)
+{
+        sha256_final_with(ctx, md, sha256_blocks());
+}
+
+/* Sum of all bytes, modulo 2^32. */
+static uint32_t
+bytesum(const uint8_t *p, size_t len)
+{
+        uint32_t sum = 0;
+#ifdef __SSE2__
+        __m128i acc = _mm_setzero_si128(), zero = _mm_setzero_si128();
+
+        for (; len >= 16; p += 16, len -= 16) {
+                acc = _mm_add_epi64(acc, _mm_sad_epu8(
+                                            _mm_loadu_si128((const __m128i *)p),
+                                            zero));
+        }
+        sum = _mm_cvtsi128_si32(acc) +
+                _mm_cvtsi128_si32(_mm_unpackhi_epi64(acc, acc));
+#endif
+        while (len--)
+                sum += *p++;
+
+        return sum;
+}
+
+/* Hash data and add the sum of its bytes to sum. */
+void
+sha256_update_sum(struct sha256_ctx *ctx, const void *data, size_t len,
+                  uint32_t *sum)
+{
+        sha256_blocks_fn blocks = sha256_blocks();
+        const uint8_t *p = data;
+        size_t n;
+
+        for (; len; p += n, len -= n) {
+                n = len < SHA256_SUM_CHUNK ? len : SHA256_SUM_CHUNK;
+                sha256_update_with(ctx, p, n, blocks);
+                *sum += bytesum(p, n);
+        }
+}
+
+void
+sha256(const void *data, size_t len, uint8_t *md)
+{
+        struct sha256_ctx ctx;
+
+        sha256_init(&ctx);
+        sha256_update(&ctx, data, len);
+        sha256_final(&ctx, md);
+}
+
+/* Sum the part of [from, to) of the data that is in its sum range. */
+static void
+sha256_mb_sum(struct sha256_mb_job *job, size_t from, size_t to)
+{
+        size_t end = job->sum_off + job->sum_len;
+
+        from = from > job->sum_off ? from : job->sum_off;
+        to = to < end ? to : end;
+        if (from < to)
+                job->sum += bytesum((const uint8_t *)job->data + from,
+                                    to - from);
+}
+
+/* Start a message. The head, and as much data as it takes to get
+ * back to a block boundary, go through the single buffer kernel.
+ * Returns the number of data bytes hashed.
+ */
+static size_t
+sha256_mb_start(struct sha256_mb_job *job, struct sha256_ctx *ctx,
+                sha256_blocks_fn blocks)
+{
+        size_t skip;
+
+        sha256_init(ctx);
+        job->sum = 0;
+        if (!job->head_len)
+                return 0;
+        sha256_update_with(ctx, job->head, job->head_len, blocks);
+        skip = (SHA256_BLOCK_SIZE - job->head_len % SHA256_BLOCK_SIZE) %
+                SHA256_BLOCK_SIZE;
+        skip = skip < job->len ? skip : job->len;
+        sha256_update_with(ctx, job->data, skip, blocks);
+        sha256_mb_sum(job, 0, skip);
+
+        return skip;
+}
+
+/* Hash the data of a message from done on, and finish it. */
+static void
+sha256_mb_finish(struct sha256_mb_job *job, struct sha256_ctx *ctx,
+                 size_t done, sha256_blocks_fn blocks)
+{
+        size_t n;
+
+        for (; done < job->len; done += n) {
+                n = job->len - done < SHA256_SUM_CHUNK ?
+                        job->len - done : SHA256_SUM_CHUNK;
+                sha256_update_with(ctx, (const uint8_t *)job->data + done,
+                                   n, blocks);
+                sha256_mb_sum(job, done, done + n);
+        }
+        sha256_final_with(ctx, job->md, blocks);
+}
+
+/* Lane scheduler.
+ * Every lane takes the next message from the queue as soon as its
+ * previous one has no full blocks left. All lanes advance together
+ * by the smallest number of full blocks any of them has left.
+ * Heads, tails, padding, and the last few messages once the queue
+ * is empty, go through the single buffer kernel. Steps are capped,
+ * so that the byte sums run over data the step just brought into cache.
+ */
+static void
+sha256_mb_run(const struct sha256_mb_kernel *k, sha256_blocks_fn blocks,
+              struct sha256_mb_job *jobs, size_t njobs)
+{
+        uint32_t state[8 * SHA256_MB_MAX_LANES] __attribute__((aligned(64)));
+        const uint8_t *data[SHA256_MB_MAX_LANES] = { NULL };
+        struct sha256_mb_job *lane[SHA256_MB_MAX_LANES] = { NULL };
+        size_t left[SHA256_MB_MAX_LANES] = { 0 };
+        struct sha256_mb_job *job;
+        struct sha256_ctx ctx;
+        size_t next = 0, n, done;
+        unsigned int l, active;
+        int i;
+
+        if (!k->blocks) {
+                for (next = 0; next < njobs; next++) {
+                        done = sha256_mb_start(&jobs[next], &ctx, blocks);
+                        sha256_mb_finish(&jobs[next], &ctx, done, blocks);
+                }
+                return;
+        }
+
+        while (1) {
+                active = 0;
+                n = SIZE_MAX;
+                for (l = 0; l < k->lanes; l++) {
+                        while (!lane[l] && next < njobs) {
+                                job = &jobs[next++];
+                                done = sha256_mb_start(job, &ctx, blocks);
+                                if (job->len - done < SHA256_BLOCK_SIZE) {
+                                        sha256_mb_finish(job, &ctx, done,
+                                                         blocks);
+                                        continue;
+                                }
+                                lane[l] = job;
+                                data[l] = (const uint8_t *)job->data + done;
+                                left[l] = (job->len - done) / SHA256_BLOCK_SIZE;
+                                for (i = 0; i < 8; i++)
+                                        state[i * k->lanes + l] = ctx.state[i];
+                        }
+                        if (!lane[l])
+                                continue;
+                        active++;
+                        n = left[l] < n ? left[l] : n;
+                }
+                if (!active)
+                        break;
+                /* Few messages left. A vector step costs the same
+                 * with one lane busy as with all of them.
+                 */
+                if (next == njobs && active * 4 <= k->lanes)
+                        n = 0;
+                if (n > SHA256_MB_CHUNK)
+                        n = SHA256_MB_CHUNK;
+                if (n)
+                        k->blocks(state, data, n);
+                for (l = 0; l < k->lanes; l++) {
+                        if (!(job = lane[l]))
+                                continue;
+                        done = data[l] - (const uint8_t *)job->data;
+                        sha256_mb_sum(job, done, done + n * SHA256_BLOCK_SIZE);
+                        done += n * SHA256_BLOCK_SIZE;
+                        data[l] += n * SHA256_BLOCK_SIZE;
+                        left[l] -= n;
+                        if (left[l] && n)
+                                continue;
+                        for (i = 0; i < 8; i++)
+                                ctx.state[i] = state[i * k->lanes + l];
+                        ctx.count = job->head_len + done;
+                        sha256_mb_finish(job, &ctx, done, blocks);
+                        lane[l] = NULL;
+                        data[l] = NULL;
+                }
+        }
+}
+
+/* Messages of assorted lengths, checked against the single buffer
+ * kernel, which passed the known answer test already.
+ */
+static bool
+sha256_mb_selftest(const struct sha256_mb_kernel *k)
+{
+        struct sha256_mb_job jobs[2 * SHA256_MB_MAX_LANES + 3];
+        uint8_t buf[16 * SHA256_BLOCK_SIZE], md[SHA256_HASH_SIZE];
+        struct sha256_ctx ctx;
+        size_t i, njobs = sizeof(jobs) / sizeof(jobs[0]);
+
+        for (i = 0; i < sizeof(buf); i++)
+                buf[i] = i * 7 + (i >> 5);
+        for (i = 0; i < njobs; i++) {
+                jobs[i].head = &buf[sizeof(buf) - 1 - i];
+                jobs[i].head_len = i % 2 ? i : 0;
+                jobs[i].data = &buf[i];
+                jobs[i].len = (i * 173) % (sizeof(buf) - 2 * njobs);
+                jobs[i].sum_off = i * 11 % (jobs[i].len + 1);
+                jobs[i].sum_len = (jobs[i].len - jobs[i].sum_off) / (1 + i % 3);
+        }
+        sha256_mb_run(k, sha256_active->blocks, jobs, njobs);
+        for (i = 0; i < njobs; i++) {
+                sha256_init(&ctx);
+                sha256_update_with(&ctx, jobs[i].head, jobs[i].head_len,
+                                   sha256_active->blocks);
+                sha256_update_with(&ctx, jobs[i].data, jobs[i].len,
+                                   sha256_active->blocks);
+                sha256_final_with(&ctx, md, sha256_active->blocks);
+                if (memcmp(md, jobs[i].md, sizeof(md)) ||
+                    bytesum(&buf[i + jobs[i].sum_off], jobs[i].sum_len) !=
+                    jobs[i].sum)
+                        return false;
+        }
+
+        return true;
+}
+
+/* Runs from sha256_probe, after the single buffer kernel is chosen.
+ * Multi-buffer is only preferred when each lane is at least as fast
+ * as the hashing instructions would be on their own. Those outrun
+ * anything narrower than 16 lanes.
+ */
+static void
+sha256_mb_probe(void)
+{
+        bool hw = !strcmp(sha256_active->name, "shani") ||
+                !strcmp(sha256_active->name, "armv8");
+        size_t i;
+
+        for (i = 0; i < SHA256_MB_NKERNELS; i++) {
+                if (!sha256_mb_kernels[i].supported)
+                        continue;
+                if (!sha256_mb_selftest(&sha256_mb_kernels[i])) {
+                        fprintf(stderr,
+                                "Warn: sha256 %s kernel failed self test.\n",
+                                sha256_mb_kernels[i].name);
+                        sha256_mb_kernels[i].supported = false;
+                        continue;
+                }
+                if (hw && sha256_mb_kernels[i].blocks &&
+                    sha256_mb_kernels[i].lanes < SHA256_MB_MAX_LANES)
+                        continue;
+                if (!sha256_mb_active)
+                        sha256_mb_active = &sha256_mb_kernels[i];
+        }
+}
+
+/* Hash njobs independent messages, several at once. */
+void
+sha256_mb(struct sha256_mb_job *jobs, size_t njobs)
+{
+        sha256_blocks_fn blocks = sha256_blocks();
+
+        sha256_mb_run(sha256_mb_active, blocks, jobs, njobs);
+}
+
+/* Messages hashed at once by sha256_mb. 1 without multi-buffer. */
+unsigned int
+sha256_mb_lanes(void)
+{
+        sha256_blocks();
+
+        return sha256_mb_active->lanes;
+}
+
+const char *
+sha256_mb_kernel(void)
+{
+        sha256_blocks();
+
+        return sha256_mb_active->name;
+}
+
+const char *
+sha256_mb_kernel_list(unsigned int i)
+{
+        size_t n;
+
+        sha256_blocks();
+        for (n = 0; n < SHA256_MB_NKERNELS; n++) {
+                if (!sha256_mb_kernels[n].supported)
+                        continue;
+                if (!i--)
+                        return sha256_mb_kernels[n].name;
+        }
+
+        return NULL;
+}
+
+/* Force a multi-buffer kernel, or none. Not thread safe. */
+int
+sha256_set_mb_kernel(const char *name)
+{
+        size_t i;
+
+        sha256_blocks();
+        for (i = 0; i < SHA256_MB_NKERNELS; i++) {
+                if (!strcmp(sha256_mb_kernels[i].name, name) &&
+                    sha256_mb_kernels[i].supported) {
+                        sha256_mb_active = &sha256_mb_kernels[i];
+                        return 0;
+                }
+        }
+
+        return -1;
+}
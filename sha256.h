@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: GPL-2.0+ OR BSD-3-Clause
+/*
+ * Copyright (C) 2022, Christian Melki
+ *
+ * SHA-256 with runtime selected kernels.
+ */
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_BLOCK_SIZE               64
+#define SHA256_HASH_SIZE                32
+#define SHA256_MB_MAX_LANES             16
+
+struct sha256_ctx {
+        uint32_t state[8];
+        uint64_t count;
+        uint8_t buf[SHA256_BLOCK_SIZE];
+};
+
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(struct sha256_ctx *ctx, uint8_t *md);
+void sha256(const void *data, size_t len, uint8_t *md);
+void sha256_update_sum(struct sha256_ctx *ctx, const void *data, size_t len,
+                       uint32_t *sum);
+
+const char *sha256_kernel(void);
+int sha256_set_kernel(const char *name);
+const char *sha256_kernel_list(unsigned int i);
+
+/* Multi-buffer. Independent messages hashed side by side.
+ * A message is head followed by data. The bytes of
+ * [sum_off, sum_off + sum_len) of data are summed into sum along the way.
+ */
+struct sha256_mb_job {
+        const void *head;
+        size_t head_len;
+        const void *data;
+        size_t len;
+        size_t sum_off;
+        size_t sum_len;
+        uint32_t sum;
+        uint8_t md[SHA256_HASH_SIZE];
+};
+
+void sha256_mb(struct sha256_mb_job *jobs, size_t njobs);
+unsigned int sha256_mb_lanes(void);
+const char *sha256_mb_kernel(void);
+int sha256_set_mb_kernel(const char *name);
+const char *sha256_mb_kernel_list(unsigned int i);
+
+#endif /* SHA256_H */
@@ -0,0 +1,279 @@
+// SPDX-License-Identifier: GPL-2.0+ OR BSD-3-Clause
+/*
+ * Copyright (C) 2022, Christian Melki
+ *
+ * SHA-256 kernel benchmark.
+ * Checks every usable kernel of the internal engine against OpenSSL,
+ * on odd lengths and on split updates, then times each of them and
+ * OpenSSL over the same buffer. Multi-buffer kernels are checked
+ * and timed on as many messages of the same size.
+ * One line of key=value pairs per implementation and size on stdout.
+ */
+
+#define _DEFAULT_SOURCE
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <time.h>
+
+/* Usage of deprecated functions.
+ * Want this to build with older openssl.
+ */
+#define OPENSSL_API_COMPAT 0x10101000L
+#include <openssl/sha.h>
+
+#include "config.h"
+#include "sha256.h"
+
+#define BENCH_MIN_NS                    200000000ULL
+/* Messages per multi-buffer call. As many as the widest kernel has lanes. */
+#define BENCH_MB_MSGS                   16
+
+static void
+usage(char *argv[])
+{
+        printf("%s usage:\n", argv[0]);
+        printf("---------------------\n");
+        printf("%s [--size <bytes>[K|M]] ...\n", argv[0]);
+        printf("where:\n");
+        printf("--size        ; Not mandatory. Buffer size to time. May be repeated.\n");
+        printf("              ; Defaults to 64, 4K, 64K and 1M.\n");
+        printf("--help        ; This help.\n");
+}
+
+static size_t
+parse_size(const char *arg)
+{
+        char *end;
+        size_t size;
+
+        size = strtoul(arg, &end, 0);
+        switch (*end) {
+        case 'M': size <<= 10; /* fallthrough */
+        case 'K': size <<= 10; end++; break;
+        default: break;
+        }
+
+        return *end ? 0 : size;
+}
+
+static uint64_t
+now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Every length up to a few blocks, fed in uneven pieces. */
+static bool
+check_kernel(const uint8_t *buf, size_t len)
+{
+        struct sha256_ctx ctx;
+        uint8_t md[SHA256_HASH_SIZE], ref[SHA256_DIGEST_LENGTH];
+        size_t n, off, step;
+
+        for (n = 0; n <= len; n++) {
+                SHA256(buf, n, ref);
+                sha256(buf, n, md);
+                if (memcmp(md, ref, sizeof(md)))
+                        return false;
+                for (step = 1; step < 2 * SHA256_BLOCK_SIZE; step += 7) {
+                        sha256_init(&ctx);
+                        for (off = 0; off < n; off += step)
+                                sha256_update(&ctx, &buf[off],
+                                              n - off < step ? n - off : step);
+                        sha256_final(&ctx, md);
+                        if (memcmp(md, ref, sizeof(md)))
+                                return false;
+                }
+        }
+
+        return true;
+}
+
+/* Messages of every length up to len, several per call. */
+static bool
+check_mb_kernel(const uint8_t *buf, size_t len)
+{
+        struct sha256_mb_job jobs[BENCH_MB_MSGS];
+        uint8_t ref[SHA256_DIGEST_LENGTH];
+        SHA256_CTX sha;
+        size_t n, i;
+
+        for (n = 0; n <= len; n++) {
+                for (i = 0; i < BENCH_MB_MSGS; i++) {
+                        jobs[i].data = &buf[i];
+                        jobs[i].len = (n + i * 61) % (len + 1);
+                        jobs[i].head_len = i % 3 ? 3 * i : 0;
+                        jobs[i].head = &buf[len + 1];
+                        jobs[i].sum_off = 0;
+                        jobs[i].sum_len = 0;
+                }
+                sha256_mb(jobs, BENCH_MB_MSGS);
+                for (i = 0; i < BENCH_MB_MSGS; i++) {
+                        SHA256_Init(&sha);
+                        SHA256_Update(&sha, jobs[i].head, jobs[i].head_len);
+                        SHA256_Update(&sha, jobs[i].data, jobs[i].len);
+                        SHA256_Final(ref, &sha);
+                        if (memcmp(jobs[i].md, ref, sizeof(ref)))
+                                return false;
+                }
+        }
+
+        return true;
+}
+
+static void
+bench_mb(const char *impl, const uint8_t *buf, size_t len)
+{
+        struct sha256_mb_job jobs[BENCH_MB_MSGS];
+        uint64_t start, ns, iters = 0;
+        size_t i;
+
+        for (i = 0; i < BENCH_MB_MSGS; i++) {
+                jobs[i].data = &buf[i * len];
+                jobs[i].len = len;
+                jobs[i].head_len = 0;
+                jobs[i].sum_off = 0;
+                jobs[i].sum_len = 0;
+        }
+        start = now_ns();
+        do {
+                sha256_mb(jobs, BENCH_MB_MSGS);
+                iters++;
+        } while ((ns = now_ns() - start) < BENCH_MIN_NS);
+
+        printf("impl=mb-%s size=%zu iterations=%" PRIu64 " mb_per_s=%.1f\n",
+               impl, len, iters,
+               (double)len * BENCH_MB_MSGS * iters * 1e3 / ns);
+}
+
+static void
+bench(const char *impl, const uint8_t *buf, size_t len)
+{
+        uint8_t md[SHA256_HASH_SIZE];
+        uint64_t start, ns, iters = 0;
+        bool openssl = !strcmp(impl, "openssl");
+
+        start = now_ns();
+        do {
+                if (openssl)
+                        SHA256(buf, len, md);
+                else
+                        sha256(buf, len, md);
+                iters++;
+        } while ((ns = now_ns() - start) < BENCH_MIN_NS);
+
+        printf("impl=%s size=%zu iterations=%" PRIu64 " mb_per_s=%.1f\n",
+               impl, len, iters,
+               (double)len * iters * 1e3 / ns);
+}
+
+int
+main(int argc, char *argv[])
+{
+        size_t defsizes[] = { 64, 4096, 65536, 1024 * 1024 };
+        size_t ndefsizes = sizeof(defsizes) / sizeof(defsizes[0]);
+        size_t *sizes = NULL, nsizes = 0, max = 0, i;
+        const char *name;
+        uint8_t *buf = NULL;
+        unsigned int k;
+        int c;
+
+        static struct option options[] = {
+                {"size", required_argument, 0, 'n'},
+                {"help", no_argument, 0, 'h'},
+                {0, 0, 0, 0}
+        };
+
+        /* Room for every --size, or the defaults. */
+        if (!(sizes = calloc(argc + ndefsizes, sizeof(*sizes)))) {
+                fprintf(stderr, "Unable to allocate sizes.\n");
+                goto err_out;
+        }
+        while (1) {
+                c = getopt_long(argc, argv, "n:h", options, NULL);
+                if (c == -1)
+                        break;
+                switch (c) {
+                case 'n':
+                        if (!(sizes[nsizes++] = parse_size(optarg))) {
+                                fprintf(stderr, "%s: Invalid size.\n", argv[0]);
+                                goto err_out;
+                        }
+                        break;
+                case 'h':
+                        usage(argv);
+                        goto err_out;
+                default:
+                        fprintf(stderr, "%s: unknown option\n", argv[0]);
+                        usage(argv);
+                        goto err_out;
+                }
+        }
+        if (!nsizes) {
+                nsizes = ndefsizes;
+                memcpy(sizes, defsizes, sizeof(defsizes));
+        }
+        for (i = 0; i < nsizes; i++)
+                max = sizes[i] > max ? sizes[i] : max;
+        if (max < 4 * SHA256_BLOCK_SIZE)
+                max = 4 * SHA256_BLOCK_SIZE;
+
+        max *= BENCH_MB_MSGS;
+        if (!(buf = malloc(max))) {
+                fprintf(stderr, "Unable to allocate buffer.\n");
+                goto err_out;
+        }
+        for (i = 0; i < max; i++)
+                buf[i] = i * 131 + (i >> 8);
+
+        printf("# default=%s mb_default=%s\n", sha256_kernel(),
+               sha256_mb_kernel());
+        for (k = 0; (name = sha256_kernel_list(k)); k++) {
+                sha256_set_kernel(name);
+                if (!check_kernel(buf, 4 * SHA256_BLOCK_SIZE)) {
+                        fprintf(stderr, "sha256 %s kernel differs from openssl.\n",
+                                name);
+                        goto err_out;
+                }
+        }
+        sha256_set_kernel(sha256_kernel_list(0));
+        for (k = 0; (name = sha256_mb_kernel_list(k)); k++) {
+                sha256_set_mb_kernel(name);
+                if (!check_mb_kernel(buf, 4 * SHA256_BLOCK_SIZE)) {
+                        fprintf(stderr, "sha256 %s kernel differs from openssl.\n",
+                                name);
+                        goto err_out;
+                }
+        }
+        for (i = 0; i < nsizes; i++) {
+                bench("openssl", buf, sizes[i]);
+                for (k = 0; (name = sha256_kernel_list(k)); k++) {
+                        sha256_set_kernel(name);
+                        bench(name, buf, sizes[i]);
+                }
+                sha256_set_kernel(sha256_kernel_list(0));
+                for (k = 0; (name = sha256_mb_kernel_list(k)); k++) {
+                        sha256_set_mb_kernel(name);
+                        bench_mb(name, buf, sizes[i]);
+                }
+        }
+
+        free(buf);
+        free(sizes);
+        exit(EXIT_SUCCESS);
+
+ err_out:
+        if (buf) free(buf);
+        if (sizes) free(sizes);
+        exit(EXIT_FAILURE);
+}
@@ -4,8 +4,6 @@
 REQ_PROGRAM_LIST=(
     "getopt"
     "stm32mp1sign"
-    "cert_create"
-    "fiptool"
 )
 
 ARGUMENT_LIST=(
@@ -14,6 +12,8 @@ ARGUMENT_LIST=(
     "fsbl:"
     "fip:"
     "outdir:"
+    "keydir:"
+    "incremental"
     "help"
 )
 
@@ -49,6 +49,8 @@ usage ()
     echo "fsbl			: Path to first stage bootloader (fsbl). Usually provided by BL2 (Trusted Firmware) as a stm32 header wrapped binary"
     echo "fip			: Path to the Firmware Image Package (FIP)"
     echo "outdir		: Path to the output directory"
+    echo "keydir		: Optional. Directory keeping the trusted world, non-trusted world and content keys between runs. Keys made in a run are added there"
+    echo "incremental		: Optional. Keep the certs of the fip that still match their keys and binaries. With keydir, a new nt-fw only changes nt-fw-cert"
     exit 1;
 }
 
@@ -83,6 +85,7 @@ ROT_KEY_PWD=""
 FSBL=""
 FIP=""
 OUTDIR=""
+FIP_HANDLING=""
 
 while [[ $# -gt 0 ]]; do
     case "$1" in
@@ -129,6 +132,19 @@ while [[ $# -gt 0 ]]; do
 	    echo "outdir: ${OUTDIR}"
 	    shift 2
 	    ;;
+	--keydir)
+	    if [ ! -d "$2" ]; then
+		echo "keydir: Unable to find or use directory"
+		exit 1
+	    fi
+	    FIP_HANDLING="${FIP_HANDLING} --fip-keys $2"
+	    echo "keydir: $2"
+	    shift 2
+	    ;;
+	--incremental)
+	    FIP_HANDLING="${FIP_HANDLING} --fip-incremental"
+	    shift
+	    ;;
 	--help)
 	    usage
 	    ;;
@@ -147,100 +163,44 @@ if [ -z "${ROT_KEY}" -o -z "${FIP}" -o -z "${FSBL}" -o -z "${OUTDIR}" ]; then
     exit 1
 fi
 
-# Copy FSBL to OUTDIR. stm32mp1sign usually modifies in situ.
-cp ${FSBL} ${OUTDIR}/$(basename ${FSBL})
-FSBL=${OUTDIR}/$(basename ${FSBL})
-
-if [ ! -f ${FSBL} ]; then
-    echo "fsbl: Could not make a copy"
-    exit 1
-fi
-
 # Compound key handling
 KEY_HANDLING="--key ${ROT_KEY}"
 if [ ! -z ${ROT_KEY_PWD} ]; then
     KEY_HANDLING="${KEY_HANDLING} --password ${ROT_KEY_PWD}"
 fi
 
-# Sign FSBL
-stm32mp1sign --image ${FSBL} ${KEY_HANDLING} --sign
-
-if [ $? -ne 0 ]; then
-    echo "fsbl: ${FSBL} signing failed"
-    exit 1
-fi
+NEW_FIP=${OUTDIR}/$(basename ${FIP%.bin}_Signed.bin)
 
-# Unpack existing FIP
-fiptool unpack --force --out ${OUTDIR} ${FIP}
+# Sign FSBL into OUTDIR and create the chain of trust of the FIP in one go.
+# The ROT key signs the FSBL and the trusted key cert. The other keys are
+# new P-256 keys, or the ones in keydir, and the nonvolatile counters are zero. The FIP is unpacked,
+# new certs included, into OUTDIR. The inputs are left as is.
+stm32mp1sign --image ${FSBL} ${KEY_HANDLING} --sign --output ${OUTDIR} \
+	     --fip ${FIP} --fip-output ${NEW_FIP} --fip-unpack ${OUTDIR} \
+	     ${FIP_HANDLING}
 
 if [ $? -ne 0 ]; then
-    echo "fip: ${FIP} unpacking failed"
+    echo "fsbl: ${FSBL}, fip: ${FIP} signing failed"
     exit 1
 fi
+FSBL=${OUTDIR}/$(basename ${FSBL})
+FIP=${NEW_FIP}
 
-# Check incoming FIP constituents
-for FIP_BINARY in "${FIP_BINARY_LIST[@]}"; do
-    if [ ! -f "${OUTDIR}/${FIP_BINARY}" ]; then
-	echo "fip: Missing a needed constituent: ${OUTDIR}/${FIP_BINARY}"
-	exit 1
+# Certs are unpacked with fiptool names. Keep the cert_create ones.
+for CERT in "${FIP_CERT_LIST[@]}"; do
+    if [ -f "${OUTDIR}/${CERT%.crt}.bin" ]; then
+	mv -f ${OUTDIR}/${CERT%.crt}.bin ${OUTDIR}/${CERT}
     fi
 done
 
-# Compund key handling.
-KEY_HANDLING="--rot-key ${ROT_KEY}"
-if [ ! -z ${ROT_KEY_PWD} ]; then
-    KEY_HANDLING="${KEY_HANDLING} --rot-key-pwd ${ROT_KEY_PWD}"
-fi
-
-# Compound binary parameters and files.
-BINARY_HANDLING=""
-for FIP_BINARY in "${FIP_BINARY_LIST[@]}"; do
-    BINARY_HANDLING="${BINARY_HANDLING} --${FIP_BINARY%.bin} ${OUTDIR}/${FIP_BINARY}"
-done
-
-# Remove old certs.
-# Compund cert parameters and files.
-CERT_HANDLING=""
-for CERT in "${FIP_CERT_LIST[@]}"; do
-    rm -f ${OUTDIR}/${CERT}
-    CERT_HANDLING="${CERT_HANDLING} --${CERT%.crt} ${OUTDIR}/${CERT}"
+# Check FIP constituents and certs
+for FIP_FILE in "${FIP_BINARY_LIST[@]}" "${FIP_CERT_LIST[@]}"; do
+    if [ ! -f "${OUTDIR}/${FIP_FILE}" ]; then
+	echo "fip: Missing a needed constituent: ${OUTDIR}/${FIP_FILE}"
+	exit 1
+    fi
 done
 
-# Need fake tb-fw. FIP does not actually contain this.
-touch ${OUTDIR}/tb-fw.bin
-
-# Create certs from constituents.
-# -n, create new keys to use for the certs.
-# 0, zero out the nonvolatile counters,
-# key-alg: ecdsa
-# hash-alg: sha256
-cert_create -n \
-	    --tfw-nvctr 0 \
-	    --ntfw-nvctr 0 \
-	    --key-alg ecdsa \
-	    --hash-alg sha256 \
-	    ${KEY_HANDLING} \
-	    ${BINARY_HANDLING} \
-	    --tb-fw ${OUTDIR}/tb-fw.bin \
-	    ${CERT_HANDLING}
-
-if [ $? -ne 0 ]; then
-    echo "cert_create, new certs failed"
-    exit 1
-fi
-
-FIP=${OUTDIR}/$(basename ${FIP%.bin}_Signed.bin)
-# Create new fip
-fiptool create \
-	${BINARY_HANDLING} \
-	${CERT_HANDLING} \
-	${FIP}
-
-if [ $? -ne 0 ]; then
-    echo "fiptool, create failed"
-    exit 1
-fi
-
 echo ""
 echo "fsbl: ${FSBL}"
 echo "fip: ${FIP}"
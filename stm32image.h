@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: GPL-2.0+ OR BSD-3-Clause
+/*
+ * Copyright (C) 2022, Christian Melki
+ *
+ * stm32 v1 image header.
+ */
+
+#ifndef STM32IMAGE_H
+#define STM32IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HEADER_MAGIC                    "STM2"
+
+/* The CPU hashes header from offset 0x48,
+ * ie. from member header_version and all of the data.
+ */
+#define STM32_HASH_OFFSET               offsetof(struct stm32_header, header_version)
+
+/* The stm32 header is often defined to be 0x100 bytes.
+ * However, some implementations carry a padding of
+ * uint32_t x[83/4] (?!?).
+ * Other definitions do uint8_t x[83] (like this one).
+ * Also add packed, which seems to be missing in
+ * a lot of implementations in the wild.
+ */
+struct __attribute((packed)) stm32_header {
+        uint32_t magic_number;
+        uint8_t image_signature[64];
+        uint32_t image_checksum;
+        uint8_t  header_version[4];
+        uint32_t image_length;
+        uint32_t image_entry_point;
+        uint32_t reserved1;
+        uint32_t load_address;
+        uint32_t reserved2;
+        uint32_t version_number;
+        uint32_t option_flags;
+        uint32_t ecdsa_algorithm;
+        uint8_t ecdsa_public_key[64];
+        uint8_t padding[83];
+        uint8_t binary_type;
+};
+
+#endif /* STM32IMAGE_H */
@@ -0,0 +1,191 @@
+// SPDX-License-Identifier: GPL-2.0+ OR BSD-3-Clause
+/*
+ * Copyright (C) 2022, Christian Melki
+ *
+ * Synthetic stm32 image generator.
+ * Writes a valid, unsigned, stm32 v1 header followed by
+ * a pseudo random payload. Used by the benchmark suite.
+ */
+
+#define _DEFAULT_SOURCE
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <getopt.h>
+#include <endian.h>
+#include <fcntl.h>
+
+#include "config.h"
+#include "stm32image.h"
+
+#define CHUNK_SIZE                      (1024 * 1024)
+/* Anywhere in SYSRAM, like TF-A BL2. */
+#define IMAGE_LOAD_ADDRESS              0x2ffc2500
+#define IMAGE_BINARY_TYPE               0x10
+
+static void
+usage(char *argv[])
+{
+        printf("%s usage:\n", argv[0]);
+        printf("---------------------\n");
+        printf("%s --output <file> --size <bytes>[K|M|G] [--seed <n>]\n", argv[0]);
+        printf("where:\n");
+        printf("--output      ; Path to the stm32image file to create.\n");
+        printf("--size        ; Payload size, not counting the header.\n");
+        printf("--seed        ; Not mandatory. Seed for the payload generator.\n");
+        printf("--help        ; This help.\n");
+}
+
+static uint64_t
+parse_size(const char *arg)
+{
+        char *end;
+        uint64_t size;
+
+        size = strtoull(arg, &end, 0);
+        switch (*end) {
+        case 'G': size <<= 10; /* fallthrough */
+        case 'M': size <<= 10; /* fallthrough */
+        case 'K': size <<= 10; end++; break;
+        default: break;
+        }
+
+        return *end ? 0 : size;
+}
+
+/* xorshift64. Fast, and incompressible enough to defeat
+ * any filesystem or page cache shortcuts.
+ */
+static uint64_t
+next_random(uint64_t *state)
+{
+        uint64_t x = *state;
+
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+
+        return *state = x;
+}
+
+/* xorshift64 state for a seed. One splitmix64 step, a bijection, so
+ * every seed gives its own payload. Only the state 0 is not allowed.
+ */
+static uint64_t
+seed_state(uint64_t seed)
+{
+        uint64_t z = seed + 0x9e3779b97f4a7c15ULL;
+
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        z ^= z >> 31;
+
+        return z ? z : 0x9e3779b97f4a7c15ULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+        struct stm32_header h;
+        char *out_path = NULL;
+        uint8_t *buf = NULL;
+        uint64_t size = 0, seed = 0x5354324d, state, done, n, i, r;
+        uint32_t checksum = 0;
+        int c, fd = -1;
+
+        static struct option options[] = {
+                {"output", required_argument, 0, 'o'},
+                {"size", required_argument, 0, 'n'},
+                {"seed", required_argument, 0, 'r'},
+                {"help", no_argument, 0, 'h'},
+                {0, 0, 0, 0}
+        };
+
+        while (1) {
+                c = getopt_long(argc, argv, "o:n:r:h", options, NULL);
+                if (c == -1)
+                        break;
+                switch (c) {
+                case 'o':
+                        out_path = optarg;
+                        break;
+                case 'n':
+                        size = parse_size(optarg);
+                        break;
+                case 'r':
+                        seed = strtoull(optarg, NULL, 0);
+                        break;
+                case 'h':
+                        usage(argv);
+                        goto err_out;
+                default:
+                        fprintf(stderr, "%s: unknown option\n", argv[0]);
+                        usage(argv);
+                        goto err_out;
+                }
+        }
+
+        if (!out_path || !size || size > UINT32_MAX) {
+                fprintf(stderr, "%s: Missing or invalid output or size.\n",
+                        argv[0]);
+                usage(argv);
+                goto err_out;
+        }
+
+        if (!(buf = malloc(CHUNK_SIZE))) {
+                fprintf(stderr, "Unable to allocate buffer.\n");
+                goto err_out;
+        }
+        if ((fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+                fprintf(stderr, "Cannot open %s: %s\n",
+                        out_path, strerror(errno));
+                goto err_out;
+        }
+        /* Payload first, the checksum goes in the header. */
+        state = seed_state(seed);
+        for (done = 0; done < size; done += n) {
+                n = size - done < CHUNK_SIZE ? size - done : CHUNK_SIZE;
+                for (i = 0; i < n; i += sizeof(r)) {
+                        r = next_random(&state);
+                        memcpy(&buf[i], &r, n - i < sizeof(r) ?
+                               n - i : sizeof(r));
+                }
+                for (i = 0; i < n; i++)
+                        checksum += buf[i];
+                if (pwrite(fd, buf, n, sizeof(h) + done) != (ssize_t)n) {
+                        fprintf(stderr, "Unable to write payload: %s\n",
+                                strerror(errno));
+                        goto err_out;
+                }
+        }
+
+        memset(&h, 0, sizeof(h));
+        memcpy(&h.magic_number, HEADER_MAGIC, strlen(HEADER_MAGIC));
+        h.image_checksum = htole32(checksum);
+        /* Version 1.0 */
+        h.header_version[2] = 1;
+        h.image_length = htole32(size);
+        h.image_entry_point = htole32(IMAGE_LOAD_ADDRESS);
+        h.load_address = htole32(IMAGE_LOAD_ADDRESS);
+        /* Not signed */
+        h.option_flags = htole32(1);
+        h.binary_type = IMAGE_BINARY_TYPE;
+        if (pwrite(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+                fprintf(stderr, "Unable to write header: %s\n",
+                        strerror(errno));
+                goto err_out;
+        }
+
+        close(fd);
+        free(buf);
+        exit(EXIT_SUCCESS);
+
+ err_out:
+        if (fd >= 0) close(fd);
+        if (buf) free(buf);
+        exit(EXIT_FAILURE);
+}
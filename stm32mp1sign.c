@@ -10,21 +10,66 @@
  * 1.1: Some polishing.
  * 1.2: Added verification.
  * 1.3: Add simple pubkey hash file creation.
+ * 1.4: Batch mode. Many images per invocation, key loaded once.
+ * 1.5: Parallel batch sign and verify.
+ * 1.6: Streaming hash engine.
+ * 1.7: ECDSA nonce precomputation.
+ * 1.8: Signing daemon and client.
+ * 1.9: Per phase timing statistics. Benchmark suite.
+ * 1.10: Internal SHA-256 engine with CPU specific kernels.
+ * 1.11: Multi-buffer hashing of batches.
+ * 1.12: Image checksum, computed in the hash pass.
+ * 1.13: Optionally hash only the declared image length.
+ * 1.14: Header only writeback when signing.
+ * 1.15: Read-only verification.
+ * 1.16: Sign into a copy with --output.
+ * 1.17: Detached signing over digest and signature manifests.
+ * 1.18: SHA-256 midstate checkpoints for re-signing.
+ * 1.19: Deterministic RFC 6979 signing.
+ * 1.20: Persistent sign and verify result cache.
+ * 1.21: Decrypted key cache in the kernel keyring.
+ * 1.22: Secure heap for key material instead of mlockall.
+ * 1.23: Page faults, max RSS, image latency percentiles and JSON in --stats.
+ * 1.24: Static tracing probes.
+ * 1.25: Native FIP unpack and repack.
+ * 1.26: In process TBBR certificates for the FIP.
+ * 1.27: Incremental FIP signing and a persistent TBBR key directory.
+ * 1.28: Chain of trust verification of the FSBL and FIP.
  */
 
-#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <errno.h>
 #include <getopt.h>
-#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <time.h>
 #include <endian.h>
 #include <libgen.h>
+#include <ctype.h>
 
+#include <signal.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <linux/keyctl.h>
 #include <fcntl.h>
+#include <pthread.h>
+
+#ifndef FICLONE
+#define FICLONE                         _IOW(0x94, 9, int)
+#endif
 
 /* Usage of deprecated functions.
  * Want this to build with older openssl.
@@ -38,56 +83,266 @@
 #include <openssl/pem.h>
 #include <openssl/bn.h>
 #include <openssl/obj_mac.h>
+#include <openssl/sha.h>
 
 #include "config.h"
+#include "cache.h"
+#include "fip.h"
+#include "outfile.h"
+#include "pool.h"
+#include "probes.h"
+#include "sha256.h"
+#include "stm32image.h"
+#include "tbbr.h"
 
 #define UNUSED                          __attribute__((unused))
-#define HEADER_MAGIC                    "STM2"
 /* The ec pubkeys for allowed curves are 65 bytes.
  * 1 byte describing format and 2*32 byte,
  * x concatenated y points in an ecsig struct.
  */
 #define EC_POINT_UNCOMPRESSED_LEN       65
-/* The CPU hashes header from offset 0x48,
- * ie. from member header_version and all of the data.
- */
-#define STM32_HASH_OFFSET               offsetof(struct stm32_header, header_version)
-
-/* The stm32 header is often defined to be 0x100 bytes.
- * However, some implementations carry a padding of
- * uint32_t x[83/4] (?!?).
- * Other definitions do uint8_t x[83] (like this one).
- * Also add packed, which seems to be missing in
- * a lot of implementations in the wild.
- */
-struct __attribute((packed)) stm32_header {
-        uint32_t magic_number;
-        uint8_t image_signature[64];
-        uint32_t image_checksum;
-        uint8_t  header_version[4];
-        uint32_t image_length;
-        uint32_t image_entry_point;
-        uint32_t reserved1;
-        uint32_t load_address;
-        uint32_t reserved2;
-        uint32_t version_number;
-        uint32_t option_flags;
-        uint32_t ecdsa_algorithm;
-        uint8_t ecdsa_public_key[64];
-        uint8_t padding[83];
-        uint8_t binary_type;
+/* Raw signature in the header. R concatenated with S. */
+#define ECDSA_SIG_RAW_LEN               64
+/* Far more worker threads than any machine gains from. */
+#define JOBS_MAX                        1024
+/* Precomputed nonces, a couple of MiB of secure heap. */
+#define PRECOMPUTE_MAX                  16384
+/* Checkpoint interval in MiB. The sidecar keeps it in 32 bits of bytes. */
+#define CHECKPOINT_MAX                  4095
+/* Seconds a decrypted key may stay in the keyring. A day. */
+#define KEY_CACHE_MAX                   86400
+
+/* Run statistics.
+ * Time spent per phase, summed over all images and workers.
+ * Workers add with atomics, nothing is locked.
+ */
+enum stats_phase {
+        STATS_KEY,
+        STATS_LOAD,
+        STATS_HASH,
+        STATS_ECDSA,
+        STATS_WRITEBACK,
+        STATS_NPHASES,
 };
 
+static const char *stats_phase_names[STATS_NPHASES] = {
+        [STATS_KEY] = "key",
+        [STATS_LOAD] = "load",
+        [STATS_HASH] = "hash",
+        [STATS_ECDSA] = "ecdsa",
+        [STATS_WRITEBACK] = "writeback",
+};
+
+/* Per image latency percentiles in the report. */
+static const unsigned int stats_percentiles[] = { 50, 90, 99, 100 };
+
+static struct {
+        bool enabled;
+        bool json;
+        /* stdout, or stderr when a manifest goes to stdout. */
+        FILE *fp;
+        uint64_t ns[STATS_NPHASES];
+        uint64_t bytes;
+        uint64_t images;
+        uint64_t cache_hits;
+        /* Time from start to done, per job. Only its worker writes it. */
+        uint64_t *image_ns;
+        size_t nimage_ns;
+} stats;
+
+static uint64_t
+stats_now(void)
+{
+        struct timespec ts;
+
+        if (!stats.enabled)
+                return 0;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Add the time since start to phase. */
+static void
+stats_add(enum stats_phase phase, uint64_t start)
+{
+        if (!stats.enabled)
+                return;
+        __atomic_fetch_add(&stats.ns[phase], stats_now() - start,
+                           __ATOMIC_RELAXED);
+}
+
+static void
+stats_add_image(uint64_t bytes)
+{
+        if (!stats.enabled)
+                return;
+        __atomic_fetch_add(&stats.bytes, bytes, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&stats.images, 1, __ATOMIC_RELAXED);
+}
+
+static void
+stats_add_cache_hit(void)
+{
+        if (!stats.enabled)
+                return;
+        __atomic_fetch_add(&stats.cache_hits, 1, __ATOMIC_RELAXED);
+}
+
+/* Latency of job, started at start. */
+static void
+stats_image_done(size_t job, uint64_t start)
+{
+        if (!stats.enabled || job >= stats.nimage_ns)
+                return;
+        stats.image_ns[job] = stats_now() - start;
+}
+
+static int
+stats_cmp_u64(const void *a, const void *b)
+{
+        uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+        return x < y ? -1 : x > y;
+}
+
+/* Fields are key=value pairs, or members of a flat JSON object. */
+static void
+stats_field(const char *key, const char *fmt, ...)
+{
+        static bool first = true;
+        va_list ap;
+
+        fprintf(stats.fp, stats.json ? "%s\"%s\": " : "%s%s=", first ? "" :
+                stats.json ? ", " : " ", key);
+        first = false;
+        va_start(ap, fmt);
+        vfprintf(stats.fp, fmt, ap);
+        va_end(ap);
+}
+
+/* One line of key=value pairs, or one JSON object, on stats.fp. */
+static void
+stats_print(const char *op, uint64_t wall_ns)
+{
+        char key[32];
+        struct rusage ru;
+        uint64_t *lat = NULL;
+        size_t i, n = 0;
+
+        if (getrusage(RUSAGE_SELF, &ru))
+                memset(&ru, 0, sizeof(ru));
+        if (stats.nimage_ns && (lat = malloc(stats.nimage_ns * sizeof(*lat)))) {
+                for (i = 0; i < stats.nimage_ns; i++)
+                        if (stats.image_ns[i])
+                                lat[n++] = stats.image_ns[i];
+                qsort(lat, n, sizeof(*lat), stats_cmp_u64);
+        }
+
+        if (stats.json)
+                fprintf(stats.fp, "{");
+        stats_field("op", stats.json ? "\"%s\"" : "%s", op);
+        stats_field("sha256", stats.json ? "\"%s\"" : "%s", sha256_kernel());
+        stats_field("sha256_mb", stats.json ? "\"%s\"" : "%s",
+                    sha256_mb_kernel());
+        stats_field("images", "%" PRIu64, stats.images);
+        stats_field("bytes", "%" PRIu64, stats.bytes);
+        stats_field("cache_hits", "%" PRIu64, stats.cache_hits);
+        for (i = 0; i < STATS_NPHASES; i++) {
+                snprintf(key, sizeof(key), "%s_ns", stats_phase_names[i]);
+                stats_field(key, "%" PRIu64, stats.ns[i]);
+        }
+        stats_field("wall_ns", "%" PRIu64, wall_ns);
+        stats_field("hash_mb_per_s", "%.1f",
+                    stats.ns[STATS_HASH] ?
+                    stats.bytes * 1e3 / stats.ns[STATS_HASH] : 0.0);
+        stats_field("ops_per_s", "%.1f",
+                    wall_ns ? stats.images * 1e9 / wall_ns : 0.0);
+        /* Nearest rank. */
+        for (i = 0; n && i < sizeof(stats_percentiles) /
+                             sizeof(stats_percentiles[0]); i++) {
+                if (stats_percentiles[i] == 100)
+                        snprintf(key, sizeof(key), "image_max_ns");
+                else
+                        snprintf(key, sizeof(key), "image_p%u_ns",
+                                 stats_percentiles[i]);
+                stats_field(key, "%" PRIu64,
+                            lat[(n * stats_percentiles[i] + 99) / 100 - 1]);
+        }
+        stats_field("minor_faults", "%ld", ru.ru_minflt);
+        stats_field("major_faults", "%ld", ru.ru_majflt);
+        stats_field("max_rss_kb", "%ld", ru.ru_maxrss);
+        fprintf(stats.fp, stats.json ? "}\n" : "\n");
+
+        if (lat) free(lat);
+}
+
 static void
 usage(char *argv[])
 {
         printf("%s usage:\n", argv[0]);
         printf("---------------------\n");
-        printf("%s --image <file> --key <file> --sign [--password <string>]\n", argv[0]);
-        printf("%s --image <file> --key <file> --verify\n", argv[0]);
+        printf("%s --image <file> [--image <file> ...] --key <file> --sign [--password <string>]\n", argv[0]);
+        printf("%s --image <file> [--image <file> ...] --key <file> --verify\n", argv[0]);
+        printf("%s --image-list <file> [--null] --key <file> --sign|--verify\n", argv[0]);
+        printf("%s --serve <socket> --key <file> [--password <string>]\n", argv[0]);
+        printf("%s --connect <socket> --image <file> [--digest-only] --sign|--verify\n", argv[0]);
+        printf("%s --image <file> [--image <file> ...] --key <pubkey> --emit-digest <manifest>\n", argv[0]);
+        printf("%s --sign-digests <manifest> --key <file> [--password <string>] > <signatures>\n", argv[0]);
+        printf("%s --import-signature <signatures> --key <pubkey>\n", argv[0]);
+        printf("%s --fip <file> [--fip-unpack <dir>] [--fip-add <name>=<file> ...] [--fip-output <file>]\n", argv[0]);
+        printf("%s [--image <file> ...] --fip <file> --key <file> --sign [--password <string>] --fip-output <file> [--fip-keys <dir>] [--fip-incremental]\n", argv[0]);
+        printf("%s --image <file> [--image <file> ...] --fip <file> --key <pubkey> --verify-chain --otp-hash <hash>\n", argv[0]);
         printf("%s --help\n", argv[0]);
         printf("where:\n");
-        printf("--image       ; Path to stm32image file.\n");
+        printf("--image       ; Path to stm32image file. May be repeated.\n");
+        printf("--image-list  ; Path to a file listing stm32image files, one per line.\n");
+        printf("              ; Use - to read the list from stdin.\n");
+        printf("--null        ; Not mandatory. Image list entries are NUL-separated.\n");
+        printf("--jobs        ; Not mandatory. Number of images processed in parallel.\n");
+        printf("              ; Defaults to the number of online CPUs.\n");
+        printf("--stream      ; Not mandatory. Read and hash images in fixed size chunks\n");
+        printf("              ; instead of mapping them. Memory use does not grow with image size.\n");
+        printf("--image-length; Not mandatory. Hash only the header and image_length bytes of payload,\n");
+        printf("              ; like the boot ROM, instead of the whole file. Trailing padding is ignored.\n");
+        printf("--sync        ; Not mandatory. When signing, wait for the new header to reach storage.\n");
+        printf("--output      ; Not mandatory. When signing, leave the image as is and write the signed\n");
+        printf("              ; copy here. A directory keeps the image file names.\n");
+        printf("--checkpoint  ; Not mandatory. When signing, keep SHA-256 midstates every N MiB in\n");
+        printf("              ; <image>.sha256ck. Re-signing only hashes from the first changed segment.\n");
+        printf("              ; N is at most 4095. The sidecar is only used if it is the user's,\n");
+        printf("              ; mode 0600, and authenticated with a key derived from the private key.\n");
+        printf("--deterministic; Not mandatory. Derive ECDSA nonces from the key and digest (RFC 6979).\n");
+        printf("              ; The same image and key always give the same signed image.\n");
+        printf("--cache       ; Not mandatory. Keep sign and verify results in this file. Unchanged\n");
+        printf("              ; images are skipped, known digests skip the ECDSA operation.\n");
+        printf("--key-cache   ; Not mandatory. Keep the decrypted private key in the session keyring\n");
+        printf("              ; for this many seconds, at most 86400. Later runs skip the decryption\n");
+        printf("              ; and the password. Until then any process of the login session can\n");
+        printf("              ; read the raw key. Without a session keyring, any process of the user\n");
+        printf("              ; that has none either.\n");
+        printf("--emit-digest ; Patch the key into the headers and write the image digests to a\n");
+        printf("              ; manifest instead of signing. One \"hex  path\" line per image, - is stdout.\n");
+        printf("--sign-digests; Sign the digests of a manifest. No images needed.\n");
+        printf("              ; The signatures are written to stdout as a manifest.\n");
+        printf("--import-signature; Check the signatures of a manifest against the images\n");
+        printf("              ; and write them into the headers.\n");
+        printf("--fip         ; Path to a TF-A Firmware Image Package to unpack or repack.\n");
+        printf("              ; With --sign, its TBBR certificates are created with the ROT key in --key,\n");
+        printf("              ; and fresh trusted world, non-trusted world and content keys.\n");
+        printf("--fip-unpack  ; Write the FIP constituents to this directory, named like fiptool does.\n");
+        printf("--fip-add     ; Replace or add a FIP constituent, by fiptool name, like nt-fw-cert=file.\n");
+        printf("              ; May be repeated.\n");
+        printf("--fip-output  ; Write the new FIP here.\n");
+        printf("--fip-keys    ; Not mandatory. Directory keeping the world and content keys between\n");
+        printf("              ; runs, unencrypted. Keys made in a run are added there.\n");
+        printf("--fip-incremental; Not mandatory. Keep the certificates of the FIP that still match\n");
+        printf("              ; their keys and constituents. Only the others are made again.\n");
+        printf("--verify-chain; Verify the images, the ROT key hash against OTP, and the TBBR\n");
+        printf("              ; certificates and constituents of the FIP, all with the ROT key in --key.\n");
+        printf("--otp-hash    ; The ROT key hash fused in OTP, as hex or a file like pubkey.hash.\n");
+        printf("--precompute  ; Not mandatory. Keep up to N ECDSA nonces precomputed in the\n");
+        printf("              ; background, at most 16384. Takes the scalar multiplication off the signing path.\n");
         printf("--key         ; Path to the key used.\n");
         printf("              ; The only allowed EC curves are: prime256v1, brainpoolP256r1\n");
         printf("              ; Contains private and public key when signing.\n");
@@ -96,15 +351,86 @@ usage(char *argv[])
         printf("--verify      ; Verify the stm32image.\n");
         printf("--password    ; Not mandatory. Contains private key password. Used when signing.\n");
         printf("              ; If not used, program will ask interactively.\n");
+        printf("--serve       ; Run as signing daemon on a unix socket. The key is loaded once.\n");
+        printf("              ; Answers sign and verify requests until SIGINT or SIGTERM.\n");
+        printf("--connect     ; Sign or verify through a daemon. No key needed.\n");
+        printf("--digest-only ; Not mandatory. Hash images locally and only send the digest.\n");
+        printf("              ; Default is to hand the image fd over to the daemon.\n");
+        printf("--stats[=json]; Not mandatory. Print per phase timings, page faults, max RSS and per image\n");
+        printf("              ; latency percentiles on stdout, as key=value pairs or as JSON.\n");
+        printf("              ; On stderr when a manifest is written to stdout.\n");
         printf("--pubhash     ; Not mandatory. If used then the raw ec point hash of the public key\n");
         printf("              ; will be overwritten to the current dir + pubkey.hash filename.\n");
         printf("--version     ; %s version.\n", argv[0]);
         printf("--help        ; This help.\n");
 }
 
+/* A whole, nonzero number of at most max. Decimal, or hex with 0x. */
+static int
+parse_ulong(const char *arg, unsigned long max, unsigned long *val)
+{
+        char *end;
+
+        if (!isdigit((unsigned char)*arg))
+                return -1;
+        errno = 0;
+        *val = strtoul(arg, &end, 0);
+        if (errno || *end || !*val || *val > max)
+                return -1;
+
+        return 0;
+}
+
+/* Read exactly len bytes at off. Short reads are errors. */
+static ssize_t
+pread_full(int fd, void *buf, size_t len, off_t off)
+{
+        size_t done = 0;
+        ssize_t n;
+
+        while (done < len) {
+                n = pread(fd, (unsigned char *)buf + done, len - done,
+                          off + done);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        return n < 0 ? -1 : (ssize_t)done;
+                done += n;
+        }
+
+        return done;
+}
+
+/* The ROM authenticates the header and image_length bytes of payload.
+ * Trim len, the file size, to that. Anything declared past the end
+ * of the file is an error.
+ */
+static int
+stm32image_declared_len(const struct stm32_header *h, off_t *len)
+{
+        off_t declared = sizeof(*h) + (off_t)le32toh(h->image_length);
+
+        if (declared > *len) {
+                fprintf(stderr, "Declared image length %" PRIu32
+                        " exceeds the file by %jd bytes.\n",
+                        le32toh(h->image_length), (intmax_t)(declared - *len));
+                return -1;
+        }
+        *len = declared;
+
+        return 0;
+}
+
+/* Map the image. The mapping is always read-only.
+ * With declared, only the header and the declared payload are mapped,
+ * and len is set to their size.
+ * writable tells that the header will be written back through fd.
+ * Otherwise fd may be O_RDONLY, on a read-only mount just as well.
+ */
 static unsigned char *
-stm32image_load(int fd, off_t *len)
+stm32image_load(int fd, off_t *len, bool declared, bool writable)
 {
+        struct stm32_header h;
         unsigned char *data;
 
         if (fd < 0 || !len) {
@@ -120,20 +446,45 @@ stm32image_load(int fd, off_t *len)
                 fprintf(stderr, "Image file too small for stm32 header.\n");
                 goto err_out;
         }
+        if (declared) {
+                if (pread_full(fd, &h, sizeof(h), 0) != sizeof(h)) {
+                        fprintf(stderr, "Unable to read stm32 header.\n");
+                        goto err_out;
+                }
+                if (memcmp(&h, HEADER_MAGIC, strlen(HEADER_MAGIC))) {
+                        fprintf(stderr, "Invalid stm32 header magic.\n");
+                        goto err_out;
+                }
+                if (stm32image_declared_len(&h, len)) {
+                        goto err_out;
+                }
+        }
         if (lseek(fd, 0, SEEK_SET) == (off_t)-1) {
                 fprintf(stderr, "Cannot seek to start.\n");
                 goto err_out;
         }
-        if ((data = mmap(NULL, *len, PROT_READ | PROT_WRITE,
-                         MAP_SHARED | MAP_POPULATE, fd, 0)) == MAP_FAILED) {
+        /* Read only. Only the header changes, and that goes
+         * back with a single pwrite, not through the page cache
+         * dirty tracking of the whole mapping.
+         * Verification maps privately. Either way the paging is left
+         * to sequential readahead, nothing is faulted in up front.
+         * Concurrent runs share the page cache, nothing is ever
+         * copied on write.
+         */
+        if ((data = mmap(NULL, *len, PROT_READ,
+                         writable ? MAP_SHARED : MAP_PRIVATE,
+                         fd, 0)) == MAP_FAILED) {
                 fprintf(stderr, "mmap failed: %s\n", strerror(errno));
                 goto err_out;
         }
+        madvise(data, *len, MADV_SEQUENTIAL);
         /* Not overly rigorous checks.
          * Assuming header was generated by something sane already.
+         * The declared length was read from a checked header already.
          */
-        if (memcmp(data, HEADER_MAGIC, strlen(HEADER_MAGIC))) {
+        if (!declared && memcmp(data, HEADER_MAGIC, strlen(HEADER_MAGIC))) {
                 fprintf(stderr, "Invalid stm32 header magic.\n");
+                munmap(data, *len);
                 goto err_out;
         }
 
@@ -144,6 +495,246 @@ stm32image_load(int fd, off_t *len)
         return NULL;
 }
 
+/* Streaming counterpart of stm32image_load.
+ * Only the header is read. The payload is left on disk.
+ */
+static int
+stm32image_read_header(int fd, struct stm32_header *h, off_t *len,
+                       bool declared)
+{
+        if (fd < 0 || !h || !len) {
+                fprintf(stderr, "Invalid input.\n");
+                goto err_out;
+        }
+
+        if ((*len = lseek(fd, 0, SEEK_END)) == (off_t)-1) {
+                fprintf(stderr, "Cannot seek to end.\n");
+                goto err_out;
+        }
+        if (*len <= (off_t)sizeof(struct stm32_header)) {
+                fprintf(stderr, "Image file too small for stm32 header.\n");
+                goto err_out;
+        }
+        if (pread_full(fd, h, sizeof(*h), 0) != sizeof(*h)) {
+                fprintf(stderr, "Unable to read stm32 header.\n");
+                goto err_out;
+        }
+        if (memcmp(h, HEADER_MAGIC, strlen(HEADER_MAGIC))) {
+                fprintf(stderr, "Invalid stm32 header magic.\n");
+                goto err_out;
+        }
+        if (declared && stm32image_declared_len(h, len)) {
+                goto err_out;
+        }
+        posix_fadvise(fd, 0, *len, POSIX_FADV_SEQUENTIAL);
+
+        return 0;
+
+ err_out:
+        if (len) *len = 0;
+        return -1;
+}
+
+/* Double buffered payload reader.
+ * The reader thread fills one chunk while the hash consumes the other.
+ * Memory use is two chunks, regardless of image size.
+ */
+#define STREAM_CHUNK_SIZE               (1024 * 1024)
+
+struct stream_reader {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        int fd;
+        off_t pos;
+        off_t end;
+        unsigned char *buf[2];
+        size_t fill[2];
+        bool full[2];
+        int err;
+        bool stop;
+};
+
+static void *
+stream_reader_main(void *data)
+{
+        struct stream_reader *sr = data;
+        off_t pos = sr->pos;
+        bool stop;
+        size_t n;
+        int i;
+
+        for (i = 0; pos < sr->end; i ^= 1) {
+                pthread_mutex_lock(&sr->lock);
+                while (sr->full[i] && !sr->stop)
+                        pthread_cond_wait(&sr->cond, &sr->lock);
+                stop = sr->stop;
+                pthread_mutex_unlock(&sr->lock);
+                if (stop)
+                        break;
+
+                n = sr->end - pos < STREAM_CHUNK_SIZE ?
+                        (size_t)(sr->end - pos) : STREAM_CHUNK_SIZE;
+                errno = 0;
+                if (pread_full(sr->fd, sr->buf[i], n, pos) != (ssize_t)n) {
+                        sr->err = errno ? errno : EIO;
+                        n = 0;
+                }
+                pthread_mutex_lock(&sr->lock);
+                sr->fill[i] = n;
+                sr->full[i] = true;
+                pthread_cond_broadcast(&sr->cond);
+                pthread_mutex_unlock(&sr->lock);
+                if (!n)
+                        break;
+                pos += n;
+        }
+
+        return NULL;
+}
+
+/* Payload covered by the image checksum.
+ * The declared length, but never past the end of the file.
+ */
+static size_t
+stm32image_payload_len(const struct stm32_header *h, off_t len)
+{
+        size_t avail = len - sizeof(*h);
+
+        return le32toh(h->image_length) < avail ?
+                le32toh(h->image_length) : avail;
+}
+
+/* Hash from STM32_HASH_OFFSET to end of file.
+ * The header part comes from h, which may be patched in memory.
+ * The payload is streamed from fd.
+ * The payload checksum is summed in the same pass.
+ */
+static int
+stm32image_stream_sha256(int fd, const struct stm32_header *h, off_t len,
+                         unsigned char *md, uint32_t *checksum)
+{
+        struct stream_reader sr = {
+                .lock = PTHREAD_MUTEX_INITIALIZER,
+                .cond = PTHREAD_COND_INITIALIZER,
+                .fd = fd,
+                .pos = sizeof(*h),
+                .end = len,
+        };
+        struct sha256_ctx sha;
+        pthread_t reader;
+        bool started = false;
+        off_t pos, sum_end;
+        size_t n, sum;
+        int i;
+
+        if (fd < 0 || !h || !md) {
+                fprintf(stderr, "Invalid input.\n");
+                goto err_out;
+        }
+
+        if (!(sr.buf[0] = malloc(2 * STREAM_CHUNK_SIZE))) {
+                fprintf(stderr, "Unable to allocate stream buffers.\n");
+                goto err_out;
+        }
+        sr.buf[1] = sr.buf[0] + STREAM_CHUNK_SIZE;
+        if (pthread_create(&reader, NULL, stream_reader_main, &sr)) {
+                fprintf(stderr, "Unable to start stream reader.\n");
+                goto err_out;
+        }
+        started = true;
+
+        sha256_init(&sha);
+        sha256_update(&sha, &((const unsigned char *)h)[STM32_HASH_OFFSET],
+                      sizeof(*h) - STM32_HASH_OFFSET);
+        *checksum = 0;
+        sum_end = sizeof(*h) + stm32image_payload_len(h, len);
+        for (i = 0, pos = sr.pos; pos < sr.end; i ^= 1) {
+                pthread_mutex_lock(&sr.lock);
+                while (!sr.full[i])
+                        pthread_cond_wait(&sr.cond, &sr.lock);
+                n = sr.fill[i];
+                pthread_mutex_unlock(&sr.lock);
+                if (!n) {
+                        fprintf(stderr, "Unable to read image data: %s\n",
+                                strerror(sr.err));
+                        goto err_out;
+                }
+
+                /* The checksummed payload starts the stream. */
+                sum = pos < sum_end ?
+                        (sum_end - pos < (off_t)n ? (size_t)(sum_end - pos) :
+                         n) : 0;
+                sha256_update_sum(&sha, sr.buf[i], sum, checksum);
+                sha256_update(&sha, sr.buf[i] + sum, n - sum);
+                pos += n;
+
+                pthread_mutex_lock(&sr.lock);
+                sr.full[i] = false;
+                pthread_cond_broadcast(&sr.cond);
+                pthread_mutex_unlock(&sr.lock);
+        }
+        sha256_final(&sha, md);
+
+        pthread_join(reader, NULL);
+        free(sr.buf[0]);
+        return 0;
+
+ err_out:
+        if (started) {
+                pthread_mutex_lock(&sr.lock);
+                sr.stop = true;
+                pthread_cond_broadcast(&sr.cond);
+                pthread_mutex_unlock(&sr.lock);
+                pthread_join(reader, NULL);
+        }
+        if (sr.buf[0]) free(sr.buf[0]);
+        return -1;
+}
+
+/* Secret material lives in OpenSSL's secure heap, locked and
+ * guarded, instead of locking the whole process. Private keys and
+ * nonces are put there by OpenSSL, the password by secure_strdup.
+ * Room for every precomputed nonce and a few per worker.
+ */
+#define SECURE_HEAP_MIN                 (64 * 1024)
+/* Well above what PRECOMPUTE_MAX and JOBS_MAX ask for. */
+#define SECURE_HEAP_MAX                 (64 * 1024 * 1024)
+#define SECURE_HEAP_MIN_ALLOC           32
+
+static void
+secure_heap_init(unsigned long precompute, unsigned int jobs)
+{
+        size_t size = SECURE_HEAP_MIN, need;
+
+        need = precompute * 4 * SECURE_HEAP_MIN_ALLOC + (size_t)jobs * 4096;
+        /* A power of two. Bounded, the shift would wrap to 0. */
+        while (size < need && size < SECURE_HEAP_MAX)
+                size <<= 1;
+        if (CRYPTO_secure_malloc_init(size, SECURE_HEAP_MIN_ALLOC) != 1) {
+                fprintf(stderr,
+                        "Warn: Failed protecting key material from being swapped.\n");
+        }
+}
+
+static char *
+secure_strdup(const char *str)
+{
+        size_t len = strlen(str) + 1;
+        char *p;
+
+        if ((p = OPENSSL_secure_malloc(len)))
+                memcpy(p, str, len);
+
+        return p;
+}
+
+static void
+secure_strfree(char *str)
+{
+        if (str)
+                OPENSSL_secure_clear_free(str, strlen(str) + 1);
+}
+
 static int
 openssl_pw_cb(char *buf, int size, int rwflag UNUSED, void *u UNUSED)
 {
@@ -153,9 +744,12 @@ openssl_pw_cb(char *buf, int size, int rwflag UNUSED, void *u UNUSED)
         passwd = getpass("stm32mp1sign. Privkey password: ");
         len = strlen(passwd);
         if (len <= 0 || len > size) {
+                OPENSSL_cleanse(passwd, len);
                 return 0;
         }
         memcpy(buf, passwd, len);
+        /* getpass keeps it in a static buffer. */
+        OPENSSL_cleanse(passwd, len);
 
         return len;
 }
@@ -169,9 +763,11 @@ openssl_load_key(const char *key_path, char *pw, bool privkey)
 
         if (!key_path || !key_path[0]) {
                 fprintf(stderr, "Invalid input.\n");
-                goto err_out;
+                return NULL;
         }
 
+        PROBE1(key__load__start, key_path);
+
         if (!(bio_key = BIO_new_file(key_path, "r"))) {
                 fprintf(stderr, "Unable to load key %s.\n", key_path);
                 goto err_out;
@@ -197,14 +793,151 @@ openssl_load_key(const char *key_path, char *pw, bool privkey)
 
         if (key) EVP_PKEY_free(key);
         if (bio_key) BIO_free(bio_key);
+        PROBE3(key__load__done, key_path, privkey, 0);
         return eckey;
 
  err_out:
         if (key) EVP_PKEY_free(key);
         if (bio_key) BIO_free(bio_key);
+        PROBE3(key__load__done, key_path, privkey, -1);
         return NULL;
 }
 
+/* Decrypted key cache in the kernel keyring.
+ * The private scalar is kept as a user key in the session keyring, with
+ * a timeout, so that later runs skip the PEM parsing, the KDF and the
+ * password prompt. It is named after the SHA-256 of the key file.
+ * Only possessors, processes sharing the session keyring, can read it
+ * until it expires. Without keyring support, keys are loaded as usual.
+ */
+#define KEYRING_MAGIC                   0x534b4331
+#define KEYRING_DESC_PREFIX             "stm32mp1sign:"
+#define KEYRING_DESC_LEN                (sizeof(KEYRING_DESC_PREFIX) + \
+                                         2 * SHA256_HASH_SIZE)
+/* From keyutils. Possessor all, nothing for the user or others.
+ * Only processes that hold the session keyring can find and read it.
+ */
+#define KEYRING_PERM                    0x3f000000
+
+struct __attribute((packed)) keyring_payload {
+        uint32_t magic;
+        uint32_t nid;
+        uint8_t priv[32];
+        uint8_t pub[EC_POINT_UNCOMPRESSED_LEN];
+};
+
+static int
+keyring_desc(const char *key_path, char *desc)
+{
+        struct sha256_ctx sha;
+        uint8_t buf[4096], md[SHA256_HASH_SIZE];
+        ssize_t n;
+        int fd, i;
+
+        if ((fd = open(key_path, O_RDONLY | O_CLOEXEC)) < 0)
+                return -1;
+        sha256_init(&sha);
+        while ((n = read(fd, buf, sizeof(buf))) > 0)
+                sha256_update(&sha, buf, n);
+        close(fd);
+        if (n < 0)
+                return -1;
+        sha256_final(&sha, md);
+        strcpy(desc, KEYRING_DESC_PREFIX);
+        for (i = 0; i < SHA256_HASH_SIZE; i++)
+                sprintf(&desc[sizeof(KEYRING_DESC_PREFIX) - 1 + 2 * i],
+                        "%02x", md[i]);
+
+        return 0;
+}
+
+static EC_KEY *
+keyring_load_key(const char *desc)
+{
+        struct keyring_payload kp;
+        EC_KEY *eckey = NULL;
+        BIGNUM *priv = NULL;
+        long id;
+
+        id = syscall(SYS_keyctl, KEYCTL_SEARCH, KEY_SPEC_SESSION_KEYRING,
+                     "user", desc, 0);
+        if (id < 0)
+                return NULL;
+        if (syscall(SYS_keyctl, KEYCTL_READ, id, &kp, sizeof(kp)) !=
+            (long)sizeof(kp) || kp.magic != KEYRING_MAGIC) {
+                goto out;
+        }
+        if (!(eckey = EC_KEY_new_by_curve_name(kp.nid)) ||
+            !(priv = BN_bin2bn(kp.priv, sizeof(kp.priv), NULL)) ||
+            !EC_KEY_set_private_key(eckey, priv) ||
+            !EC_KEY_oct2key(eckey, kp.pub, sizeof(kp.pub), NULL)) {
+                if (eckey) EC_KEY_free(eckey);
+                eckey = NULL;
+        }
+
+ out:
+        if (priv) BN_clear_free(priv);
+        OPENSSL_cleanse(&kp, sizeof(kp));
+        return eckey;
+}
+
+static void
+keyring_store_key(const char *desc, const EC_KEY *eckey, unsigned long timeout)
+{
+        const EC_GROUP *group = EC_KEY_get0_group(eckey);
+        struct keyring_payload kp;
+        long id;
+
+        kp.magic = KEYRING_MAGIC;
+        kp.nid = EC_GROUP_get_curve_name(group);
+        if (BN_bn2binpad(EC_KEY_get0_private_key(eckey), kp.priv,
+                         sizeof(kp.priv)) < 0 ||
+            EC_POINT_point2oct(group, EC_KEY_get0_public_key(eckey),
+                               POINT_CONVERSION_UNCOMPRESSED, kp.pub,
+                               sizeof(kp.pub), NULL) != sizeof(kp.pub)) {
+                goto out;
+        }
+        /* Without a session keyring, add_key would make a new one that
+         * ends with this process. Look it up without creating instead,
+         * that gives the user session keyring then, like the search.
+         */
+        id = syscall(SYS_keyctl, KEYCTL_GET_KEYRING_ID,
+                     KEY_SPEC_SESSION_KEYRING, 0);
+        if (id >= 0)
+                id = syscall(SYS_add_key, "user", desc, &kp, sizeof(kp), id);
+        if (id < 0 ||
+            syscall(SYS_keyctl, KEYCTL_SET_TIMEOUT, id, timeout) < 0 ||
+            syscall(SYS_keyctl, KEYCTL_SETPERM, id, KEYRING_PERM) < 0) {
+                fprintf(stderr, "Warn: Unable to cache key in keyring: %s\n",
+                        strerror(errno));
+                if (id >= 0)
+                        syscall(SYS_keyctl, KEYCTL_INVALIDATE, id);
+        }
+
+ out:
+        OPENSSL_cleanse(&kp, sizeof(kp));
+}
+
+/* openssl_load_key, through the keyring for private keys
+ * when timeout is set.
+ */
+static EC_KEY *
+openssl_load_key_cached(const char *key_path, char *pw, bool privkey,
+                        unsigned long timeout)
+{
+        char desc[KEYRING_DESC_LEN];
+        EC_KEY *eckey;
+
+        if (!timeout || !privkey || keyring_desc(key_path, desc))
+                return openssl_load_key(key_path, pw, privkey);
+        if ((eckey = keyring_load_key(desc)))
+                return eckey;
+        if ((eckey = openssl_load_key(key_path, pw, privkey)))
+                keyring_store_key(desc, eckey, timeout);
+
+        return eckey;
+}
+
 static uint8_t *
 openssl_get_pubkey(EC_KEY *eckey, size_t *len, int *alg)
 {
@@ -275,69 +1008,2623 @@ openssl_get_pubkey(EC_KEY *eckey, size_t *len, int *alg)
         return NULL;
 }
 
-static ECDSA_SIG *
-openssl_do_ecdsa_sha256_sign(EC_KEY *eckey,
-                             unsigned char *data, unsigned long datalen)
+/* ECDSA nonce pool.
+ * (kinv, r) pairs are computed ahead of time by a background thread.
+ * The expensive k*G is then off the signing path. A pair is used for
+ * exactly one signature and cleared when freed.
+ * An empty pool is not an error. The signer does its own setup.
+ */
+struct nonce_pool {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        EC_KEY *eckey;
+        BIGNUM **kinv;
+        BIGNUM **r;
+        size_t size;
+        size_t head;
+        size_t count;
+        pthread_t thread;
+        bool started;
+        bool stop;
+};
+
+static void *
+nonce_pool_main(void *data)
 {
-        ECDSA_SIG *ecsig = NULL;
+        struct nonce_pool *np = data;
+        BN_CTX *bnctx;
+        BIGNUM *kinv, *r;
+        size_t tail;
+        bool stop;
 
-        if (!eckey || !data || !datalen) {
-                fprintf(stderr, "Invalid input.\n");
-                goto err_out;
+        if (!(bnctx = BN_CTX_new())) {
+                fprintf(stderr, "Warn: Unable to allocate bignum context.\n");
+                return NULL;
         }
+        while (1) {
+                pthread_mutex_lock(&np->lock);
+                while (np->count == np->size && !np->stop)
+                        pthread_cond_wait(&np->cond, &np->lock);
+                stop = np->stop;
+                pthread_mutex_unlock(&np->lock);
+                if (stop)
+                        break;
 
-        if (!(ecsig = ECDSA_do_sign(SHA256(data, datalen, NULL),
-                                    SHA256_DIGEST_LENGTH, eckey))) {
-                fprintf(stderr, "Unable to generate ECDSA signature.\n");
-                goto err_out;
+                kinv = r = NULL;
+                if (!ECDSA_sign_setup(np->eckey, bnctx, &kinv, &r)) {
+                        fprintf(stderr,
+                                "Warn: Unable to precompute ECDSA nonce.\n");
+                        break;
+                }
+                /* Only this thread adds. There is room. */
+                pthread_mutex_lock(&np->lock);
+                tail = (np->head + np->count) % np->size;
+                np->kinv[tail] = kinv;
+                np->r[tail] = r;
+                np->count++;
+                pthread_mutex_unlock(&np->lock);
         }
+        BN_CTX_free(bnctx);
 
-        return ecsig;
-
- err_out:
         return NULL;
 }
 
-static ECDSA_SIG *
-openssl_do_ecdsa_sha256_verify(ECDSA_SIG *ecsig, EC_KEY *eckey,
-                               unsigned char *data, unsigned long datalen)
+static bool
+nonce_pool_take(struct nonce_pool *np, BIGNUM **kinv, BIGNUM **r)
+{
+        bool taken = false;
+
+        if (!np)
+                return false;
+
+        pthread_mutex_lock(&np->lock);
+        if (np->count) {
+                *kinv = np->kinv[np->head];
+                *r = np->r[np->head];
+                np->kinv[np->head] = np->r[np->head] = NULL;
+                np->head = (np->head + 1) % np->size;
+                np->count--;
+                pthread_cond_signal(&np->cond);
+                taken = true;
+        }
+        pthread_mutex_unlock(&np->lock);
+
+        return taken;
+}
+
+static void
+nonce_pool_free(struct nonce_pool *np)
+{
+        size_t i;
+
+        if (!np)
+                return;
+
+        if (np->started) {
+                pthread_mutex_lock(&np->lock);
+                np->stop = true;
+                pthread_cond_broadcast(&np->cond);
+                pthread_mutex_unlock(&np->lock);
+                pthread_join(np->thread, NULL);
+        }
+        for (i = 0; i < np->size; i++) {
+                if (np->kinv && np->kinv[i]) BN_clear_free(np->kinv[i]);
+                if (np->r && np->r[i]) BN_clear_free(np->r[i]);
+        }
+        if (np->kinv) free(np->kinv);
+        if (np->r) free(np->r);
+        pthread_mutex_destroy(&np->lock);
+        pthread_cond_destroy(&np->cond);
+        free(np);
+}
+
+static struct nonce_pool *
+nonce_pool_new(EC_KEY *eckey, size_t size)
 {
-        if (!ecsig || !eckey || !data || !datalen) {
+        struct nonce_pool *np = NULL;
+
+        if (!eckey || !size) {
                 fprintf(stderr, "Invalid input.\n");
                 goto err_out;
         }
 
-        if (!(ECDSA_do_verify(SHA256(data, datalen, NULL),
-                              SHA256_DIGEST_LENGTH, ecsig, eckey))) {
-                fprintf(stderr, "Unable to verify ECDSA signature.\n");
+        if (!(np = calloc(1, sizeof(*np)))) {
+                fprintf(stderr, "Unable to allocate nonce pool.\n");
+                goto err_out;
+        }
+        pthread_mutex_init(&np->lock, NULL);
+        pthread_cond_init(&np->cond, NULL);
+        np->eckey = eckey;
+        np->size = size;
+        if (!(np->kinv = calloc(size, sizeof(*np->kinv))) ||
+            !(np->r = calloc(size, sizeof(*np->r)))) {
+                fprintf(stderr, "Unable to allocate nonce pool.\n");
+                goto err_out;
+        }
+        if (pthread_create(&np->thread, NULL, nonce_pool_main, np)) {
+                fprintf(stderr, "Unable to start nonce pool thread.\n");
                 goto err_out;
         }
+        np->started = true;
 
-        return ecsig;
+        return np;
 
  err_out:
+        nonce_pool_free(np);
         return NULL;
 }
 
-int
-main(int argc, char *argv[])
+/* Deterministic nonces, RFC 6979 with HMAC-SHA256.
+ * The nonce is derived from the private key and the digest, so the
+ * same image and key always give the same signature.
+ * Both allowed curves have a 256 bit order, one HMAC output is a
+ * full candidate.
+ */
+#define RFC6979_LEN                     SHA256_HASH_SIZE
+
+/* out = HMAC_K(V [|| sep [|| x || h]]). No sep for sep < 0. */
+static void
+rfc6979_hmac(const uint8_t *k, const uint8_t *v, int sep, const uint8_t *x,
+             const uint8_t *h, uint8_t *out)
 {
-        struct stm32_header *h = NULL;
-        FILE *fp = NULL;
+        struct sha256_ctx sha;
+        uint8_t pad[SHA256_BLOCK_SIZE], c = sep;
+        size_t i;
+
+        memset(pad, 0x36, sizeof(pad));
+        for (i = 0; i < RFC6979_LEN; i++)
+                pad[i] ^= k[i];
+        sha256_init(&sha);
+        sha256_update(&sha, pad, sizeof(pad));
+        sha256_update(&sha, v, RFC6979_LEN);
+        if (sep >= 0)
+                sha256_update(&sha, &c, 1);
+        if (sep >= 0 && x) {
+                sha256_update(&sha, x, RFC6979_LEN);
+                sha256_update(&sha, h, RFC6979_LEN);
+        }
+        sha256_final(&sha, out);
+        for (i = 0; i < sizeof(pad); i++)
+                pad[i] ^= 0x36 ^ 0x5c;
+        sha256_init(&sha);
+        sha256_update(&sha, pad, sizeof(pad));
+        sha256_update(&sha, out, RFC6979_LEN);
+        sha256_final(&sha, out);
+        OPENSSL_cleanse(pad, sizeof(pad));
+        OPENSSL_cleanse(&sha, sizeof(sha));
+}
+
+/* The ECDSA_sign_setup of RFC 6979.
+ * kinv is computed with a constant time exponentiation, k^(q - 2).
+ */
+static int
+rfc6979_sign_setup(EC_KEY *eckey, BN_CTX *bnctx, const unsigned char *md,
+                   BIGNUM **kinv, BIGNUM **rp)
+{
+        const EC_GROUP *group = EC_KEY_get0_group(eckey);
+        const BIGNUM *order = EC_GROUP_get0_order(group);
+        uint8_t x[RFC6979_LEN], h[RFC6979_LEN];
+        uint8_t v[RFC6979_LEN], k[RFC6979_LEN];
+        EC_POINT *p = NULL;
+        BIGNUM *bk = NULL, *e = NULL;
+        int ret = -1;
+
+        *kinv = *rp = NULL;
+        if (BN_num_bits(order) != 8 * RFC6979_LEN) {
+                fprintf(stderr, "Unsupported curve order for RFC 6979.\n");
+                return -1;
+        }
+        BN_CTX_start(bnctx);
+        if (!(bk = BN_CTX_get(bnctx)) || !(e = BN_CTX_get(bnctx)) ||
+            !(*kinv = BN_new()) || !(*rp = BN_new()) ||
+            !(p = EC_POINT_new(group))) {
+                goto out;
+        }
+        /* int2octets(x) and bits2octets(h1). */
+        if (BN_bn2binpad(EC_KEY_get0_private_key(eckey), x, sizeof(x)) < 0 ||
+            !BN_bin2bn(md, RFC6979_LEN, e) ||
+            !BN_nnmod(e, e, order, bnctx) ||
+            BN_bn2binpad(e, h, sizeof(h)) < 0) {
+                goto out;
+        }
+        memset(v, 0x01, sizeof(v));
+        memset(k, 0x00, sizeof(k));
+        rfc6979_hmac(k, v, 0x00, x, h, k);
+        rfc6979_hmac(k, v, -1, NULL, NULL, v);
+        rfc6979_hmac(k, v, 0x01, x, h, k);
+        rfc6979_hmac(k, v, -1, NULL, NULL, v);
+        BN_set_flags(bk, BN_FLG_CONSTTIME);
+        while (1) {
+                rfc6979_hmac(k, v, -1, NULL, NULL, v);
+                if (!BN_bin2bn(v, sizeof(v), bk))
+                        goto out;
+                if (!BN_is_zero(bk) && BN_cmp(bk, order) < 0) {
+                        if (!EC_POINT_mul(group, p, bk, NULL, NULL, bnctx) ||
+                            !EC_POINT_get_affine_coordinates(group, p, *rp,
+                                                             NULL, bnctx) ||
+                            !BN_nnmod(*rp, *rp, order, bnctx)) {
+                                goto out;
+                        }
+                        if (!BN_is_zero(*rp))
+                                break;
+                }
+                /* K = HMAC_K(V || 0x00), V = HMAC_K(V). */
+                rfc6979_hmac(k, v, 0x00, NULL, NULL, k);
+                rfc6979_hmac(k, v, -1, NULL, NULL, v);
+        }
+        if (!BN_copy(e, order) || !BN_sub_word(e, 2) ||
+            !BN_mod_exp_mont_consttime(*kinv, bk, e, order, bnctx, NULL)) {
+                goto out;
+        }
+        ret = 0;
+
+ out:
+        OPENSSL_cleanse(x, sizeof(x));
+        OPENSSL_cleanse(k, sizeof(k));
+        OPENSSL_cleanse(v, sizeof(v));
+        if (bk) BN_clear(bk);
+        BN_CTX_end(bnctx);
+        if (p) EC_POINT_free(p);
+        if (ret) {
+                fprintf(stderr, "Unable to setup RFC 6979 nonce.\n");
+                BN_clear_free(*kinv);
+                BN_clear_free(*rp);
+                *kinv = *rp = NULL;
+        }
+        return ret;
+}
+
+/* Per worker OpenSSL state.
+ * The EC_KEY is shared read-only between workers.
+ * Everything that is written to during sign or verify is private.
+ */
+struct worker_ctx {
+        BN_CTX *bnctx;
+        ECDSA_SIG *ecsig;
+        int sock;
+};
+
+/* Sign a sha256 digest.
+ * The nonce comes from the pool if there is one with a pair ready,
+ * otherwise it is set up here with the workers own bignum context.
+ * Deterministic signatures never take from the pool.
+ * path is the image the digest belongs to, for the probes.
+ */
+static ECDSA_SIG *
+openssl_do_ecdsa_sha256_sign(EC_KEY *eckey, BN_CTX *bnctx,
+                             struct nonce_pool *nonces, bool deterministic,
+                             const unsigned char *md, const char *path)
+{
+        ECDSA_SIG *ecsig = NULL;
+        BIGNUM *kinv = NULL, *rp = NULL;
+
+        if (!eckey || !bnctx || !md) {
+                fprintf(stderr, "Invalid input.\n");
+                return NULL;
+        }
+
+        PROBE1(ecdsa__sign__start, path);
+        if (deterministic) {
+                if (rfc6979_sign_setup(eckey, bnctx, md, &kinv, &rp)) {
+                        goto out;
+                }
+                if (!(ecsig = ECDSA_do_sign_ex(md, SHA256_DIGEST_LENGTH,
+                                               kinv, rp, eckey))) {
+                        fprintf(stderr, "Unable to generate ECDSA signature.\n");
+                }
+                goto out;
+        }
+        if (nonce_pool_take(nonces, &kinv, &rp)) {
+                ecsig = ECDSA_do_sign_ex(md, SHA256_DIGEST_LENGTH,
+                                         kinv, rp, eckey);
+                BN_clear_free(kinv);
+                BN_clear_free(rp);
+                kinv = rp = NULL;
+                /* A precomputed pair can not be retried with.
+                 * Fall through to a fresh setup.
+                 */
+                if (ecsig)
+                        goto out;
+        }
+        if (!ECDSA_sign_setup(eckey, bnctx, &kinv, &rp)) {
+                fprintf(stderr, "Unable to setup ECDSA signature.\n");
+                goto out;
+        }
+        if (!(ecsig = ECDSA_do_sign_ex(md, SHA256_DIGEST_LENGTH,
+                                       kinv, rp, eckey))) {
+                fprintf(stderr, "Unable to generate ECDSA signature.\n");
+        }
+
+ out:
+        if (kinv) BN_clear_free(kinv);
+        if (rp) BN_clear_free(rp);
+        PROBE2(ecdsa__sign__done, path, ecsig ? 0 : -1);
+        return ecsig;
+}
+
+/* Known answer test, RFC 6979 A.2.5. P-256, SHA-256, "sample". */
+static int
+rfc6979_selftest(void)
+{
+        const char *x =
+                "C9AFA9D845BA75166B5C215767B1D6934E50C3DB36E89B127B8A622B120F6721";
+        const char *r =
+                "EFD48B2AACB6A8FD1140DD9CD45E81D69D2C877B56AAF991C34D0EA84EAF3716";
+        const char *s =
+                "F7CB1C942D657C41D436C7A1B6E29F65F3E900DBB9AFF4064DC4AB2F843ACDA8";
+        unsigned char md[SHA256_DIGEST_LENGTH];
+        EC_KEY *eckey = NULL;
+        EC_POINT *pub = NULL;
+        BN_CTX *bnctx = NULL;
+        BIGNUM *priv = NULL, *rr = NULL, *ss = NULL;
+        ECDSA_SIG *ecsig = NULL;
+        int ret = -1;
+
+        sha256("sample", 6, md);
+        if (!(bnctx = BN_CTX_new()) ||
+            !(eckey = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1)) ||
+            !(pub = EC_POINT_new(EC_KEY_get0_group(eckey))) ||
+            !BN_hex2bn(&priv, x) || !BN_hex2bn(&rr, r) ||
+            !BN_hex2bn(&ss, s) ||
+            !EC_POINT_mul(EC_KEY_get0_group(eckey), pub, priv, NULL, NULL,
+                          bnctx) ||
+            !EC_KEY_set_private_key(eckey, priv) ||
+            !EC_KEY_set_public_key(eckey, pub)) {
+                goto out;
+        }
+        if (!(ecsig = openssl_do_ecdsa_sha256_sign(eckey, bnctx, NULL, true,
+                                                   md, "-"))) {
+                goto out;
+        }
+        if (!BN_cmp(ECDSA_SIG_get0_r(ecsig), rr) &&
+            !BN_cmp(ECDSA_SIG_get0_s(ecsig), ss))
+                ret = 0;
+
+ out:
+        if (ret)
+                fprintf(stderr, "RFC 6979 known answer test failed.\n");
+        if (ecsig) ECDSA_SIG_free(ecsig);
+        if (priv) BN_free(priv);
+        if (rr) BN_free(rr);
+        if (ss) BN_free(ss);
+        if (pub) EC_POINT_free(pub);
+        if (eckey) EC_KEY_free(eckey);
+        if (bnctx) BN_CTX_free(bnctx);
+        return ret;
+}
+
+/* Verify a sha256 digest. path is for the probes. */
+static ECDSA_SIG *
+openssl_do_ecdsa_sha256_verify(ECDSA_SIG *ecsig, EC_KEY *eckey,
+                               const unsigned char *md, const char *path)
+{
+        if (!ecsig || !eckey || !md) {
+                fprintf(stderr, "Invalid input.\n");
+                return NULL;
+        }
+
+        PROBE1(ecdsa__verify__start, path);
+        if ((ECDSA_do_verify(md, SHA256_DIGEST_LENGTH,
+                             ecsig, eckey)) != 1) {
+                fprintf(stderr, "Unable to verify ECDSA signature.\n");
+                goto err_out;
+        }
+        PROBE2(ecdsa__verify__done, path, 0);
+
+        return ecsig;
+
+ err_out:
+        PROBE2(ecdsa__verify__done, path, -1);
+        return NULL;
+}
+
+/* Image list.
+ * Paths collected from repeated --image options and list files.
+ * Every image is processed with the same key.
+ */
+struct image_list {
+        char **paths;
+        size_t count;
+        size_t size;
+};
+
+static int
+image_list_add(struct image_list *list, const char *path)
+{
+        char **paths;
+        size_t size;
+
+        if (!list || !path || !path[0]) {
+                fprintf(stderr, "Invalid input.\n");
+                goto err_out;
+        }
+
+        if (list->count == list->size) {
+                size = list->size ? list->size * 2 : 16;
+                if (!(paths = realloc(list->paths, size * sizeof(*paths)))) {
+                        fprintf(stderr, "Unable to allocate image list.\n");
+                        goto err_out;
+                }
+                list->paths = paths;
+                list->size = size;
+        }
+        if (!(list->paths[list->count] = strdup(path))) {
+                fprintf(stderr, "Unable to allocate image path.\n");
+                goto err_out;
+        }
+        list->count++;
+
+        return 0;
+
+ err_out:
+        return -1;
+}
+
+/* Read image paths from a list file.
+ * One path per line, or NUL-separated if null_sep is set
+ * (find -print0 style). "-" reads the list from stdin.
+ */
+static int
+image_list_read(struct image_list *list, const char *list_path, bool null_sep)
+{
+        FILE *fp = NULL;
+        char *line = NULL;
+        size_t size = 0;
+        ssize_t n;
+        int delim = null_sep ? '\0' : '\n';
+
+        if (!list || !list_path) {
+                fprintf(stderr, "Invalid input.\n");
+                goto err_out;
+        }
+
+        if (!strcmp(list_path, "-")) {
+                fp = stdin;
+        } else if (!(fp = fopen(list_path, "r"))) {
+                fprintf(stderr, "Cannot open %s: %s\n",
+                        list_path, strerror(errno));
+                goto err_out;
+        }
+        while ((n = getdelim(&line, &size, delim, fp)) > 0) {
+                if (line[n - 1] == delim)
+                        line[--n] = '\0';
+                /* Skip empty lines */
+                if (!n)
+                        continue;
+                if (image_list_add(list, line))
+                        goto err_out;
+        }
+        if (ferror(fp)) {
+                fprintf(stderr, "Unable to read image list %s.\n", list_path);
+                goto err_out;
+        }
+
+        if (line) free(line);
+        if (fp && fp != stdin) fclose(fp);
+        return 0;
+
+ err_out:
+        if (line) free(line);
+        if (fp && fp != stdin) fclose(fp);
+        return -1;
+}
+
+static void
+image_list_free(struct image_list *list)
+{
+        size_t i;
+
+        for (i = 0; i < list->count; i++)
+                free(list->paths[i]);
+        if (list->paths) free(list->paths);
+        memset(list, 0, sizeof(*list));
+}
+
+/* Manifests for detached signing.
+ * One image per line, a hex value, two spaces and the path,
+ * like sha256sum. The value is a digest or a raw signature.
+ */
+static int
+hex_decode(const char *hex, uint8_t *buf, size_t len)
+{
+        unsigned int v;
+        size_t i;
+
+        for (i = 0; i < len; i++) {
+                if (!isxdigit((unsigned char)hex[2 * i]) ||
+                    !isxdigit((unsigned char)hex[2 * i + 1]) ||
+                    sscanf(&hex[2 * i], "%2x", &v) != 1)
+                        return -1;
+                buf[i] = v;
+        }
+
+        return 0;
+}
+
+/* Read a manifest into list, with the values of len bytes in *vals. */
+static int
+manifest_read(struct image_list *list, const char *path, size_t len,
+              uint8_t **vals)
+{
+        FILE *fp = NULL;
+        char *line = NULL;
+        uint8_t *v;
+        size_t size = 0, lineno = 0;
+        ssize_t n;
+
+        if (!strcmp(path, "-")) {
+                fp = stdin;
+        } else if (!(fp = fopen(path, "r"))) {
+                fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+                goto err_out;
+        }
+        while ((n = getline(&line, &size, fp)) > 0) {
+                lineno++;
+                if (line[n - 1] == '\n')
+                        line[--n] = '\0';
+                /* Skip empty lines */
+                if (!n)
+                        continue;
+                if ((size_t)n < 2 * len + 3 || line[2 * len] != ' ' ||
+                    (line[2 * len + 1] != ' ' && line[2 * len + 1] != '*')) {
+                        fprintf(stderr, "%s:%zu: Malformed manifest line.\n",
+                                path, lineno);
+                        goto err_out;
+                }
+                if (image_list_add(list, &line[2 * len + 2]))
+                        goto err_out;
+                if (!(v = realloc(*vals, list->size * len))) {
+                        fprintf(stderr, "Unable to allocate manifest.\n");
+                        goto err_out;
+                }
+                *vals = v;
+                if (hex_decode(line, &v[(list->count - 1) * len], len)) {
+                        fprintf(stderr, "%s:%zu: Malformed manifest line.\n",
+                                path, lineno);
+                        goto err_out;
+                }
+        }
+        if (ferror(fp)) {
+                fprintf(stderr, "Unable to read manifest %s.\n", path);
+                goto err_out;
+        }
+
+        if (line) free(line);
+        if (fp && fp != stdin) fclose(fp);
+        return 0;
+
+ err_out:
+        if (line) free(line);
+        if (fp && fp != stdin) fclose(fp);
+        return -1;
+}
+
+/* Write a manifest of list with the values of len bytes in vals. */
+static int
+manifest_write(const struct image_list *list, const char *path, size_t len,
+               const uint8_t *vals)
+{
+        FILE *fp = NULL;
+        size_t i, j;
+
+        if (!strcmp(path, "-")) {
+                fp = stdout;
+        } else if (!(fp = fopen(path, "w"))) {
+                fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+                goto err_out;
+        }
+        for (i = 0; i < list->count; i++) {
+                for (j = 0; j < len; j++)
+                        fprintf(fp, "%02x", vals[i * len + j]);
+                fprintf(fp, "  %s\n", list->paths[i]);
+        }
+        if (fflush(fp) || ferror(fp)) {
+                fprintf(stderr, "Unable to write manifest %s.\n", path);
+                goto err_out;
+        }
+
+        if (fp != stdout && fclose(fp)) {
+                fp = NULL;
+                fprintf(stderr, "Unable to write manifest %s.\n", path);
+                goto err_out;
+        }
+        return 0;
+
+ err_out:
+        if (fp && fp != stdout) fclose(fp);
+        return -1;
+}
+
+/* Detached signing.
+ * The build host patches the header and emits the digests, the
+ * signer signs only digests, and the build host imports the
+ * signatures. The images never leave the build host.
+ */
+enum detached_op {
+        DETACHED_NONE,
+        DETACHED_EMIT,
+        DETACHED_SIGN,
+        DETACHED_IMPORT,
+};
+
+/* Batch of images sharing one key and one operation. */
+struct batch {
+        struct image_list *images;
+        EC_KEY *eckey;
+        const uint8_t *pubkey;
+        int alg;
+        struct nonce_pool *nonces;
+        const char *sock_path;
+        bool sign;
+        bool stream;
+        bool digest_only;
+        /* Hash only the declared image_length. */
+        bool declared;
+        /* fdatasync the header after writing it. */
+        bool sync;
+        /* Write signed copies here instead of signing in situ.
+         * A directory when output_dir, otherwise a file.
+         */
+        const char *output;
+        bool output_dir;
+        /* Detached signing. Digests and signatures, one per image. */
+        enum detached_op detached;
+        uint8_t *digests;
+        uint8_t *signatures;
+        /* Midstate checkpoint interval in bytes, 0 for none. */
+        size_t checkpoint;
+        /* Sidecar MAC key, from the private key. */
+        uint8_t ck_key[SHA256_HASH_SIZE];
+        /* RFC 6979 nonces. */
+        bool deterministic;
+        /* Results of earlier runs, or NULL. */
+        struct cache *cache;
+        /* Images per job, hashed side by side. */
+        size_t group;
+        /* The header must carry pubkey, as the boot ROM uses that one. */
+        bool header_key;
+};
+
+/* One image being worked on.
+ * h points at hdr, a copy of the header. The payload is mapped,
+ * or read in chunks when streaming.
+ */
+struct stm32image {
+        int fd;
+        off_t len;
+        unsigned char *data;
+        struct stm32_header *h;
+        struct stm32_header hdr;
+        bool stream;
+        /* For the probes. Not owned, "-" for bare fds. */
+        const char *path;
+        /* Payload checksum, from the last hash. */
+        uint32_t checksum;
+        /* Signed copy being written, see stm32image_output_begin. */
+        struct outfile out;
+        /* Checkpoint sidecar, see stm32image_ck_sha256. */
+        char *ck_path;
+        size_t ck_interval;
+        const uint8_t *ck_key;
+};
+
+/* Take over an open image fd, opened from path.
+ * The fd is closed by stm32image_close, also on failure.
+ */
+static int
+stm32image_attach(struct stm32image *img, const char *path, int fd,
+                  bool writable, bool stream, bool declared)
+{
+        memset(img, 0, sizeof(*img));
+        img->fd = fd;
+        img->out.fd = -1;
+        img->stream = stream;
+        img->path = path ? path : "-";
+        PROBE1(image__load__start, img->path);
+        /* Load and validate image magic. */
+        if (stream) {
+                if (stm32image_read_header(img->fd, &img->hdr, &img->len,
+                                           declared))
+                        goto err_out;
+                img->h = &img->hdr;
+        } else {
+                if (!(img->data = stm32image_load(img->fd, &img->len,
+                                                  declared, writable)))
+                        goto err_out;
+                /* Modify a copy of the header.
+                 * Don't forget header endians.
+                 */
+                memcpy(&img->hdr, img->data, sizeof(img->hdr));
+                img->h = &img->hdr;
+        }
+        PROBE3(image__load__done, img->path, img->len, 0);
+
+        return 0;
+
+ err_out:
+        PROBE3(image__load__done, img->path, img->len, -1);
+        if (img->fd >= 0) close(img->fd);
+        img->fd = -1;
+        return -1;
+}
+
+static int
+stm32image_open(struct stm32image *img, const char *path,
+                bool writable, bool stream, bool declared)
+{
+        int fd;
+
+        if ((fd = open(path, writable ? O_RDWR : O_RDONLY)) < 0) {
+                fprintf(stderr, "Error: Cannot open %s: %s\n",
+                        path, strerror(errno));
+                memset(img, 0, sizeof(*img));
+                img->fd = -1;
+                img->out.fd = -1;
+                return -1;
+        }
+
+        return stm32image_attach(img, path, fd, writable, stream, declared);
+}
+
+/* Midstate checkpoints.
+ * The hashed range is cut into segments of a fixed size. The sidecar
+ * keeps the SHA-256 state and the payload checksum at the end of every
+ * segment, with the SHA-256 of its bytes. Re-hashing resumes after
+ * the last segment that still has its digest, so an image patched
+ * late only has its tail hashed again. The segment digests are
+ * independent, they go through the multi-buffer engine.
+ * A planted midstate would get a digest signed that is not the one of
+ * the image. The sidecar is only used when it belongs to the caller,
+ * is mode 0600 and carries an HMAC keyed from the signing key.
+ */
+#define CK_MAGIC                        "STM32CK2"
+#define CK_SUFFIX                       ".sha256ck"
+#define CK_HEAD_LEN                     (sizeof(struct stm32_header) - \
+                                         STM32_HASH_OFFSET)
+
+struct ck_file_header {
+        char magic[8];
+        uint32_t interval;
+        uint32_t count;
+        /* The hashed part of the header. Any change voids all states. */
+        uint8_t head[CK_HEAD_LEN];
+        /* HMAC-SHA256 of the header, with mac zeroed, and the entries. */
+        uint8_t mac[SHA256_HASH_SIZE];
+};
+
+struct ck_entry {
+        uint32_t state[8];
+        uint8_t fingerprint[SHA256_HASH_SIZE];
+        uint32_t checksum;
+        uint32_t reserved;
+};
+
+/* The sidecar MAC key. Only the holder of the private key can make a
+ * sidecar that is used.
+ */
+static int
+ck_key_derive(const EC_KEY *eckey, uint8_t *key)
+{
+        static const char label[] = "stm32mp1sign checkpoint";
+        struct sha256_ctx sha;
+        uint8_t x[SHA256_HASH_SIZE];
+
+        if (BN_bn2binpad(EC_KEY_get0_private_key(eckey), x, sizeof(x)) < 0) {
+                fprintf(stderr, "Unable to derive checkpoint key.\n");
+                return -1;
+        }
+        sha256_init(&sha);
+        sha256_update(&sha, label, sizeof(label));
+        sha256_update(&sha, x, sizeof(x));
+        sha256_final(&sha, key);
+        OPENSSL_cleanse(x, sizeof(x));
+        OPENSSL_cleanse(&sha, sizeof(sha));
+
+        return 0;
+}
+
+/* HMAC-SHA256 of the sidecar header, mac taken as zero, and n entries. */
+static void
+ck_mac(const uint8_t *key, const struct ck_file_header *fh,
+       const struct ck_entry *ck, size_t n, uint8_t *mac)
+{
+        static const uint8_t zero[SHA256_HASH_SIZE];
+        struct sha256_ctx sha;
+        uint8_t pad[SHA256_BLOCK_SIZE];
+        size_t i;
+
+        memset(pad, 0x36, sizeof(pad));
+        for (i = 0; i < SHA256_HASH_SIZE; i++)
+                pad[i] ^= key[i];
+        sha256_init(&sha);
+        sha256_update(&sha, pad, sizeof(pad));
+        sha256_update(&sha, fh, offsetof(struct ck_file_header, mac));
+        sha256_update(&sha, zero, sizeof(zero));
+        sha256_update(&sha, ck, n * sizeof(*ck));
+        sha256_final(&sha, mac);
+        for (i = 0; i < sizeof(pad); i++)
+                pad[i] ^= 0x36 ^ 0x5c;
+        sha256_init(&sha);
+        sha256_update(&sha, pad, sizeof(pad));
+        sha256_update(&sha, mac, SHA256_HASH_SIZE);
+        sha256_final(&sha, mac);
+        OPENSSL_cleanse(pad, sizeof(pad));
+        OPENSSL_cleanse(&sha, sizeof(sha));
+}
+
+/* SHA-256 of segments [first, last) into ck[i].fingerprint, or into
+ * md[i - first] when md is set. Segment i is payload
+ * [i * interval - head, (i + 1) * interval - head).
+ */
+static void
+stm32image_ck_fingerprint(const struct stm32image *img, struct ck_entry *ck,
+                          uint8_t (*md)[SHA256_HASH_SIZE], size_t first,
+                          size_t last)
+{
+        struct sha256_mb_job jobs[SHA256_MB_MAX_LANES];
+        const uint8_t *p = &img->data[sizeof(*img->h)];
+        size_t i, j, n;
+
+        for (i = first; i < last; i += n) {
+                n = last - i < SHA256_MB_MAX_LANES ? last - i :
+                        SHA256_MB_MAX_LANES;
+                memset(jobs, 0, n * sizeof(*jobs));
+                for (j = 0; j < n; j++) {
+                        jobs[j].data = &p[i + j ? (i + j) * img->ck_interval -
+                                          CK_HEAD_LEN : 0];
+                        jobs[j].len = img->ck_interval -
+                                (i + j ? 0 : CK_HEAD_LEN);
+                }
+                sha256_mb(jobs, n);
+                for (j = 0; j < n; j++)
+                        memcpy(md ? md[i + j - first] : ck[i + j].fingerprint,
+                               jobs[j].md, SHA256_HASH_SIZE);
+        }
+}
+
+/* Hash payload [from, to), summing the part before plen. */
+static void
+stm32image_hash_payload(struct sha256_ctx *sha, const struct stm32image *img,
+                        size_t from, size_t to, size_t plen, uint32_t *sum)
+{
+        const uint8_t *p = &img->data[sizeof(*img->h)];
+        size_t mid = to < plen ? to : plen;
+
+        if (from < mid) {
+                sha256_update_sum(sha, &p[from], mid - from, sum);
+                from = mid;
+        }
+        sha256_update(sha, &p[from], to - from);
+}
+
+/* Read the usable entries of the sidecar into ck. Returns the number
+ * of leading segments that are unchanged in the image.
+ */
+static size_t
+stm32image_ck_load(const struct stm32image *img, struct ck_entry *ck,
+                   size_t nseg)
+{
+        struct ck_file_header fh;
+        uint8_t mac[SHA256_HASH_SIZE], (*md)[SHA256_HASH_SIZE] = NULL;
+        struct stat st;
+        size_t i, n = 0;
+        ssize_t len;
+        int fd;
+
+        if ((fd = open(img->ck_path, O_RDONLY | O_NOFOLLOW)) < 0)
+                return 0;
+        if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+            st.st_uid != geteuid() || (st.st_mode & 07777) != 0600) {
+                fprintf(stderr, "Warn: Ignoring checkpoints %s, not owned "
+                        "by the user with mode 0600.\n", img->ck_path);
+                goto out;
+        }
+        if (pread_full(fd, &fh, sizeof(fh), 0) != (ssize_t)sizeof(fh) ||
+            memcmp(fh.magic, CK_MAGIC, sizeof(fh.magic)) ||
+            fh.interval != img->ck_interval || fh.count > nseg ||
+            memcmp(fh.head, (uint8_t *)img->h + STM32_HASH_OFFSET,
+                   CK_HEAD_LEN)) {
+                goto out;
+        }
+        len = fh.count * sizeof(*ck);
+        if (pread_full(fd, ck, len, sizeof(fh)) != len)
+                goto out;
+        ck_mac(img->ck_key, &fh, ck, fh.count, mac);
+        if (CRYPTO_memcmp(mac, fh.mac, sizeof(mac))) {
+                fprintf(stderr, "Warn: Ignoring checkpoints %s, bad MAC.\n",
+                        img->ck_path);
+                goto out;
+        }
+        if (fh.count && !(md = calloc(fh.count, sizeof(*md))))
+                goto out;
+        stm32image_ck_fingerprint(img, ck, md, 0, fh.count);
+        for (i = 0; i < fh.count; i++) {
+                if (memcmp(md[i], ck[i].fingerprint, sizeof(md[i])))
+                        break;
+        }
+        n = i;
+
+ out:
+        if (md) free(md);
+        close(fd);
+        return n;
+}
+
+/* Replace the sidecar. A failure only costs the next run a full hash. */
+static void
+stm32image_ck_store(const struct stm32image *img, const struct ck_entry *ck,
+                    size_t nseg)
+{
+        struct ck_file_header fh;
+        struct outfile of;
+        size_t len = nseg * sizeof(*ck);
+
+        memset(&fh, 0, sizeof(fh));
+        memcpy(fh.magic, CK_MAGIC, sizeof(fh.magic));
+        fh.interval = img->ck_interval;
+        fh.count = nseg;
+        memcpy(fh.head, (uint8_t *)img->h + STM32_HASH_OFFSET, CK_HEAD_LEN);
+        ck_mac(img->ck_key, &fh, ck, nseg, fh.mac);
+        if (outfile_open(&of, img->ck_path, 0600))
+                goto err_out;
+        if (pwrite(of.fd, &fh, sizeof(fh), 0) != (ssize_t)sizeof(fh) ||
+            pwrite(of.fd, ck, len, sizeof(fh)) != (ssize_t)len ||
+            outfile_commit(&of, img->ck_path)) {
+                outfile_close(&of);
+                goto err_out;
+        }
+
+        outfile_close(&of);
+        return;
+
+ err_out:
+        fprintf(stderr, "Warn: Unable to write checkpoints %s.\n",
+                img->ck_path);
+}
+
+/* sha256 of a mapped image, resumed from the checkpoint sidecar. */
+static int
+stm32image_ck_sha256(struct stm32image *img, unsigned char *md)
+{
+        struct sha256_ctx sha;
+        struct ck_entry *ck;
+        size_t plen, tail, nseg, skip, i, from;
+
+        plen = stm32image_payload_len(img->h, img->len);
+        tail = img->len - sizeof(*img->h);
+        nseg = (img->len - STM32_HASH_OFFSET) / img->ck_interval;
+        if (!(ck = calloc(nseg ? nseg : 1, sizeof(*ck)))) {
+                fprintf(stderr, "Unable to allocate checkpoints.\n");
+                return -1;
+        }
+        skip = stm32image_ck_load(img, ck, nseg);
+
+        sha256_init(&sha);
+        if (skip) {
+                memcpy(sha.state, ck[skip - 1].state, sizeof(sha.state));
+                sha.count = skip * img->ck_interval;
+                img->checksum = ck[skip - 1].checksum;
+        } else {
+                img->checksum = 0;
+                sha256_update(&sha, (uint8_t *)img->h + STM32_HASH_OFFSET,
+                              CK_HEAD_LEN);
+        }
+        for (i = skip; i < nseg; i++) {
+                from = i ? i * img->ck_interval - CK_HEAD_LEN : 0;
+                stm32image_hash_payload(&sha, img, from,
+                                        (i + 1) * img->ck_interval -
+                                        CK_HEAD_LEN, plen, &img->checksum);
+                memcpy(ck[i].state, sha.state, sizeof(ck[i].state));
+                ck[i].checksum = img->checksum;
+        }
+        stm32image_ck_fingerprint(img, ck, NULL, skip, nseg);
+        from = nseg ? nseg * img->ck_interval - CK_HEAD_LEN : 0;
+        stm32image_hash_payload(&sha, img, from, tail, plen, &img->checksum);
+        sha256_final(&sha, md);
+
+        if (skip < nseg)
+                stm32image_ck_store(img, ck, nseg);
+        free(ck);
+
+        return 0;
+}
+
+/* sha256 from correct offset in header to end of data.
+ * The payload checksum comes along in the same pass.
+ */
+static int
+stm32image_sha256(struct stm32image *img, unsigned char *md)
+{
+        struct sha256_ctx sha;
+        size_t hlen = sizeof(*img->h), plen;
+
+        if (img->stream)
+                return stm32image_stream_sha256(img->fd, img->h, img->len, md,
+                                                &img->checksum);
+        if (img->ck_path)
+                return stm32image_ck_sha256(img, md);
+
+        plen = stm32image_payload_len(img->h, img->len);
+        img->checksum = 0;
+        sha256_init(&sha);
+        sha256_update(&sha, (uint8_t *)img->h + STM32_HASH_OFFSET,
+                      hlen - STM32_HASH_OFFSET);
+        sha256_update_sum(&sha, &img->data[hlen], plen, &img->checksum);
+        sha256_update(&sha, &img->data[hlen + plen], img->len - hlen - plen);
+        sha256_final(&sha, md);
+
+        return 0;
+}
+
+/* The boot ROM checks the payload checksum too.
+ * Compare the header against the one from the last hash.
+ */
+static int
+stm32image_check_checksum(const struct stm32image *img)
+{
+        if (le32toh(img->h->image_checksum) != img->checksum) {
+                fprintf(stderr, "Image checksum mismatch. "
+                        "Header: 0x%08" PRIx32 ", payload: 0x%08" PRIx32 ".\n",
+                        le32toh(img->h->image_checksum), img->checksum);
+                return -1;
+        }
+
+        return 0;
+}
+
+/* Write back the header copy. The payload is never written.
+ * The header goes to the signed copy, if there is one.
+ * With sync, wait for it to reach storage. Only the header page is dirty.
+ */
+static int
+stm32image_writeback(struct stm32image *img, bool sync)
+{
+        int fd = img->out.fd >= 0 ? img->out.fd : img->fd;
+
+        if (pwrite(fd, img->h, sizeof(*img->h), 0) !=
+            (ssize_t)sizeof(*img->h)) {
+                fprintf(stderr, "Unable to write stm32 header: %s\n",
+                        strerror(errno));
+                return -1;
+        }
+        if (sync && fdatasync(fd)) {
+                fprintf(stderr, "Unable to sync stm32 header: %s\n",
+                        strerror(errno));
+                return -1;
+        }
+
+        return 0;
+}
+
+static void
+stm32image_close(struct stm32image *img)
+{
+        if (img->data) munmap(img->data, img->len);
+        if (img->fd >= 0) close(img->fd);
+        outfile_close(&img->out);
+        if (img->ck_path) free(img->ck_path);
+        img->ck_path = NULL;
+        img->data = NULL;
+        img->fd = -1;
+}
+
+/* Copy all of in to out.
+ * A reflink where the filesystem can share extents, which only
+ * touches metadata. Otherwise an in-kernel copy, and as a last
+ * resort, across filesystems on older kernels, a plain one.
+ */
+static int
+file_clone(int in, int out, off_t len)
+{
+        unsigned char buf[64 * 1024];
+        off_t in_off = 0, out_off = 0;
+        ssize_t n = -1;
+
+        if (!ioctl(out, FICLONE, in))
+                return 0;
+        while (in_off < len) {
+                n = copy_file_range(in, &in_off, out, &out_off,
+                                    len - in_off, 0);
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0)
+                        break;
+        }
+        if (in_off == len)
+                return 0;
+        if (!n)
+                goto short_copy;
+        if (errno != EXDEV && errno != ENOSYS && errno != EINVAL &&
+            errno != EOPNOTSUPP) {
+                return -1;
+        }
+        while (in_off < len) {
+                if ((n = pread_full(in, buf, len - in_off < (off_t)sizeof(buf) ?
+                                    (size_t)(len - in_off) : sizeof(buf),
+                                    in_off)) < 0)
+                        return -1;
+                if (!n)
+                        goto short_copy;
+                if (pwrite(out, buf, n, in_off) != n)
+                        return -1;
+                in_off += n;
+        }
+
+        return 0;
+
+ short_copy:
+        /* End of file before len. The image shrunk under us, and
+         * errno is whatever an earlier call left there.
+         */
+        errno = EIO;
+        return -1;
+}
+
+/* Start a signed copy at out of an open image, see outfile.c.
+ * The signed header is written to it by stm32image_writeback.
+ */
+static int
+stm32image_output_begin(struct stm32image *img, const char *out)
+{
+        struct stat st;
+
+        if (fstat(img->fd, &st)) {
+                fprintf(stderr, "Cannot stat image: %s\n", strerror(errno));
+                return -1;
+        }
+        if (outfile_open(&img->out, out, st.st_mode & 0777)) {
+                fprintf(stderr, "Cannot create %s: %s\n", out,
+                        strerror(errno));
+                return -1;
+        }
+        if (file_clone(img->fd, img->out.fd, st.st_size)) {
+                fprintf(stderr, "Cannot copy image to %s: %s\n", out,
+                        strerror(errno));
+                return -1;
+        }
+
+        return 0;
+}
+
+/* Put the signed copy in place, replacing out atomically. */
+static int
+stm32image_output_commit(struct stm32image *img, const char *out)
+{
+        if (outfile_commit(&img->out, out)) {
+                fprintf(stderr, "Cannot write %s: %s\n", out,
+                        strerror(errno));
+                return -1;
+        }
+
+        return 0;
+}
+
+/* Fill in the signing part of the header.
+ * Must be done before hashing, it is part of the hashed range.
+ * pubkey is the raw uncompressed ec point, without the type byte.
+ */
+static void
+stm32image_set_pubkey(struct stm32_header *h, const uint8_t *pubkey, int alg)
+{
+        /* Copy raw pubkey to header.
+         * Raw bignum. Two points on curve. X concatenated with Y.
+         */
+        memcpy(h->ecdsa_public_key, pubkey, EC_POINT_UNCOMPRESSED_LEN - 1);
+        /* option:
+         * 0: signed.
+         * 1: not signed.
+         */
+        h->option_flags = htole32(0);
+        /* Algorithm:
+         * 1: prime256v1
+         * 2: brainpoolP256r1
+         */
+        h->ecdsa_algorithm = htole32(alg);
+}
+
+/* Raw signature format used in the header.
+ * Raw bignum. Two numbers. R concatenated with S.
+ */
+static void
+openssl_sig_to_raw(const ECDSA_SIG *ecsig, uint8_t *raw)
+{
+        BN_bn2binpad(ECDSA_SIG_get0_r(ecsig), &raw[0], 32);
+        BN_bn2binpad(ECDSA_SIG_get0_s(ecsig), &raw[32], 32);
+}
+
+static int
+openssl_sig_from_raw(ECDSA_SIG *ecsig, const uint8_t *raw)
+{
+        BIGNUM *r = NULL, *s = NULL;
+
+        if (!(r = BN_bin2bn(&raw[0], 32, NULL)) ||
+            !(s = BN_bin2bn(&raw[32], 32, NULL)) ||
+            !ECDSA_SIG_set0(ecsig, r, s)) {
+                fprintf(stderr, "Unable to load ECDSA signature.\n");
+                if (r) BN_free(r);
+                if (s) BN_free(s);
+                return -1;
+        }
+
+        return 0;
+}
+
+/* Result cache keys.
+ * Results only hold for the same key, operation and hashed range.
+ * A stat key stands for an unchanged file, ctime catches any write
+ * even when mtime is set back. A digest key stands for the content,
+ * for verification together with the signature that was checked.
+ */
+enum batch_cache_kind {
+        BATCH_CACHE_STAT = 'S',
+        BATCH_CACHE_DIGEST = 'D',
+};
+
+static void
+batch_cache_key(const struct batch *b, enum batch_cache_kind kind,
+                const void *id, size_t len, const void *id2, size_t len2,
+                uint8_t *key)
+{
+        struct sha256_ctx sha;
+        /* Random and deterministic signatures of a digest differ. Only
+         * the signer cares, a verify result holds for either. A plain
+         * verify does not check the header key, --verify-chain does.
+         */
+        uint8_t op[6] = { kind, b->sign, b->declared, b->alg,
+                          b->sign && b->deterministic, b->header_key };
+
+        sha256_init(&sha);
+        sha256_update(&sha, op, sizeof(op));
+        sha256_update(&sha, b->pubkey, EC_POINT_UNCOMPRESSED_LEN - 1);
+        sha256_update(&sha, id, len);
+        sha256_update(&sha, id2, len2);
+        sha256_final(&sha, key);
+}
+
+static void
+batch_cache_stat_key(const struct batch *b, const struct stat *st,
+                     uint8_t *key)
+{
+        uint64_t id[7] = {
+                st->st_dev, st->st_ino, st->st_size,
+                st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+                st->st_ctim.tv_sec, st->st_ctim.tv_nsec,
+        };
+
+        batch_cache_key(b, BATCH_CACHE_STAT, id, sizeof(id), NULL, 0, key);
+}
+
+/* Stat keys need the image itself to be the result. */
+static bool
+batch_cache_by_stat(const struct batch *b)
+{
+        return b->cache && !b->output && b->detached == DETACHED_NONE;
+}
+
+/* Unchanged since it was signed or verified with this key. */
+static bool
+batch_cache_stat_hit(const struct batch *b, const char *path)
+{
+        uint8_t key[CACHE_KEY_SIZE], val[CACHE_VAL_SIZE];
+        struct stat st;
+
+        if (!batch_cache_by_stat(b) || stat(path, &st))
+                return false;
+        batch_cache_stat_key(b, &st, key);
+        if (!cache_get(b->cache, key, val))
+                return false;
+        stats_add_cache_hit();
+
+        return true;
+}
+
+/* Record an image as done. st is from before hashing when verifying,
+ * a change during the hash must not inherit the verdict.
+ */
+static void
+batch_cache_stat_put(const struct batch *b, const struct stat *st,
+                     const struct stm32image *img)
+{
+        uint8_t key[CACHE_KEY_SIZE], val[CACHE_VAL_SIZE];
+
+        if (!batch_cache_by_stat(b))
+                return;
+        batch_cache_stat_key(b, st, key);
+        memcpy(val, img->h->image_signature, ECDSA_SIG_RAW_LEN);
+        cache_put(b->cache, key, val);
+}
+
+/* Sign the digest of an open image and write the signature back. */
+static int
+stm32image_sign_digest(struct worker_ctx *wctx, const struct batch *b,
+                       struct stm32image *img, const unsigned char *md)
+{
+        ECDSA_SIG *ecsig = NULL;
+        uint64_t t;
+
+        uint8_t key[CACHE_KEY_SIZE], val[CACHE_VAL_SIZE];
+
+        /* Not part of the hashed range. Fine to set afterwards. */
+        img->h->image_checksum = htole32(img->checksum);
+        batch_cache_key(b, BATCH_CACHE_DIGEST, md, SHA256_DIGEST_LENGTH,
+                        NULL, 0, key);
+        /* A cached signature is checked before it goes into an image.
+         * One that does not verify is signed again.
+         */
+        if (cache_get(b->cache, key, val) &&
+            !openssl_sig_from_raw(wctx->ecsig, val) &&
+            ECDSA_do_verify(md, SHA256_DIGEST_LENGTH, wctx->ecsig,
+                            b->eckey) == 1) {
+                stats_add_cache_hit();
+                memcpy(img->h->image_signature, val, ECDSA_SIG_RAW_LEN);
+        } else {
+                t = stats_now();
+                if (!(ecsig = openssl_do_ecdsa_sha256_sign(b->eckey,
+                                                           wctx->bnctx,
+                                                           b->nonces,
+                                                           b->deterministic,
+                                                           md, img->path))) {
+                        goto err_out;
+                }
+                stats_add(STATS_ECDSA, t);
+                /* Copy signature to header. */
+                openssl_sig_to_raw(ecsig, img->h->image_signature);
+                memcpy(val, img->h->image_signature, ECDSA_SIG_RAW_LEN);
+                cache_put(b->cache, key, val);
+        }
+        t = stats_now();
+        if (stm32image_writeback(img, b->sync)) {
+                goto err_out;
+        }
+        stats_add(STATS_WRITEBACK, t);
+        stats_add_image(img->len - STM32_HASH_OFFSET);
+
+        ECDSA_SIG_free(ecsig);
+        return 0;
+
+ err_out:
+        if (ecsig) ECDSA_SIG_free(ecsig);
+        return -1;
+}
+
+/* Check an imported signature against the digest of an open image
+ * and write it back. The key has no private part.
+ */
+static int
+stm32image_import_digest(struct worker_ctx *wctx, const struct batch *b,
+                         struct stm32image *img, const unsigned char *md,
+                         const uint8_t *sig)
+{
+        uint64_t t;
+
+        img->h->image_checksum = htole32(img->checksum);
+        if (openssl_sig_from_raw(wctx->ecsig, sig)) {
+                return -1;
+        }
+        t = stats_now();
+        if (!openssl_do_ecdsa_sha256_verify(wctx->ecsig, b->eckey, md,
+                                            img->path)) {
+                fprintf(stderr, "Imported signature does not match the image.\n");
+                return -1;
+        }
+        stats_add(STATS_ECDSA, t);
+        memcpy(img->h->image_signature, sig, ECDSA_SIG_RAW_LEN);
+        t = stats_now();
+        if (stm32image_writeback(img, b->sync)) {
+                return -1;
+        }
+        stats_add(STATS_WRITEBACK, t);
+        stats_add_image(img->len - STM32_HASH_OFFSET);
+
+        return 0;
+}
+
+/* Hand out the digest of an open image, job of the batch.
+ * The patched header goes back without a signature, so that the
+ * signature imported later covers what is in the image.
+ */
+static int
+stm32image_emit_digest(const struct batch *b, struct stm32image *img,
+                       const unsigned char *md, size_t job)
+{
+        uint64_t t;
+
+        img->h->image_checksum = htole32(img->checksum);
+        memcpy(&b->digests[job * SHA256_DIGEST_LENGTH], md,
+               SHA256_DIGEST_LENGTH);
+        t = stats_now();
+        if (stm32image_writeback(img, b->sync)) {
+                return -1;
+        }
+        stats_add(STATS_WRITEBACK, t);
+        stats_add_image(img->len - STM32_HASH_OFFSET);
+
+        return 0;
+}
+
+/* Finish signing the digest of an open image, job of the batch. */
+static int
+stm32image_sign_job(struct worker_ctx *wctx, const struct batch *b,
+                    struct stm32image *img, const unsigned char *md,
+                    size_t job)
+{
+        switch (b->detached) {
+        case DETACHED_EMIT:
+                return stm32image_emit_digest(b, img, md, job);
+        case DETACHED_IMPORT:
+                return stm32image_import_digest(wctx, b, img, md,
+                                                &b->signatures[job *
+                                                ECDSA_SIG_RAW_LEN]);
+        default:
+                return stm32image_sign_digest(wctx, b, img, md);
+        }
+}
+
+/* Sign an open image, job of the batch. The image stays open. */
+static int
+stm32image_do_sign(struct worker_ctx *wctx, const struct batch *b,
+                   struct stm32image *img, size_t job)
+{
+        unsigned char md[SHA256_DIGEST_LENGTH];
+        uint64_t t;
+
+        stm32image_set_pubkey(img->h, b->pubkey, b->alg);
+        /* Do ECDSA signature with sha256
+         * from correct offset in header to end of data.
+         */
+        t = stats_now();
+        if (stm32image_sha256(img, md)) {
+                return -1;
+        }
+        stats_add(STATS_HASH, t);
+
+        return stm32image_sign_job(wctx, b, img, md, job);
+}
+
+/* Check the header signature of an open image against its digest. */
+static int
+stm32image_verify_digest(struct worker_ctx *wctx, const struct batch *b,
+                         struct stm32image *img, const unsigned char *md)
+{
+        uint8_t key[CACHE_KEY_SIZE], val[CACHE_VAL_SIZE];
+        uint64_t t;
+
+        if (stm32image_check_checksum(img)) {
+                return -1;
+        }
+        if (b->header_key &&
+            (memcmp(img->h->ecdsa_public_key, b->pubkey,
+                    EC_POINT_UNCOMPRESSED_LEN - 1) ||
+             le32toh(img->h->ecdsa_algorithm) != (uint32_t)b->alg)) {
+                fprintf(stderr, "%s: Header key is not the ROT key.\n",
+                        img->path);
+                return -1;
+        }
+        batch_cache_key(b, BATCH_CACHE_DIGEST, md, SHA256_DIGEST_LENGTH,
+                        img->h->image_signature, ECDSA_SIG_RAW_LEN, key);
+        if (cache_get(b->cache, key, val)) {
+                stats_add_cache_hit();
+                stats_add_image(img->len - STM32_HASH_OFFSET);
+                return 0;
+        }
+        /* Get signature from header into the workers ecsig. */
+        if (openssl_sig_from_raw(wctx->ecsig, img->h->image_signature)) {
+                return -1;
+        }
+        t = stats_now();
+        if (!openssl_do_ecdsa_sha256_verify(wctx->ecsig, b->eckey, md,
+                                            img->path)) {
+                return -1;
+        }
+        stats_add(STATS_ECDSA, t);
+        memset(val, 0, sizeof(val));
+        cache_put(b->cache, key, val);
+        stats_add_image(img->len - STM32_HASH_OFFSET);
+
+        return 0;
+}
+
+/* Verify an open image. The image stays open. */
+static int
+stm32image_do_verify(struct worker_ctx *wctx, const struct batch *b,
+                     struct stm32image *img)
+{
+        unsigned char md[SHA256_DIGEST_LENGTH];
+        uint64_t t;
+
+        /* Do ECDSA verification with sha256
+         * from correct offset in header to end of data.
+         */
+        t = stats_now();
+        if (stm32image_sha256(img, md)) {
+                return -1;
+        }
+        stats_add(STATS_HASH, t);
+
+        return stm32image_verify_digest(wctx, b, img, md);
+}
+
+/* Where the signed copy of path goes, or NULL to sign in situ. */
+static char *
+batch_output_path(const struct batch *b, const char *path)
+{
+        char *base, *out = NULL;
+
+        if (!b->output)
+                return NULL;
+        if (!b->output_dir)
+                return strdup(b->output);
+        if (!(base = strdup(path)))
+                return NULL;
+        if (asprintf(&out, "%s/%s", b->output, basename(base)) < 0)
+                out = NULL;
+        free(base);
+
+        return out;
+}
+
+/* Open an image for signing.
+ * In situ, or read-only with a signed copy started at out.
+ */
+static int
+stm32image_open_sign(struct stm32image *img, const struct batch *b,
+                     const char *path, const char *out)
+{
+        if (stm32image_open(img, path, !out, b->stream, b->declared)) {
+                return -1;
+        }
+        if (out && stm32image_output_begin(img, out)) {
+                return -1;
+        }
+
+        return 0;
+}
+
+/* Sign one image, in situ or into a copy. */
+static int
+stm32image_sign(struct worker_ctx *wctx, const struct batch *b,
+                const char *path, size_t job)
+{
+        struct stm32image img;
+        struct stat st;
+        char *out = NULL;
+        uint64_t t;
+        int ret = -1;
+
+        if (batch_cache_stat_hit(b, path))
+                return 0;
+        t = stats_now();
+        if (b->output && !(out = batch_output_path(b, path))) {
+                fprintf(stderr, "Unable to allocate output path.\n");
+                return -1;
+        }
+        if (!stm32image_open_sign(&img, b, path, out)) {
+                stats_add(STATS_LOAD, t);
+                if (b->checkpoint &&
+                    asprintf(&img.ck_path, "%s" CK_SUFFIX, path) < 0) {
+                        img.ck_path = NULL;
+                        fprintf(stderr, "Unable to allocate checkpoint path.\n");
+                        goto out;
+                }
+                img.ck_interval = b->checkpoint;
+                img.ck_key = b->ck_key;
+                ret = stm32image_do_sign(wctx, b, &img, job);
+                if (!ret && out)
+                        ret = stm32image_output_commit(&img, out);
+                if (!ret && !fstat(img.fd, &st))
+                        batch_cache_stat_put(b, &st, &img);
+        }
+ out:
+        stm32image_close(&img);
+        if (out) free(out);
+
+        return ret;
+}
+
+static int
+stm32image_verify(struct worker_ctx *wctx, const struct batch *b,
+                  const char *path)
+{
+        struct stm32image img;
+        struct stat st;
+        int ret = -1;
+        uint64_t t;
+
+        if (batch_cache_stat_hit(b, path))
+                return 0;
+        t = stats_now();
+        /* Read-only, mapped or streamed. */
+        if (!stm32image_open(&img, path, false, b->stream, b->declared)) {
+                stats_add(STATS_LOAD, t);
+                if (fstat(img.fd, &st))
+                        memset(&st, 0, sizeof(st));
+                ret = stm32image_do_verify(wctx, b, &img);
+                if (!ret && st.st_ino)
+                        batch_cache_stat_put(b, &st, &img);
+        }
+        stm32image_close(&img);
+
+        return ret;
+}
+
+static void *
+batch_worker_init(void *arg UNUSED)
+{
+        struct worker_ctx *wctx;
+
+        if (!(wctx = calloc(1, sizeof(*wctx)))) {
+                fprintf(stderr, "Unable to allocate worker context.\n");
+                goto err_out;
+        }
+        if (!(wctx->bnctx = BN_CTX_new())) {
+                fprintf(stderr, "Unable to allocate bignum context.\n");
+                goto err_out;
+        }
+        if (!(wctx->ecsig = ECDSA_SIG_new())) {
+                fprintf(stderr, "Unable to allocate a ecsig structure.\n");
+                goto err_out;
+        }
+
+        return wctx;
+
+ err_out:
+        if (wctx && wctx->bnctx) BN_CTX_free(wctx->bnctx);
+        if (wctx) free(wctx);
+        return NULL;
+}
+
+static void
+batch_worker_fini(void *data)
+{
+        struct worker_ctx *wctx = data;
+
+        ECDSA_SIG_free(wctx->ecsig);
+        BN_CTX_free(wctx->bnctx);
+        free(wctx);
+}
+
+/* A group of images at once.
+ * All of them are mapped first, so that the multi-buffer engine
+ * can hash them in one pass. Then each is signed or verified.
+ */
+static int
+batch_group_run(struct worker_ctx *wctx, const struct batch *b,
+                size_t first, size_t count)
+{
+        struct stm32image img[SHA256_MB_MAX_LANES];
+        struct sha256_mb_job jobs[SHA256_MB_MAX_LANES];
+        size_t slot[SHA256_MB_MAX_LANES];
+        char *out[SHA256_MB_MAX_LANES] = { NULL };
+        struct stat st[SHA256_MB_MAX_LANES];
+        const char *path;
+        size_t i, n = 0;
+        uint64_t t, start = stats_now();
+        int ret = 0, err;
+
+        for (i = 0; i < count; i++) {
+                path = b->images->paths[first + i];
+                t = stats_now();
+                if (batch_cache_stat_hit(b, path)) {
+                        memset(&img[i], 0, sizeof(img[i]));
+                        img[i].fd = img[i].out.fd = -1;
+                        stats_image_done(first + i, start);
+                        continue;
+                }
+                if (b->sign && b->output &&
+                    !(out[i] = batch_output_path(b, path))) {
+                        fprintf(stderr, "Unable to allocate output path.\n");
+                        memset(&img[i], 0, sizeof(img[i]));
+                        img[i].fd = img[i].out.fd = -1;
+                        err = -1;
+                } else if (b->sign) {
+                        err = stm32image_open_sign(&img[i], b, path, out[i]);
+                } else {
+                        err = stm32image_open(&img[i], path, false, false,
+                                              b->declared);
+                }
+                if (err) {
+                        fprintf(stderr, "%s: %s failed.\n", path,
+                                b->sign ? "Signing" : "Verification");
+                        ret = -1;
+                        continue;
+                }
+                stats_add(STATS_LOAD, t);
+                if (fstat(img[i].fd, &st[i]))
+                        memset(&st[i], 0, sizeof(st[i]));
+                if (b->sign)
+                        stm32image_set_pubkey(img[i].h, b->pubkey, b->alg);
+                /* The header part comes from the patched copy. */
+                jobs[n].head = (uint8_t *)img[i].h + STM32_HASH_OFFSET;
+                jobs[n].head_len = sizeof(*img[i].h) - STM32_HASH_OFFSET;
+                jobs[n].data = &img[i].data[sizeof(*img[i].h)];
+                jobs[n].len = img[i].len - sizeof(*img[i].h);
+                jobs[n].sum_off = 0;
+                jobs[n].sum_len = stm32image_payload_len(img[i].h,
+                                                         img[i].len);
+                slot[n++] = i;
+        }
+
+        t = stats_now();
+        sha256_mb(jobs, n);
+        stats_add(STATS_HASH, t);
+
+        /* Every image of a group waits for the whole group hash. */
+        for (i = 0; i < n; i++) {
+                path = b->images->paths[first + slot[i]];
+                img[slot[i]].checksum = jobs[i].sum;
+                if (b->sign) {
+                        if (stm32image_sign_job(wctx, b, &img[slot[i]],
+                                                jobs[i].md,
+                                                first + slot[i]) ||
+                            (out[slot[i]] &&
+                             stm32image_output_commit(&img[slot[i]],
+                                                      out[slot[i]]))) {
+                                fprintf(stderr, "%s: Signing failed.\n",
+                                        path);
+                                ret = -1;
+                                continue;
+                        }
+                        if (fstat(img[slot[i]].fd, &st[slot[i]]))
+                                continue;
+                } else {
+                        if (stm32image_verify_digest(wctx, b, &img[slot[i]],
+                                                     jobs[i].md)) {
+                                fprintf(stderr, "%s: Verification failed.\n",
+                                        path);
+                                ret = -1;
+                                continue;
+                        }
+                }
+                if (st[slot[i]].st_ino)
+                        batch_cache_stat_put(b, &st[slot[i]], &img[slot[i]]);
+                stats_image_done(first + slot[i], start);
+        }
+
+        for (i = 0; i < count; i++) {
+                stm32image_close(&img[i]);
+                if (out[i]) free(out[i]);
+        }
+
+        return ret;
+}
+
+/* Sign a digest from the manifest. No image is touched. */
+static int
+batch_digest_run(struct worker_ctx *wctx, const struct batch *b, size_t job)
+{
+        ECDSA_SIG *ecsig;
+        uint64_t t = stats_now();
+
+        if (!(ecsig = openssl_do_ecdsa_sha256_sign(b->eckey, wctx->bnctx,
+                                                   b->nonces,
+                                                   b->deterministic,
+                                                   &b->digests[job *
+                                                   SHA256_DIGEST_LENGTH],
+                                                   b->images->paths[job]))) {
+                return -1;
+        }
+        stats_add(STATS_ECDSA, t);
+        openssl_sig_to_raw(ecsig, &b->signatures[job * ECDSA_SIG_RAW_LEN]);
+        ECDSA_SIG_free(ecsig);
+        stats_add_image(0);
+
+        return 0;
+}
+
+static int
+batch_worker_run(void *arg, void *data, size_t job)
+{
+        struct batch *b = arg;
+        struct worker_ctx *wctx = data;
+        const char *path = b->images->paths[job];
+        uint64_t start = stats_now();
+
+        if (b->detached == DETACHED_SIGN) {
+                if (batch_digest_run(wctx, b, job)) {
+                        fprintf(stderr, "%s: Signing failed.\n", path);
+                        return -1;
+                }
+                stats_image_done(job, start);
+                return 0;
+        }
+        if (b->group > 1) {
+                job *= b->group;
+                return batch_group_run(wctx, b, job,
+                                       b->images->count - job < b->group ?
+                                       b->images->count - job : b->group);
+        }
+        if (b->sign) {
+                if (stm32image_sign(wctx, b, path, job)) {
+                        fprintf(stderr, "%s: Signing failed.\n", path);
+                        return -1;
+                }
+        } else {
+                if (stm32image_verify(wctx, b, path)) {
+                        fprintf(stderr, "%s: Verification failed.\n", path);
+                        return -1;
+                }
+        }
+        stats_image_done(job, start);
+
+        return 0;
+}
+
+static const struct pool_ops batch_ops = {
+        .init = batch_worker_init,
+        .run = batch_worker_run,
+        .fini = batch_worker_fini,
+};
+
+/* Signing daemon.
+ * The key is loaded once and kept in the secure heap.
+ * Clients talk over a unix seqpacket socket, one fixed size request
+ * and one fixed size reply per message. An image is either handed over
+ * as an fd (SCM_RIGHTS) and hashed by the daemon, or hashed by the
+ * client and sent as a digest. The socket is only accessible to the
+ * owner, and peers with another uid are turned away.
+ * Every pool worker waits on the same epoll set and takes one event
+ * at a time. Sockets are armed one shot, so a client is served by one
+ * worker at a time, in order, while other clients go to other workers.
+ */
+#define SERVE_MAGIC                     0x53544d53
+
+enum serve_op {
+        SERVE_OP_INFO = 1,
+        SERVE_OP_SIGN_FD,
+        SERVE_OP_VERIFY_FD,
+        SERVE_OP_SIGN_DIGEST,
+        SERVE_OP_VERIFY_DIGEST,
+};
+
+/* Request flags. */
+#define SERVE_FLAG_DECLARED             (1 << 0)
+#define SERVE_FLAG_SYNC                 (1 << 1)
+
+struct __attribute((packed)) serve_request {
+        uint32_t magic;
+        uint32_t op;
+        uint32_t flags;
+        uint8_t digest[SHA256_DIGEST_LENGTH];
+        uint8_t signature[64];
+};
+
+struct __attribute((packed)) serve_reply {
+        uint32_t magic;
+        uint32_t status;
+        uint32_t alg;
+        uint8_t pubkey[EC_POINT_UNCOMPRESSED_LEN - 1];
+        uint8_t signature[64];
+};
+
+/* Send one message, with an optional fd attached. */
+static int
+serve_send(int sock, const void *msgbuf, size_t len, int fd)
+{
+        union {
+                struct cmsghdr align;
+                char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        struct iovec iov = { .iov_base = (void *)msgbuf, .iov_len = len };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+        struct cmsghdr *cmsg;
+        ssize_t n;
+
+        if (fd >= 0) {
+                memset(&control, 0, sizeof(control));
+                msg.msg_control = control.buf;
+                msg.msg_controllen = sizeof(control.buf);
+                cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+                memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        }
+        do {
+                n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        } while (n < 0 && errno == EINTR);
+        if (n != (ssize_t)len) {
+                fprintf(stderr, "Unable to send message: %s\n",
+                        n < 0 ? strerror(errno) : "Short write");
+                return -1;
+        }
+
+        return 0;
+}
+
+/* Receive one message and at most one fd.
+ * Returns the message length, 0 on hangup, -1 on error.
+ * *fd is -1 if no fd came along. Surplus fds are closed.
+ */
+static ssize_t
+serve_recv(int sock, void *msgbuf, size_t len, int *fd)
+{
+        union {
+                struct cmsghdr align;
+                char buf[CMSG_SPACE(4 * sizeof(int))];
+        } control;
+        struct iovec iov = { .iov_base = msgbuf, .iov_len = len };
+        struct msghdr msg = {
+                .msg_iov = &iov,
+                .msg_iovlen = 1,
+                .msg_control = control.buf,
+                .msg_controllen = sizeof(control.buf),
+        };
+        struct cmsghdr *cmsg;
+        int i, nfds, fds[4];
+        ssize_t n;
+
+        *fd = -1;
+        do {
+                n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0)
+                return -1;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+                if (cmsg->cmsg_level != SOL_SOCKET ||
+                    cmsg->cmsg_type != SCM_RIGHTS)
+                        continue;
+                nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+                for (i = 0; i < nfds; i++) {
+                        if (*fd < 0)
+                                *fd = fds[i];
+                        else
+                                close(fds[i]);
+                }
+        }
+        if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+                if (*fd >= 0) close(*fd);
+                *fd = -1;
+                errno = EMSGSIZE;
+                return -1;
+        }
+
+        return n;
+}
+
+/* Handle one request. Returns the reply status, 0 is success.
+ * Images handed over as fds are always streamed.
+ * The daemon then never maps, and never pins, client images.
+ */
+static uint32_t
+serve_handle(struct worker_ctx *wctx, const struct batch *b,
+             const struct serve_request *req, int fd,
+             struct serve_reply *rep)
+{
+        struct stm32image img;
+        struct batch rb = *b;
+        ECDSA_SIG *ecsig;
+        int ret = -1;
+
+        /* Client side options on top of the daemon ones. */
+        rb.declared |= !!(req->flags & SERVE_FLAG_DECLARED);
+        rb.sync |= !!(req->flags & SERVE_FLAG_SYNC);
+        switch (req->op) {
+        case SERVE_OP_INFO:
+                rep->alg = b->alg;
+                memcpy(rep->pubkey, b->pubkey, sizeof(rep->pubkey));
+                ret = 0;
+                break;
+        case SERVE_OP_SIGN_FD:
+        case SERVE_OP_VERIFY_FD:
+                if (fd < 0) {
+                        fprintf(stderr, "Request without image fd.\n");
+                        break;
+                }
+                if (stm32image_attach(&img, NULL, fd,
+                                      req->op == SERVE_OP_SIGN_FD,
+                                      true, rb.declared)) {
+                        stm32image_close(&img);
+                        break;
+                }
+                if (req->op == SERVE_OP_SIGN_FD)
+                        ret = stm32image_do_sign(wctx, &rb, &img, 0);
+                else
+                        ret = stm32image_do_verify(wctx, &rb, &img);
+                if (!ret)
+                        memcpy(rep->signature, img.h->image_signature,
+                               sizeof(rep->signature));
+                stm32image_close(&img);
+                break;
+        case SERVE_OP_SIGN_DIGEST:
+                if ((ecsig = openssl_do_ecdsa_sha256_sign(b->eckey,
+                                                          wctx->bnctx,
+                                                          b->nonces,
+                                                          b->deterministic,
+                                                          req->digest,
+                                                          "-"))) {
+                        openssl_sig_to_raw(ecsig, rep->signature);
+                        ECDSA_SIG_free(ecsig);
+                        ret = 0;
+                }
+                break;
+        case SERVE_OP_VERIFY_DIGEST:
+                if (!openssl_sig_from_raw(wctx->ecsig, req->signature) &&
+                    openssl_do_ecdsa_sha256_verify(wctx->ecsig, b->eckey,
+                                                   req->digest, "-")) {
+                        ret = 0;
+                }
+                break;
+        default:
+                fprintf(stderr, "Unknown request %u.\n", req->op);
+                break;
+        }
+        /* Digest requests never carry an fd. Drop it. */
+        if (fd >= 0 && req->op != SERVE_OP_SIGN_FD &&
+            req->op != SERVE_OP_VERIFY_FD)
+                close(fd);
+
+        return ret ? 1 : 0;
+}
+
+/* Serve one readable client. Returns -1 if the client is done. */
+static int
+serve_client(struct worker_ctx *wctx, const struct batch *b, int sock)
+{
+        struct serve_request req;
+        struct serve_reply rep;
+        ssize_t n;
+        int fd;
+
+        if ((n = serve_recv(sock, &req, sizeof(req), &fd)) < 0) {
+                return errno == EAGAIN ? 0 : -1;
+        }
+        if (!n) {
+                return -1;
+        }
+        if (n != sizeof(req) || req.magic != SERVE_MAGIC) {
+                fprintf(stderr, "Malformed request.\n");
+                if (fd >= 0) close(fd);
+                return -1;
+        }
+
+        memset(&rep, 0, sizeof(rep));
+        rep.magic = SERVE_MAGIC;
+        rep.status = serve_handle(wctx, b, &req, fd, &rep);
+
+        return serve_send(sock, &rep, sizeof(rep), -1);
+}
+
+static void
+serve_accept(int lsock, int epfd)
+{
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT };
+        struct ucred cred;
+        socklen_t len;
+        int sock;
+
+        while ((sock = accept4(lsock, NULL, NULL,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                len = sizeof(cred);
+                if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED,
+                               &cred, &len) ||
+                    (cred.uid != getuid() && cred.uid != 0)) {
+                        fprintf(stderr, "Rejected client.\n");
+                        close(sock);
+                        continue;
+                }
+                ev.data.fd = sock;
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev)) {
+                        close(sock);
+                }
+        }
+}
+
+struct serve_ctx {
+        const struct batch *b;
+        int epfd;
+        int lsock;
+        int sigfd;
+};
+
+/* One event loop per worker, until the signal fd turns readable.
+ * It is never read, so every worker sees it.
+ */
+static int
+serve_worker_run(void *arg, void *data, size_t job UNUSED)
+{
+        struct serve_ctx *sc = arg;
+        struct worker_ctx *wctx = data;
+        struct epoll_event ev;
+        int fd;
+
+        while (1) {
+                if (epoll_wait(sc->epfd, &ev, 1, -1) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        fprintf(stderr, "epoll failed: %s\n",
+                                strerror(errno));
+                        return -1;
+                }
+                fd = ev.data.fd;
+                if (fd == sc->sigfd)
+                        return 0;
+                if (fd == sc->lsock) {
+                        serve_accept(sc->lsock, sc->epfd);
+                } else if (serve_client(wctx, sc->b, fd)) {
+                        /* Closing also removes it from epoll. */
+                        close(fd);
+                        continue;
+                }
+                ev.events = EPOLLIN | EPOLLONESHOT;
+                if (epoll_ctl(sc->epfd, EPOLL_CTL_MOD, fd, &ev)) {
+                        fprintf(stderr, "Unable to rearm socket: %s\n",
+                                strerror(errno));
+                        if (fd != sc->lsock)
+                                close(fd);
+                        else
+                                return -1;
+                }
+        }
+}
+
+static const struct pool_ops serve_ops = {
+        .init = batch_worker_init,
+        .run = serve_worker_run,
+        .fini = batch_worker_fini,
+};
+
+/* Run the daemon on jobs workers until SIGINT or SIGTERM.
+ * The signals must be blocked in all threads by the caller.
+ */
+static int
+serve_loop(const char *sock_path, const struct batch *b,
+           const sigset_t *sigs, unsigned int jobs)
+{
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        struct serve_ctx sc = { .b = b, .epfd = -1, .lsock = -1,
+                                .sigfd = -1 };
+        struct epoll_event ev;
+        struct stat st;
+        bool bound = false;
+        mode_t mask;
+        int ret = -1;
+
+        if (!sock_path || strlen(sock_path) >= sizeof(addr.sun_path)) {
+                fprintf(stderr, "Invalid socket path.\n");
+                goto out;
+        }
+        strcpy(addr.sun_path, sock_path);
+
+        if ((sc.lsock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK |
+                               SOCK_CLOEXEC, 0)) < 0) {
+                fprintf(stderr, "Unable to create socket: %s\n",
+                        strerror(errno));
+                goto out;
+        }
+        /* Remove a stale socket, never anything else. */
+        if (!lstat(sock_path, &st) && S_ISSOCK(st.st_mode)) {
+                unlink(sock_path);
+        }
+        mask = umask(0177);
+        if (bind(sc.lsock, (struct sockaddr *)&addr, sizeof(addr))) {
+                umask(mask);
+                fprintf(stderr, "Unable to bind %s: %s\n",
+                        sock_path, strerror(errno));
+                goto out;
+        }
+        umask(mask);
+        bound = true;
+        if (listen(sc.lsock, SOMAXCONN)) {
+                fprintf(stderr, "Unable to listen: %s\n", strerror(errno));
+                goto out;
+        }
+        if ((sc.sigfd = signalfd(-1, sigs, SFD_NONBLOCK | SFD_CLOEXEC)) < 0 ||
+            (sc.epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+                fprintf(stderr, "Unable to setup event loop: %s\n",
+                        strerror(errno));
+                goto out;
+        }
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.fd = sc.lsock;
+        if (epoll_ctl(sc.epfd, EPOLL_CTL_ADD, sc.lsock, &ev)) {
+                goto out;
+        }
+        ev.events = EPOLLIN;
+        ev.data.fd = sc.sigfd;
+        if (epoll_ctl(sc.epfd, EPOLL_CTL_ADD, sc.sigfd, &ev)) {
+                goto out;
+        }
+
+        if (pool_run(jobs, jobs, &serve_ops, &sc)) {
+                goto out;
+        }
+        ret = 0;
+
+ out:
+        if (sc.epfd >= 0) close(sc.epfd);
+        if (sc.sigfd >= 0) close(sc.sigfd);
+        if (sc.lsock >= 0) close(sc.lsock);
+        if (bound) unlink(sock_path);
+        return ret;
+}
+
+/* Client side of the daemon.
+ * Every worker gets its own connection.
+ */
+static int
+client_connect(const char *sock_path)
+{
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        int sock;
+
+        if (!sock_path || strlen(sock_path) >= sizeof(addr.sun_path)) {
+                fprintf(stderr, "Invalid socket path.\n");
+                return -1;
+        }
+        strcpy(addr.sun_path, sock_path);
+
+        if ((sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0) {
+                fprintf(stderr, "Unable to create socket: %s\n",
+                        strerror(errno));
+                return -1;
+        }
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+                fprintf(stderr, "Unable to connect to %s: %s\n",
+                        sock_path, strerror(errno));
+                close(sock);
+                return -1;
+        }
+
+        return sock;
+}
+
+/* One request, one reply. Returns the reply status, or -1. */
+static int
+client_call(int sock, struct serve_request *req, int fd,
+            struct serve_reply *rep)
+{
+        ssize_t n;
+        int rfd;
+
+        req->magic = SERVE_MAGIC;
+        if (serve_send(sock, req, sizeof(*req), fd)) {
+                return -1;
+        }
+        if ((n = serve_recv(sock, rep, sizeof(*rep), &rfd)) < 0) {
+                fprintf(stderr, "Unable to receive reply: %s\n",
+                        strerror(errno));
+                return -1;
+        }
+        if (rfd >= 0) close(rfd);
+        if (n != sizeof(*rep) || rep->magic != SERVE_MAGIC) {
+                fprintf(stderr, "Malformed reply.\n");
+                return -1;
+        }
+
+        return rep->status;
+}
+
+static void *
+client_worker_init(void *arg)
+{
+        struct batch *b = arg;
+        struct worker_ctx *wctx;
+
+        if (!(wctx = calloc(1, sizeof(*wctx)))) {
+                fprintf(stderr, "Unable to allocate worker context.\n");
+                return NULL;
+        }
+        if ((wctx->sock = client_connect(b->sock_path)) < 0) {
+                free(wctx);
+                return NULL;
+        }
+
+        return wctx;
+}
+
+static void
+client_worker_fini(void *data)
+{
+        struct worker_ctx *wctx = data;
+
+        close(wctx->sock);
+        free(wctx);
+}
+
+/* Sign or verify one image through the daemon.
+ * Either hand over the image fd, or hash here and send the digest.
+ */
+static int
+client_image(struct worker_ctx *wctx, const struct batch *b,
+             const char *path)
+{
+        struct serve_request req = { 0 };
+        struct serve_reply rep;
+        struct stm32image img;
+        int fd, ret = -1;
+
+        if (b->declared)
+                req.flags |= SERVE_FLAG_DECLARED;
+        if (b->sync)
+                req.flags |= SERVE_FLAG_SYNC;
+        if (!b->digest_only) {
+                if ((fd = open(path, b->sign ? O_RDWR : O_RDONLY)) < 0) {
+                        fprintf(stderr, "Error: Cannot open %s: %s\n",
+                                path, strerror(errno));
+                        return -1;
+                }
+                req.op = b->sign ? SERVE_OP_SIGN_FD : SERVE_OP_VERIFY_FD;
+                ret = client_call(wctx->sock, &req, fd, &rep);
+                close(fd);
+                return ret ? -1 : 0;
+        }
+
+        if (stm32image_open(&img, path, b->sign, b->stream, b->declared)) {
+                goto out;
+        }
+        if (b->sign) {
+                stm32image_set_pubkey(img.h, b->pubkey, b->alg);
+                req.op = SERVE_OP_SIGN_DIGEST;
+        } else {
+                memcpy(req.signature, img.h->image_signature,
+                       sizeof(req.signature));
+                req.op = SERVE_OP_VERIFY_DIGEST;
+        }
+        if (stm32image_sha256(&img, req.digest)) {
+                goto out;
+        }
+        if (!b->sign && stm32image_check_checksum(&img)) {
+                goto out;
+        }
+        if (client_call(wctx->sock, &req, -1, &rep)) {
+                goto out;
+        }
+        if (b->sign) {
+                img.h->image_checksum = htole32(img.checksum);
+                memcpy(img.h->image_signature, rep.signature,
+                       sizeof(rep.signature));
+                if (stm32image_writeback(&img, b->sync))
+                        goto out;
+        }
+        ret = 0;
+
+ out:
+        stm32image_close(&img);
+        return ret;
+}
+
+static int
+client_worker_run(void *arg, void *data, size_t job)
+{
+        struct batch *b = arg;
+        const char *path = b->images->paths[job];
+        uint64_t start = stats_now();
+
+        if (client_image(data, b, path)) {
+                fprintf(stderr, "%s: %s failed.\n", path,
+                        b->sign ? "Signing" : "Verification");
+                return -1;
+        }
+        stats_image_done(job, start);
+
+        return 0;
+}
+
+static const struct pool_ops client_ops = {
+        .init = client_worker_init,
+        .run = client_worker_run,
+        .fini = client_worker_fini,
+};
+
+/* FIP packaging without a round trip through fiptool.
+ * The FIP is mapped. name=file entries replace or extend it.
+ * With a ROT key, the TBBR certificates are created and set too,
+ * or only the ones that no longer hold, incrementally.
+ * The result is unpacked to dir and written to output when asked to.
+ * Everything else is written straight from the mapping.
+ */
+static int
+fip_run(const char *fip_path, const char *unpack_dir,
+        const struct image_list *adds, const char *output, EC_KEY *rot,
+        const char *key_dir, bool incremental, unsigned int jobs)
+{
+        struct fip fip;
+        struct tbbr tbbr = { 0 };
+        EVP_PKEY *pkey = NULL;
+        char name[32];
+        const char *file;
+        size_t i;
+        int ret = -1;
+
+        if (fip_open(&fip, fip_path)) {
+                return -1;
+        }
+        for (i = 0; i < adds->count; i++) {
+                if (!(file = strchr(adds->paths[i], '=')) ||
+                    file - adds->paths[i] >= (ptrdiff_t)sizeof(name)) {
+                        fprintf(stderr, "Invalid FIP entry %s, expected name=file.\n",
+                                adds->paths[i]);
+                        goto out;
+                }
+                snprintf(name, sizeof(name), "%.*s",
+                         (int)(file - adds->paths[i]), adds->paths[i]);
+                if (fip_set_file(&fip, name, file + 1)) {
+                        goto out;
+                }
+        }
+        if (rot) {
+                if (!(pkey = EVP_PKEY_new()) ||
+                    !EVP_PKEY_set1_EC_KEY(pkey, rot)) {
+                        fprintf(stderr, "Unable to use the ROT key.\n");
+                        goto out;
+                }
+                if (tbbr_create(&tbbr, &fip, pkey, key_dir, incremental,
+                                jobs)) {
+                        goto out;
+                }
+        }
+        if (unpack_dir && fip_unpack(&fip, unpack_dir)) {
+                goto out;
+        }
+        if (output && fip_write(&fip, output)) {
+                goto out;
+        }
+        ret = 0;
+
+ out:
+        fip_close(&fip);
+        tbbr_free(&tbbr);
+        if (pkey) EVP_PKEY_free(pkey);
+        return ret;
+}
+
+/* Verify the TBBR certificates and images of a FIP against rot. */
+static int
+fip_verify(const char *fip_path, EC_KEY *rot, unsigned int jobs)
+{
+        struct fip fip;
+        EVP_PKEY *pkey = NULL;
+        int ret = -1;
+
+        if (fip_open(&fip, fip_path)) {
+                return -1;
+        }
+        if (!(pkey = EVP_PKEY_new()) || !EVP_PKEY_set1_EC_KEY(pkey, rot)) {
+                fprintf(stderr, "Unable to use the ROT key.\n");
+                goto out;
+        }
+        if (tbbr_verify(&fip, pkey, jobs)) {
+                fprintf(stderr, "%s: Chain of trust verification failed.\n",
+                        fip_path);
+                goto out;
+        }
+        ret = 0;
+
+ out:
+        fip_close(&fip);
+        if (pkey) EVP_PKEY_free(pkey);
+        return ret;
+}
+
+/* Check the hash of the raw pubkey against the one fused in OTP.
+ * otp is the hash in hex, or a file holding it, like --pubhash writes.
+ */
+static int
+otp_check(const uint8_t *pubkey, const char *otp)
+{
+        uint8_t md[SHA256_DIGEST_LENGTH], want[SHA256_DIGEST_LENGTH];
+        FILE *fp;
+        size_t n;
+
+        if (strlen(otp) != 2 * sizeof(want) ||
+            hex_decode(otp, want, sizeof(want))) {
+                if (!(fp = fopen(otp, "r"))) {
+                        fprintf(stderr, "Unable to open OTP hash %s.\n", otp);
+                        return -1;
+                }
+                n = fread(want, 1, sizeof(want), fp);
+                fclose(fp);
+                if (n != sizeof(want)) {
+                        fprintf(stderr, "Unable to read OTP hash %s.\n", otp);
+                        return -1;
+                }
+        }
+        sha256(pubkey, EC_POINT_UNCOMPRESSED_LEN - 1, md);
+        if (memcmp(md, want, sizeof(md))) {
+                fprintf(stderr, "ROT pubkey hash does not match OTP.\n");
+                return -1;
+        }
+
+        return 0;
+}
+
+/* Fetch pubkey and algorithm from the daemon.
+ * Needed to patch the header before hashing on the client side.
+ */
+static int
+client_info(const char *sock_path, uint8_t *pubkey, int *alg)
+{
+        struct serve_request req = { .op = SERVE_OP_INFO };
+        struct serve_reply rep;
+        int sock, ret = -1;
+
+        if ((sock = client_connect(sock_path)) < 0) {
+                return -1;
+        }
+        if (!client_call(sock, &req, -1, &rep)) {
+                memcpy(pubkey, rep.pubkey, sizeof(rep.pubkey));
+                *alg = rep.alg;
+                ret = 0;
+        }
+        close(sock);
+
+        return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+        struct image_list images = { 0 };
+        struct image_list fip_adds = { 0 };
+        struct batch batch = { 0 };
+        FILE *fp = NULL;
         unsigned char *p;
         char *key_path = NULL;
-        char *password = NULL;
+        char *password = NULL, *password_arg = NULL;
+        char *list_path = NULL;
+        char *serve_path = NULL;
+        char *connect_path = NULL;
+        char *output_path = NULL;
+        char *manifest_path = NULL;
+        char *fip_path = NULL;
+        char *fip_unpack_dir = NULL;
+        char *fip_output = NULL;
+        char *fip_key_dir = NULL;
+        bool fip_incremental = false;
+        bool verify_chain = false, chain_failed = false;
+        char *otp_hash = NULL;
+        enum detached_op detached = DETACHED_NONE;
+        struct stat st;
         EC_KEY *eckey = NULL;
-        ECDSA_SIG *ecsig = NULL;
-        unsigned char *data = NULL;
-        off_t datalen;
         uint8_t *buf = NULL;
+        uint8_t rawkey[EC_POINT_UNCOMPRESSED_LEN - 1];
+        sigset_t sigs;
         size_t len;
-        int alg, c, fd = -1;
-        bool sign = false, verify = false, pubhash = false;
+        long failed;
+        unsigned int jobs = 0;
+        unsigned long val;
+        unsigned long precompute = 0;
+        unsigned long checkpoint = 0;
+        uint64_t t, wall = 0;
+        int alg, c;
+        bool sign = false, verify = false, pubhash = false, null_sep = false;
+        bool stream = false, digest_only = false, declared = false;
+        bool sync = false, deterministic = false;
+        char *cache_path = NULL;
+        unsigned long key_cache = 0;
 
         static struct option options[] = {
                 {"image", required_argument, 0, 'i'},
+                {"image-list", required_argument, 0, 'l'},
+                {"null", no_argument, 0, '0'},
+                {"jobs", required_argument, 0, 'j'},
+                {"stream", no_argument, 0, 'S'},
+                {"image-length", no_argument, 0, 'L'},
+                {"sync", no_argument, 0, 'Y'},
+                {"output", required_argument, 0, 'o'},
+                {"checkpoint", required_argument, 0, 'K'},
+                {"deterministic", no_argument, 0, 'R'},
+                {"cache", required_argument, 0, 'c'},
+                {"key-cache", required_argument, 0, 'T'},
+                {"emit-digest", required_argument, 0, 'E'},
+                {"sign-digests", required_argument, 0, 'G'},
+                {"import-signature", required_argument, 0, 'I'},
+                {"fip", required_argument, 0, 'F'},
+                {"fip-unpack", required_argument, 0, 'U'},
+                {"fip-add", required_argument, 0, 'A'},
+                {"fip-output", required_argument, 0, 'O'},
+                {"fip-keys", required_argument, 0, 'B'},
+                {"fip-incremental", no_argument, 0, 'N'},
+                {"verify-chain", no_argument, 0, 'W'},
+                {"otp-hash", required_argument, 0, 'H'},
+                {"precompute", required_argument, 0, 'P'},
+                {"serve", required_argument, 0, 'D'},
+                {"connect", required_argument, 0, 'C'},
+                {"digest-only", no_argument, 0, 'd'},
+                {"stats", optional_argument, 0, 't'},
                 {"key", required_argument, 0, 'k'},
                 {"sign", no_argument, 0, 's'},
                 {"verify", no_argument, 0, 'v'},
@@ -348,24 +3635,136 @@ main(int argc, char *argv[])
                 {0, 0, 0, 0}
         };
 
-        /* Prevent pages from reaching swap.
-         * Contains sensitive data.
-         */
-        if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
-                fprintf(stderr,
-                        "Warn: Failed protecting memory from being swapped.\n");
-        }
         while (1) {
-                c = getopt_long(argc, argv, "i:svk:p:xhV", options, NULL);
+                c = getopt_long(argc, argv, "i:l:0j:SLYo:K:Rc:T:E:G:I:F:U:A:O:B:NWH:P:D:C:dt::svk:p:xhV", options, NULL);
                 if (c == -1)
                         break;
                 switch (c) {
                 case 'i':
-                        fd = open(optarg, O_RDWR);
-                        if (fd < 0) {
+                        if (image_list_add(&images, optarg))
+                                goto err_out;
+                        break;
+                case 'l':
+                        if (list_path) free(list_path);
+                        list_path = strdup(optarg);
+                        break;
+                case '0':
+                        null_sep = true;
+                        break;
+                case 'j':
+                        if (parse_ulong(optarg, JOBS_MAX, &val)) {
+                                fprintf(stderr,
+                                        "%s: Invalid number of jobs: %s\n",
+                                        argv[0], optarg);
+                                goto err_out;
+                        }
+                        jobs = val;
+                        break;
+                case 'S':
+                        stream = true;
+                        break;
+                case 'P':
+                        if (parse_ulong(optarg, PRECOMPUTE_MAX,
+                                        &precompute)) {
+                                fprintf(stderr,
+                                        "%s: Invalid number of precomputed nonces: %s\n",
+                                        argv[0], optarg);
+                                goto err_out;
+                        }
+                        break;
+                case 'D':
+                        if (serve_path) free(serve_path);
+                        serve_path = strdup(optarg);
+                        break;
+                case 'C':
+                        if (connect_path) free(connect_path);
+                        connect_path = strdup(optarg);
+                        break;
+                case 'd':
+                        digest_only = true;
+                        break;
+                case 'L':
+                        declared = true;
+                        break;
+                case 'Y':
+                        sync = true;
+                        break;
+                case 'o':
+                        if (output_path) free(output_path);
+                        output_path = strdup(optarg);
+                        break;
+                case 'K':
+                        if (parse_ulong(optarg, CHECKPOINT_MAX,
+                                        &checkpoint)) {
+                                fprintf(stderr,
+                                        "%s: Invalid checkpoint interval: %s\n",
+                                        argv[0], optarg);
+                                goto err_out;
+                        }
+                        break;
+                case 'R':
+                        deterministic = true;
+                        break;
+                case 'c':
+                        if (cache_path) free(cache_path);
+                        cache_path = strdup(optarg);
+                        break;
+                case 'T':
+                        if (parse_ulong(optarg, KEY_CACHE_MAX, &key_cache)) {
                                 fprintf(stderr,
-                                        "Error: Cannot open %s: %s\n",
-                                        optarg, strerror(errno));
+                                        "%s: Invalid key cache timeout: %s\n",
+                                        argv[0], optarg);
+                                goto err_out;
+                        }
+                        break;
+                case 'E':
+                case 'G':
+                case 'I':
+                        if (detached != DETACHED_NONE) {
+                                fprintf(stderr, "%s: Only one detached signing step at a time.\n",
+                                        argv[0]);
+                                goto err_out;
+                        }
+                        detached = c == 'E' ? DETACHED_EMIT :
+                                   c == 'G' ? DETACHED_SIGN : DETACHED_IMPORT;
+                        manifest_path = strdup(optarg);
+                        sign = true;
+                        break;
+                case 'F':
+                        if (fip_path) free(fip_path);
+                        fip_path = strdup(optarg);
+                        break;
+                case 'U':
+                        if (fip_unpack_dir) free(fip_unpack_dir);
+                        fip_unpack_dir = strdup(optarg);
+                        break;
+                case 'A':
+                        if (image_list_add(&fip_adds, optarg))
+                                goto err_out;
+                        break;
+                case 'O':
+                        if (fip_output) free(fip_output);
+                        fip_output = strdup(optarg);
+                        break;
+                case 'B':
+                        if (fip_key_dir) free(fip_key_dir);
+                        fip_key_dir = strdup(optarg);
+                        break;
+                case 'N':
+                        fip_incremental = true;
+                        break;
+                case 'W':
+                        verify_chain = true;
+                        break;
+                case 'H':
+                        if (otp_hash) free(otp_hash);
+                        otp_hash = strdup(optarg);
+                        break;
+                case 't':
+                        stats.enabled = true;
+                        if (optarg && !(stats.json = !strcmp(optarg, "json"))) {
+                                fprintf(stderr, "%s: Unknown stats format: %s\n",
+                                        argv[0], optarg);
                                 goto err_out;
                         }
                         break;
@@ -379,7 +3778,7 @@ main(int argc, char *argv[])
                         verify = true;
                         break;
                 case 'p':
-                        password = strdup(optarg);
+                        password_arg = optarg;
                         break;
                 case 'x':
                         pubhash = true;
@@ -400,6 +3799,70 @@ main(int argc, char *argv[])
                 }
         }
 
+        if (serve_path && connect_path) {
+                fprintf(stderr, "%s: Either serve or connect.\n", argv[0]);
+                usage(argv);
+                goto err_out;
+        }
+
+        /* Chain verification takes the images and the FIP together,
+         * against the ROT key and the hash of it fused in OTP.
+         */
+        if (verify_chain || otp_hash) {
+                if (!verify_chain || !fip_path || !otp_hash || sign ||
+                    serve_path || connect_path ||
+                    detached != DETACHED_NONE || fip_unpack_dir ||
+                    fip_adds.count || fip_output || fip_key_dir ||
+                    fip_incremental) {
+                        fprintf(stderr, "%s: Chain verification takes local images, a FIP and an OTP hash.\n",
+                                argv[0]);
+                        usage(argv);
+                        goto err_out;
+                }
+                verify = true;
+        }
+
+        /* FIP packaging needs no key. Signing one, along with
+         * the images, takes the ROT key used for them.
+         */
+        if (!verify_chain &&
+            (fip_path || fip_unpack_dir || fip_adds.count || fip_output ||
+             fip_key_dir || fip_incremental)) {
+                if (!fip_path || verify || serve_path || connect_path ||
+                    detached != DETACHED_NONE ||
+                    (!sign && (images.count || list_path))) {
+                        fprintf(stderr, "%s: FIP packaging takes a FIP, and only signs local images.\n",
+                                argv[0]);
+                        usage(argv);
+                        goto err_out;
+                }
+                if ((fip_key_dir || fip_incremental) && !sign) {
+                        fprintf(stderr, "%s: FIP keys and incremental signing take --sign.\n",
+                                argv[0]);
+                        usage(argv);
+                        goto err_out;
+                }
+                if ((sign || fip_adds.count) && !fip_output) {
+                        fprintf(stderr, "%s: Missing output path for the new FIP.\n",
+                                argv[0]);
+                        usage(argv);
+                        goto err_out;
+                }
+        }
+        if (fip_path && !sign && !verify_chain) {
+                if (fip_run(fip_path, fip_unpack_dir, &fip_adds,
+                            fip_output, NULL, NULL, false, jobs)) {
+                        goto err_out;
+                }
+                goto out;
+        }
+
+        /* The daemon does both, as requested by its clients. */
+        if (serve_path) {
+                sign = true;
+                verify = false;
+        }
+
         if (sign == verify) {
                 fprintf(stderr, "%s: Op must be either sign or verify.\n",
                         argv[0]);
@@ -407,103 +3870,287 @@ main(int argc, char *argv[])
                 goto err_out;
         }
 
-        if (fd < 0) {
-                fprintf(stderr, "%s: Missing stm32 image file.\n",
+        /* The cache only sees what is signed and verified here. */
+        if (cache_path && (connect_path || detached != DETACHED_NONE)) {
+                fprintf(stderr, "%s: The cache is for local sign and verify.\n",
                         argv[0]);
                 usage(argv);
                 goto err_out;
         }
 
-        if (!key_path) {
-                fprintf(stderr, "%s: Missing key path or password.\n",
+        /* Checkpoints are kept for mapped images signed locally. */
+        if (checkpoint && (!sign || stream || serve_path || connect_path ||
+                           detached != DETACHED_NONE)) {
+                fprintf(stderr, "%s: Checkpoints are only for local, mapped signing.\n",
                         argv[0]);
                 usage(argv);
                 goto err_out;
         }
 
-        /* Load and validate image magic. */
-        if (!(data = stm32image_load(fd, &datalen))) {
+        /* Detached signing is local, and the signer and the
+         * import take their images from the manifest.
+         */
+        if (detached != DETACHED_NONE) {
+                if (serve_path || connect_path || output_path) {
+                        fprintf(stderr, "%s: Detached signing works on local images in situ.\n",
+                                argv[0]);
+                        usage(argv);
+                        goto err_out;
+                }
+                if (detached != DETACHED_EMIT && (images.count || list_path)) {
+                        fprintf(stderr, "%s: Images come from the manifest.\n",
+                                argv[0]);
+                        usage(argv);
+                        goto err_out;
+                }
+        }
+        /* The manifest has stdout to itself. */
+        stats.fp = detached == DETACHED_SIGN ||
+                (detached == DETACHED_EMIT && !strcmp(manifest_path, "-")) ?
+                stderr : stdout;
+        if (detached == DETACHED_SIGN &&
+            manifest_read(&images, manifest_path, SHA256_DIGEST_LENGTH,
+                          &batch.digests)) {
                 goto err_out;
         }
-        /* Load key.
-         * Contains both priv and pubkey if signing.
-         * Contains only pubkey if verifying.
+        if (detached == DETACHED_IMPORT &&
+            manifest_read(&images, manifest_path, ECDSA_SIG_RAW_LEN,
+                          &batch.signatures)) {
+                goto err_out;
+        }
+
+        /* List file is read after option parsing.
+         * --null may be given after --image-list.
          */
-        if (!(eckey = openssl_load_key(key_path, password, sign))) {
+        if (list_path && image_list_read(&images, list_path, null_sep)) {
+                goto err_out;
+        }
+
+        if (!images.count && !serve_path && (!fip_path || verify_chain)) {
+                fprintf(stderr, "%s: Missing stm32 image file.\n",
+                        argv[0]);
+                usage(argv);
                 goto err_out;
         }
-        /* Slap the header over the data so we can modify it.
-         * Don't forget header endians.
+
+        /* Signed copies are written locally. A directory takes
+         * any number of images, a file only one.
          */
-        h = (struct stm32_header *)data;
-        /* sign and verify already checked to be mutually exclusive */
-        if (sign) {
-                /* Get raw pubkey from key. */
-                if (!(buf = openssl_get_pubkey(eckey, &len, &alg))) {
+        if (output_path) {
+                if (!sign || serve_path || connect_path) {
+                        fprintf(stderr, "%s: Output is only for local signing.\n",
+                                argv[0]);
+                        usage(argv);
                         goto err_out;
                 }
-                if (buf[0] != POINT_CONVERSION_UNCOMPRESSED ||
-                    len != EC_POINT_UNCOMPRESSED_LEN) {
-                        fprintf(stderr, "EC pubkey invalid length.\n");
+                batch.output = output_path;
+                batch.output_dir = !stat(output_path, &st) &&
+                                   S_ISDIR(st.st_mode);
+                if (!batch.output_dir && images.count > 1) {
+                        fprintf(stderr, "%s: Output must be a directory for several images.\n",
+                                argv[0]);
                         goto err_out;
                 }
-                /* Copy raw pubkey to header.
-                 * First byte is the type declaration. Skip it.
-                 * Raw bignum. Two points on curve. X concatenated with Y.
-                 */
-                memcpy(h->ecdsa_public_key, &buf[1], len - 1);
-                /* option:
-                 * 0: signed.
-                 * 1: not signed.
-                 */
-                h->option_flags = htole32(0);
-                /* Algorithm:
-                 * 1: prime256v1
-                 * 2: brainpoolP256r1
-                 */
-                h->ecdsa_algorithm = htole32(alg);
-                /* Do ECDSA signature with sha256
-                 * from correct offset in header to end of data.
-                 */
-                if (!(ecsig =
-                      openssl_do_ecdsa_sha256_sign(eckey,
-                                                   &data[STM32_HASH_OFFSET],
-                                                   datalen - STM32_HASH_OFFSET))) {
+        }
+
+        batch.images = &images;
+        batch.sign = sign;
+        batch.stream = stream;
+        batch.digest_only = digest_only;
+        batch.declared = declared;
+        batch.sync = sync;
+        batch.detached = detached;
+        batch.checkpoint = checkpoint << 20;
+        batch.deterministic = deterministic;
+        if (detached == DETACHED_EMIT &&
+            !(batch.digests = calloc(images.count, SHA256_DIGEST_LENGTH))) {
+                fprintf(stderr, "Unable to allocate digests.\n");
+                goto err_out;
+        }
+        if (detached == DETACHED_SIGN &&
+            !(batch.signatures = calloc(images.count, ECDSA_SIG_RAW_LEN))) {
+                fprintf(stderr, "Unable to allocate signatures.\n");
+                goto err_out;
+        }
+        if (stats.enabled && images.count) {
+                if (!(stats.image_ns = calloc(images.count,
+                                              sizeof(*stats.image_ns)))) {
+                        fprintf(stderr, "Unable to allocate image timings.\n");
                         goto err_out;
                 }
-                /* Copy signature to header.
-                 * Raw bignum. Two numbers. R concatenated with S.
-                 */
-                BN_bn2bin(ECDSA_SIG_get0_r(ecsig),
-                          &((h->image_signature)[0]));
-                BN_bn2bin(ECDSA_SIG_get0_s(ecsig),
-                          &((h->image_signature)[32]));
+                stats.nimage_ns = images.count;
+        }
+        if (!jobs)
+                jobs = pool_default_threads();
+
+        /* Only the secrets are locked. Move the password there,
+         * and out of the command line, as seen in /proc.
+         */
+        secure_heap_init(precompute, jobs);
+        if (password_arg) {
+                if (!(password = secure_strdup(password_arg))) {
+                        fprintf(stderr, "Unable to allocate password.\n");
+                        goto err_out;
+                }
+                OPENSSL_cleanse(password_arg, strlen(password_arg));
         }
-        if (verify) {
-                if (!(ecsig = ECDSA_SIG_new())) {
-                        fprintf(stderr, "Unable to allocate a ecsig structure.\n");
+
+        /* Client. The key stays with the daemon. */
+        if (connect_path) {
+                if (client_info(connect_path, rawkey, &alg)) {
                         goto err_out;
                 }
-                /* Get signature from header
-                 * Raw bignum. Two numbers. R concatenated with S.
-                 */
-                ECDSA_SIG_set0(ecsig,
-                               BN_bin2bn(&((h->image_signature)[0]), 32, NULL),
-                               BN_bin2bn(&((h->image_signature)[32]), 32, NULL));
-                /* Do ECDSA verification with sha256
-                 * from correct offset in header to end of data.
+                batch.sock_path = connect_path;
+                batch.pubkey = rawkey;
+                batch.alg = alg;
+                t = stats_now();
+                PROBE1(phase__start, "run");
+                failed = pool_run(images.count, jobs, &client_ops, &batch);
+                PROBE3(phase__done, "run", images.count, failed ? -1 : 0);
+                if (failed) {
+                        goto err_out;
+                }
+                wall = stats_now() - t;
+                goto pubhash;
+        }
+
+        if (!key_path) {
+                fprintf(stderr, "%s: Missing key path or password.\n",
+                        argv[0]);
+                usage(argv);
+                goto err_out;
+        }
+
+        /* Load key once for all images.
+         * Contains both priv and pubkey if signing.
+         * Contains only pubkey if verifying.
+         */
+        t = stats_now();
+        PROBE1(phase__start, "key");
+        eckey = openssl_load_key_cached(key_path, password,
+                                        sign && detached != DETACHED_EMIT &&
+                                        detached != DETACHED_IMPORT,
+                                        key_cache);
+        PROBE3(phase__done, "key", 0, eckey ? 0 : -1);
+        if (!eckey) {
+                goto err_out;
+        }
+        stats_add(STATS_KEY, t);
+        if (checkpoint && ck_key_derive(eckey, batch.ck_key)) {
+                goto err_out;
+        }
+        /* Get raw pubkey from key. */
+        if (!(buf = openssl_get_pubkey(eckey, &len, &alg))) {
+                goto err_out;
+        }
+        if (buf[0] != POINT_CONVERSION_UNCOMPRESSED ||
+            len != EC_POINT_UNCOMPRESSED_LEN) {
+                fprintf(stderr, "EC pubkey invalid length.\n");
+                goto err_out;
+        }
+        /* First byte of the pubkey is the type declaration. Skip it. */
+        batch.eckey = eckey;
+        batch.pubkey = &buf[1];
+        batch.alg = alg;
+        if (cache_path && !(batch.cache = cache_open(cache_path))) {
+                goto err_out;
+        }
+        if (serve_path) {
+                /* Keep the key out of core dumps and ptrace.
+                 * Block the stop signals before any thread starts,
+                 * the event loop picks them up.
                  */
-                if (!(ecsig =
-                      openssl_do_ecdsa_sha256_verify(ecsig, eckey,
-                                                     &data[STM32_HASH_OFFSET],
-                                                     datalen - STM32_HASH_OFFSET))) {
+                prctl(PR_SET_DUMPABLE, 0);
+                sigemptyset(&sigs);
+                sigaddset(&sigs, SIGINT);
+                sigaddset(&sigs, SIGTERM);
+                pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+        }
+        /* Precomputed nonces are random. */
+        if (deterministic && precompute) {
+                fprintf(stderr, "%s: Deterministic signing takes no precomputed nonces.\n",
+                        argv[0]);
+                goto err_out;
+        }
+        if (deterministic && rfc6979_selftest()) {
+                goto err_out;
+        }
+        if (sign && precompute && detached != DETACHED_EMIT &&
+            detached != DETACHED_IMPORT &&
+            !(batch.nonces = nonce_pool_new(eckey, precompute))) {
+                goto err_out;
+        }
+        if (serve_path) {
+                if (serve_loop(serve_path, &batch, &sigs, jobs)) {
+                        goto err_out;
+                }
+                goto pubhash;
+        }
+        /* The ROT key checks go first, the images are verified
+         * regardless. Every failure is reported.
+         */
+        if (verify_chain) {
+                batch.header_key = true;
+                if (otp_check(batch.pubkey, otp_hash))
+                        chain_failed = true;
+                if (fip_verify(fip_path, eckey, jobs))
+                        chain_failed = true;
+        }
+        if (fip_path && sign) {
+                if (fip_run(fip_path, fip_unpack_dir, &fip_adds,
+                            fip_output, eckey, fip_key_dir,
+                            fip_incremental, jobs)) {
                         goto err_out;
                 }
+                if (!images.count)
+                        goto pubhash;
+        }
+        /* sign and verify already checked to be mutually exclusive.
+         * Images are independent. Spread them over the worker pool.
+         * Keep going on failure, report every failed image.
+         */
+        t = stats_now();
+        /* Mapped images can be hashed side by side.
+         * Fill the lanes, but not at the cost of idle threads.
+         */
+        batch.group = 1;
+        if (!stream && detached != DETACHED_SIGN && !checkpoint &&
+            sha256_mb_lanes() > 1) {
+                batch.group = (images.count + jobs - 1) / jobs;
+                if (batch.group > sha256_mb_lanes())
+                        batch.group = sha256_mb_lanes();
+        }
+        PROBE1(phase__start, "run");
+        failed = pool_run((images.count + batch.group - 1) / batch.group,
+                          jobs, &batch_ops, &batch);
+        PROBE3(phase__done, "run", images.count, failed ? -1 : 0);
+        if (failed || chain_failed) {
+                goto err_out;
+        }
+        wall = stats_now() - t;
+        /* Only a complete manifest is written. */
+        if (detached == DETACHED_EMIT &&
+            manifest_write(&images, manifest_path, SHA256_DIGEST_LENGTH,
+                           batch.digests)) {
+                goto err_out;
+        }
+        if (detached == DETACHED_SIGN &&
+            manifest_write(&images, "-", ECDSA_SIG_RAW_LEN,
+                           batch.signatures)) {
+                goto err_out;
+        }
+ pubhash:
+        if (stats.enabled && !serve_path) {
+                stats_print(detached == DETACHED_EMIT ? "emit" :
+                            detached == DETACHED_SIGN ? "sign-digests" :
+                            detached == DETACHED_IMPORT ? "import" :
+                            sign ? "sign" : verify_chain ? "verify-chain" :
+                            "verify", wall);
         }
         /* Pubkeys are always available, regardless of operation */
         if (pubhash) {
-                if (!(p = SHA256(h->ecdsa_public_key,
-                                 EC_POINT_UNCOMPRESSED_LEN - 1, NULL))) {
+                if (!(p = SHA256(batch.pubkey, EC_POINT_UNCOMPRESSED_LEN - 1,
+                                 NULL))) {
                         fprintf(stderr, "Unable to calculate sha256 of raw pubkey.\n");
                         goto err_out;
                 }
@@ -517,30 +4164,57 @@ main(int argc, char *argv[])
                         goto err_out;
                 }
         }
-        if (ecsig) ECDSA_SIG_free(ecsig);
+ out:
+        OPENSSL_cleanse(batch.ck_key, sizeof(batch.ck_key));
+        if (batch.nonces) nonce_pool_free(batch.nonces);
         if (buf) OPENSSL_free(buf);
         if (eckey) EC_KEY_free(eckey);
-        if (data) munmap(data, datalen);
-        if (password) {
-                memset(password, 0, strlen(password));
-                free(password);
-        }
+        secure_strfree(password);
         if (key_path) free(key_path);
+        if (list_path) free(list_path);
+        if (serve_path) free(serve_path);
+        if (connect_path) free(connect_path);
+        if (output_path) free(output_path);
+        if (cache_path) free(cache_path);
+        if (batch.cache) cache_close(batch.cache);
+        if (manifest_path) free(manifest_path);
+        if (fip_path) free(fip_path);
+        if (fip_unpack_dir) free(fip_unpack_dir);
+        if (fip_output) free(fip_output);
+        if (fip_key_dir) free(fip_key_dir);
+        if (otp_hash) free(otp_hash);
+        image_list_free(&fip_adds);
+        if (batch.digests) free(batch.digests);
+        if (batch.signatures) free(batch.signatures);
+        if (stats.image_ns) free(stats.image_ns);
+        image_list_free(&images);
         if (fp) fclose(fp);
-        munlockall();
         exit(EXIT_SUCCESS);
 
  err_out:
-        if (ecsig) ECDSA_SIG_free(ecsig);
+        OPENSSL_cleanse(batch.ck_key, sizeof(batch.ck_key));
+        if (batch.nonces) nonce_pool_free(batch.nonces);
         if (buf) OPENSSL_free(buf);
         if (eckey) EC_KEY_free(eckey);
-        if (data) munmap(data, datalen);
-        if (password) {
-                memset(password, 0, strlen(password));
-                free(password);
-        }
+        secure_strfree(password);
         if (key_path) free(key_path);
+        if (list_path) free(list_path);
+        if (serve_path) free(serve_path);
+        if (connect_path) free(connect_path);
+        if (output_path) free(output_path);
+        if (cache_path) free(cache_path);
+        if (batch.cache) cache_close(batch.cache);
+        if (manifest_path) free(manifest_path);
+        if (fip_path) free(fip_path);
+        if (fip_unpack_dir) free(fip_unpack_dir);
+        if (fip_output) free(fip_output);
+        if (fip_key_dir) free(fip_key_dir);
+        if (otp_hash) free(otp_hash);
+        image_list_free(&fip_adds);
+        if (batch.digests) free(batch.digests);
+        if (batch.signatures) free(batch.signatures);
+        if (stats.image_ns) free(stats.image_ns);
+        image_list_free(&images);
         if (fp) fclose(fp);
-        munlockall();
         exit(EXIT_FAILURE);
 }
@@ -0,0 +1,763 @@
+// SPDX-License-Identifier: GPL-2.0+ OR BSD-3-Clause
+/*
+ * Copyright (C) 2022, Christian Melki
+ *
+ * TF-A Trusted Board Boot (TBBR) certificates of a FIP.
+ * What cert_create -n --key-alg ecdsa --hash-alg sha256 makes, with
+ * all non-volatile counters at 0, in process.
+ * Every certificate is self-issued and signed with its own key. The
+ * chain is in the extensions: the trusted key certificate, signed
+ * with the ROT key, carries the trusted and non-trusted world keys.
+ * Those sign the key certificates carrying the content certificate
+ * keys, and the content certificates carry the image hashes.
+ * The world and content keys are fresh P-256 keys, used once, unless
+ * a key directory keeps them between runs.
+ * Images are hashed in parallel, one per worker, straight from the
+ * FIP mapping.
+ * Incrementally, a certificate of the FIP is kept as it is when its
+ * signature, keys and hashes still hold. Only the ones that do not
+ * are made again, with the keys they need.
+ * Verification walks the chain from the ROT key the way BL2 does.
+ * Images are hashed and certificate signatures checked side by side,
+ * the chain is linked up afterwards.
+ */
+
+#define _DEFAULT_SOURCE
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+
+/* Usage of deprecated functions.
+ * Want this to build with older openssl.
+ */
+#define OPENSSL_API_COMPAT 0x10101000L
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/obj_mac.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+#include "config.h"
+#include "pool.h"
+#include "tbbr.h"
+
+#define UNUSED                          __attribute__((unused))
+#define TBBR_OID(n)                     "1.3.6.1.4.1.4128.2100." #n
+#define TBBR_TRUSTED_NVCOUNTER_OID      TBBR_OID(1)
+#define TBBR_NON_TRUSTED_NVCOUNTER_OID  TBBR_OID(2)
+#define TBBR_VALID_DAYS                 (20 * 365)
+#define TBBR_SERIAL_BITS                63
+#define TBBR_MAX_EXTS                   4
+
+/* How an image missing from the FIP is hashed. */
+enum tbbr_absent {
+        TBBR_REQUIRED,
+        /* A hash of zeros, like cert_create does for optional images. */
+        TBBR_ZEROS,
+        /* The hash of nothing. BL2 lives in the FSBL, not the FIP. */
+        TBBR_EMPTY,
+};
+
+static const struct {
+        const char *name;
+        const char *oid;
+        enum tbbr_absent absent;
+} tbbr_images[TBBR_NIMAGES] = {
+        [TBBR_TB_FW] = { "tb-fw", TBBR_OID(201), TBBR_EMPTY },
+        [TBBR_TB_FW_CONFIG] = { "tb-fw-config", TBBR_OID(202), TBBR_ZEROS },
+        [TBBR_HW_CONFIG] = { "hw-config", TBBR_OID(203), TBBR_ZEROS },
+        [TBBR_FW_CONFIG] = { "fw-config", TBBR_OID(204), TBBR_ZEROS },
+        [TBBR_TOS_FW] = { "tos-fw", TBBR_OID(602), TBBR_REQUIRED },
+        [TBBR_TOS_FW_EXTRA1] = { "tos-fw-extra1", TBBR_OID(604), TBBR_ZEROS },
+        [TBBR_TOS_FW_EXTRA2] = { "tos-fw-extra2", TBBR_OID(605), TBBR_ZEROS },
+        [TBBR_TOS_FW_CONFIG] = { "tos-fw-config", TBBR_OID(603), TBBR_ZEROS },
+        [TBBR_NT_FW] = { "nt-fw", TBBR_OID(1102), TBBR_REQUIRED },
+        [TBBR_NT_FW_CONFIG] = { "nt-fw-config", TBBR_OID(1103), TBBR_ZEROS },
+};
+
+/* Extension carrying the public key, when another certificate does. */
+static const char *const tbbr_key_oids[TBBR_NKEYS] = {
+        [TBBR_TRUSTED_WORLD_KEY] = TBBR_OID(301),
+        [TBBR_NON_TRUSTED_WORLD_KEY] = TBBR_OID(302),
+        [TBBR_TOS_FW_CONTENT_KEY] = TBBR_OID(601),
+        [TBBR_NT_FW_CONTENT_KEY] = TBBR_OID(1101),
+};
+
+/* Key directory files, named like the cert_create options. */
+static const char *const tbbr_key_files[TBBR_NKEYS] = {
+        [TBBR_TRUSTED_WORLD_KEY] = "trusted-world-key.pem",
+        [TBBR_NON_TRUSTED_WORLD_KEY] = "non-trusted-world-key.pem",
+        [TBBR_TOS_FW_CONTENT_KEY] = "tos-fw-key.pem",
+        [TBBR_NT_FW_CONTENT_KEY] = "nt-fw-key.pem",
+};
+
+/* Extensions after the counter: keys, or images. -1 ends a list. */
+static const struct {
+        const char *name;
+        const char *cn;
+        enum tbbr_key key;
+        bool trusted;
+        bool ca;
+        int keys[TBBR_MAX_EXTS];
+        int images[TBBR_MAX_EXTS];
+} tbbr_certs[TBBR_NCERTS] = {
+        [TBBR_TRUSTED_KEY_CERT] = {
+                "trusted-key-cert", "Trusted Key Certificate",
+                TBBR_ROT_KEY, true, true,
+                { TBBR_TRUSTED_WORLD_KEY, TBBR_NON_TRUSTED_WORLD_KEY, -1 },
+                { -1 },
+        },
+        [TBBR_TB_FW_CERT] = {
+                "tb-fw-cert", "Trusted Boot FW Certificate",
+                TBBR_ROT_KEY, true, false,
+                { -1 },
+                { TBBR_TB_FW, TBBR_TB_FW_CONFIG, TBBR_HW_CONFIG,
+                  TBBR_FW_CONFIG },
+        },
+        [TBBR_TOS_FW_KEY_CERT] = {
+                "tos-fw-key-cert", "Trusted OS FW Key Certificate",
+                TBBR_TRUSTED_WORLD_KEY, true, true,
+                { TBBR_TOS_FW_CONTENT_KEY, -1 },
+                { -1 },
+        },
+        [TBBR_TOS_FW_CERT] = {
+                "tos-fw-cert", "Trusted OS FW Content Certificate",
+                TBBR_TOS_FW_CONTENT_KEY, true, false,
+                { -1 },
+                { TBBR_TOS_FW, TBBR_TOS_FW_EXTRA1, TBBR_TOS_FW_EXTRA2,
+                  TBBR_TOS_FW_CONFIG },
+        },
+        [TBBR_NT_FW_KEY_CERT] = {
+                "nt-fw-key-cert", "Non-Trusted Firmware Key Certificate",
+                TBBR_NON_TRUSTED_WORLD_KEY, false, true,
+                { TBBR_NT_FW_CONTENT_KEY, -1 },
+                { -1 },
+        },
+        [TBBR_NT_FW_CERT] = {
+                "nt-fw-cert", "Non-Trusted Firmware Content Certificate",
+                TBBR_NT_FW_CONTENT_KEY, false, false,
+                { -1 },
+                { TBBR_NT_FW, TBBR_NT_FW_CONFIG, -1 },
+        },
+};
+
+/* DigestInfo DER up to the digest: SEQUENCE { AlgorithmIdentifier
+ * { sha256, NULL }, OCTET STRING }. NULL parameters, as cert_create
+ * writes them.
+ */
+static const uint8_t tbbr_hash_prefix[] = {
+        0x30, 0x31, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01,
+        0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20
+};
+
+struct tbbr_hash_job {
+        struct tbbr *t;
+        const struct fip_entry *e[TBBR_NIMAGES];
+};
+
+static int
+tbbr_hash_run(void *arg, void *wctx UNUSED, size_t job)
+{
+        struct tbbr_hash_job *hj = arg;
+        const struct fip_entry *e = hj->e[job];
+
+        if (e)
+                sha256(e->data, e->size, hj->t->md[job]);
+        else if (tbbr_images[job].absent == TBBR_EMPTY)
+                /* Absent, hashed as empty, as cert_create does for tb-fw. */
+                sha256((const uint8_t *)"", 0, hj->t->md[job]);
+        else
+                memset(hj->t->md[job], 0, SHA256_HASH_SIZE);
+
+        return 0;
+}
+
+static const struct pool_ops tbbr_hash_ops = {
+        .run = tbbr_hash_run,
+};
+
+/* Hash every image of the FIP the certificates cover. */
+static int
+tbbr_hash_images(struct tbbr *t, struct fip *fip, unsigned int jobs)
+{
+        struct tbbr_hash_job hj = { .t = t };
+        size_t i;
+
+        for (i = 0; i < TBBR_NIMAGES; i++) {
+                hj.e[i] = fip_find(fip, tbbr_images[i].name);
+                if (!hj.e[i] && tbbr_images[i].absent == TBBR_REQUIRED) {
+                        fprintf(stderr, "FIP has no %s.\n",
+                                tbbr_images[i].name);
+                        return -1;
+                }
+        }
+        if (pool_run(TBBR_NIMAGES, jobs, &tbbr_hash_ops, &hj)) {
+                fprintf(stderr, "Unable to hash FIP images.\n");
+                return -1;
+        }
+
+        return 0;
+}
+
+/* The certificate carrying key k, -1 for the ROT key. */
+static int
+tbbr_key_cert(int k)
+{
+        size_t i, j;
+
+        for (i = 0; i < TBBR_NCERTS; i++)
+                for (j = 0; j < TBBR_MAX_EXTS && tbbr_certs[i].keys[j] >= 0;
+                     j++)
+                        if (tbbr_certs[i].keys[j] == k)
+                                return i;
+
+        return -1;
+}
+
+static EVP_PKEY *
+tbbr_new_key(void)
+{
+        EVP_PKEY_CTX *ctx;
+        EVP_PKEY *key = NULL;
+
+        if (!(ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL)) ||
+            EVP_PKEY_keygen_init(ctx) <= 0 ||
+            EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx,
+                                                   NID_X9_62_prime256v1) <= 0 ||
+            EVP_PKEY_keygen(ctx, &key) <= 0) {
+                fprintf(stderr, "Unable to generate EC key.\n");
+                key = NULL;
+        }
+        if (ctx) EVP_PKEY_CTX_free(ctx);
+
+        return key;
+}
+
+/* A critical extension with DER contents. */
+static int
+tbbr_add_ext(X509 *x, const char *oid, const uint8_t *der, int len)
+{
+        ASN1_OBJECT *obj = NULL;
+        ASN1_OCTET_STRING *os = NULL;
+        X509_EXTENSION *ex = NULL;
+        int ret = -1;
+
+        if ((obj = OBJ_txt2obj(oid, 1)) &&
+            (os = ASN1_OCTET_STRING_new()) &&
+            ASN1_OCTET_STRING_set(os, der, len) &&
+            (ex = X509_EXTENSION_create_by_OBJ(NULL, obj, 1, os)) &&
+            X509_add_ext(x, ex, -1))
+                ret = 0;
+
+        if (ex) X509_EXTENSION_free(ex);
+        if (os) ASN1_OCTET_STRING_free(os);
+        if (obj) ASN1_OBJECT_free(obj);
+        return ret;
+}
+
+static int
+tbbr_add_std_ext(X509 *x, int nid, const char *value)
+{
+        X509V3_CTX ctx;
+        X509_EXTENSION *ex;
+        int ret;
+
+        X509V3_set_ctx(&ctx, x, x, NULL, NULL, 0);
+        if (!(ex = X509V3_EXT_conf_nid(NULL, &ctx, nid, value)))
+                return -1;
+        ret = X509_add_ext(x, ex, -1) ? 0 : -1;
+        X509_EXTENSION_free(ex);
+
+        return ret;
+}
+
+static int
+tbbr_add_nvcounter(X509 *x, bool trusted)
+{
+        ASN1_INTEGER *ai;
+        uint8_t *der = NULL;
+        int len = -1, ret;
+
+        if ((ai = ASN1_INTEGER_new()) && ASN1_INTEGER_set(ai, 0))
+                len = i2d_ASN1_INTEGER(ai, &der);
+        if (ai) ASN1_INTEGER_free(ai);
+        if (len <= 0)
+                return -1;
+        ret = tbbr_add_ext(x, trusted ? TBBR_TRUSTED_NVCOUNTER_OID :
+                           TBBR_NON_TRUSTED_NVCOUNTER_OID, der, len);
+        OPENSSL_free(der);
+
+        return ret;
+}
+
+static int
+tbbr_add_key(X509 *x, const char *oid, EVP_PKEY *key)
+{
+        uint8_t *der = NULL;
+        int len, ret;
+
+        if ((len = i2d_PUBKEY(key, &der)) <= 0)
+                return -1;
+        ret = tbbr_add_ext(x, oid, der, len);
+        OPENSSL_free(der);
+
+        return ret;
+}
+
+static int
+tbbr_add_hash(X509 *x, const char *oid, const uint8_t *md)
+{
+        uint8_t der[sizeof(tbbr_hash_prefix) + SHA256_HASH_SIZE];
+
+        memcpy(der, tbbr_hash_prefix, sizeof(tbbr_hash_prefix));
+        memcpy(&der[sizeof(tbbr_hash_prefix)], md, SHA256_HASH_SIZE);
+
+        return tbbr_add_ext(x, oid, der, sizeof(der));
+}
+
+/* Build, sign and encode one certificate. */
+static int
+tbbr_make_cert(struct tbbr *t, enum tbbr_cert id)
+{
+        EVP_PKEY *key = t->keys[tbbr_certs[id].key];
+        X509 *x = NULL;
+        X509_NAME *name;
+        BIGNUM *bn = NULL;
+        size_t i;
+        int k, ret = -1;
+
+        if (!(x = X509_new()) || !X509_set_version(x, 2) ||
+            !(bn = BN_new()) ||
+            !BN_rand(bn, TBBR_SERIAL_BITS, BN_RAND_TOP_ANY,
+                     BN_RAND_BOTTOM_ANY) ||
+            !BN_to_ASN1_INTEGER(bn, X509_get_serialNumber(x)) ||
+            !X509_gmtime_adj(X509_getm_notBefore(x), 0) ||
+            !X509_time_adj_ex(X509_getm_notAfter(x), TBBR_VALID_DAYS, 0,
+                              NULL) ||
+            !(name = X509_get_subject_name(x)) ||
+            !X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                        (const unsigned char *)
+                                        tbbr_certs[id].cn, -1, -1, 0) ||
+            !X509_set_issuer_name(x, name) ||
+            !X509_set_pubkey(x, key)) {
+                goto out;
+        }
+        if (tbbr_add_std_ext(x, NID_subject_key_identifier, "hash") ||
+            tbbr_add_std_ext(x, NID_authority_key_identifier,
+                             "keyid:always") ||
+            tbbr_add_std_ext(x, NID_basic_constraints, tbbr_certs[id].ca ?
+                             "critical,CA:TRUE" : "critical,CA:FALSE") ||
+            tbbr_add_nvcounter(x, tbbr_certs[id].trusted)) {
+                goto out;
+        }
+        for (i = 0; i < TBBR_MAX_EXTS && (k = tbbr_certs[id].keys[i]) >= 0;
+             i++) {
+                if (tbbr_add_key(x, tbbr_key_oids[k], t->keys[k]))
+                        goto out;
+        }
+        for (i = 0; i < TBBR_MAX_EXTS && (k = tbbr_certs[id].images[i]) >= 0;
+             i++) {
+                if (tbbr_add_hash(x, tbbr_images[k].oid, t->md[k]))
+                        goto out;
+        }
+        if (!X509_sign(x, key, EVP_sha256()) ||
+            (t->der_len[id] = i2d_X509(x, &t->der[id])) <= 0) {
+                t->der[id] = NULL;
+                goto out;
+        }
+        ret = 0;
+
+ out:
+        if (ret)
+                fprintf(stderr, "Unable to create %s.\n", tbbr_certs[id].name);
+        if (bn) BN_free(bn);
+        if (x) X509_free(x);
+        return ret;
+}
+
+/* Replace key k with a new one. Certificates carrying it no longer hold. */
+static int
+tbbr_renew_key(struct tbbr *t, int k)
+{
+        if (t->keys[k]) EVP_PKEY_free(t->keys[k]);
+        if (!(t->keys[k] = tbbr_new_key()))
+                return -1;
+        t->priv[k] = true;
+        t->fresh[k] = true;
+
+        return 0;
+}
+
+/* A missing key file is not an error, the key is made instead. */
+static int
+tbbr_load_key(struct tbbr *t, const char *dir, int k)
+{
+        char path[PATH_MAX];
+        FILE *fp;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, tbbr_key_files[k]);
+        if (!(fp = fopen(path, "re"))) {
+                if (errno == ENOENT)
+                        return 0;
+                fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+                return -1;
+        }
+        t->keys[k] = PEM_read_PrivateKey(fp, NULL, NULL, (void *)"");
+        fclose(fp);
+        if (!t->keys[k]) {
+                fprintf(stderr, "Unable to read key %s.\n", path);
+                return -1;
+        }
+        t->priv[k] = true;
+
+        return 0;
+}
+
+/* Unencrypted, like cert_create writes them. Never over an existing key. */
+static int
+tbbr_save_key(const struct tbbr *t, const char *dir, int k)
+{
+        char path[PATH_MAX];
+        FILE *fp = NULL;
+        int fd, ret = -1;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, tbbr_key_files[k]);
+        if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                       0600)) < 0) {
+                fprintf(stderr, "Cannot create %s: %s\n", path,
+                        strerror(errno));
+                return -1;
+        }
+        if (!(fp = fdopen(fd, "w"))) {
+                close(fd);
+        } else if (PEM_write_PrivateKey(fp, t->keys[k], NULL, NULL, 0, NULL,
+                                        NULL)) {
+                ret = 0;
+        }
+        if (fp && fclose(fp))
+                ret = -1;
+        if (ret)
+                fprintf(stderr, "Unable to write key %s.\n", path);
+
+        return ret;
+}
+
+static const ASN1_OCTET_STRING *
+tbbr_find_ext(const X509 *x, const char *oid)
+{
+        ASN1_OBJECT *obj;
+        int i;
+
+        if (!(obj = OBJ_txt2obj(oid, 1)))
+                return NULL;
+        i = X509_get_ext_by_OBJ(x, obj, -1);
+        ASN1_OBJECT_free(obj);
+
+        return i < 0 ? NULL : X509_EXTENSION_get_data(X509_get_ext(x, i));
+}
+
+/* The public key in the extension oid of x, or NULL. */
+static EVP_PKEY *
+tbbr_ext_key(const X509 *x, const char *oid)
+{
+        const ASN1_OCTET_STRING *os;
+        const uint8_t *p;
+
+        if (!(os = tbbr_find_ext(x, oid)))
+                return NULL;
+        p = ASN1_STRING_get0_data(os);
+
+        return d2i_PUBKEY(NULL, &p, ASN1_STRING_length(os));
+}
+
+/* The image hash in the extension oid of x. A DigestInfo of sha256,
+ * its parameters absent or NULL, encoders differ there. -1 for
+ * anything else.
+ */
+static int
+tbbr_ext_hash(const X509 *x, const char *oid, uint8_t *md)
+{
+        const ASN1_OCTET_STRING *os, *digest;
+        const X509_ALGOR *alg;
+        const ASN1_OBJECT *obj;
+        const uint8_t *p, *end;
+        X509_SIG *sig;
+        int ptype, ret = -1;
+
+        if (!(os = tbbr_find_ext(x, oid)))
+                return -1;
+        p = ASN1_STRING_get0_data(os);
+        end = p + ASN1_STRING_length(os);
+        if (!(sig = d2i_X509_SIG(NULL, &p, end - p)))
+                return -1;
+        X509_SIG_get0(sig, &alg, &digest);
+        X509_ALGOR_get0(&obj, &ptype, NULL, alg);
+        if (p == end && OBJ_obj2nid(obj) == NID_sha256 &&
+            (ptype == V_ASN1_UNDEF || ptype == V_ASN1_NULL) &&
+            ASN1_STRING_length(digest) == SHA256_HASH_SIZE) {
+                memcpy(md, ASN1_STRING_get0_data(digest), SHA256_HASH_SIZE);
+                ret = 0;
+        }
+        X509_SIG_free(sig);
+
+        return ret;
+}
+
+/* Whether a certificate of the FIP is what would be made now, but for
+ * serial, validity and counter: signed with the current key, carrying
+ * the current keys and hashes.
+ */
+static bool
+tbbr_cert_holds(const struct tbbr *t, X509 *x, enum tbbr_cert id)
+{
+        EVP_PKEY *key = t->keys[tbbr_certs[id].key];
+        uint8_t md[SHA256_HASH_SIZE];
+        EVP_PKEY *ext;
+        size_t i;
+        bool ok;
+        int k;
+
+        if (EVP_PKEY_cmp(X509_get0_pubkey(x), key) != 1 ||
+            X509_verify(x, key) != 1)
+                return false;
+        for (i = 0; i < TBBR_MAX_EXTS && (k = tbbr_certs[id].keys[i]) >= 0;
+             i++) {
+                ext = tbbr_ext_key(x, tbbr_key_oids[k]);
+                ok = ext && EVP_PKEY_cmp(ext, t->keys[k]) == 1;
+                if (ext) EVP_PKEY_free(ext);
+                if (!ok)
+                        return false;
+        }
+        for (i = 0; i < TBBR_MAX_EXTS && (k = tbbr_certs[id].images[i]) >= 0;
+             i++) {
+                if (tbbr_ext_hash(x, tbbr_images[k].oid, md) ||
+                    memcmp(md, t->md[k], SHA256_HASH_SIZE))
+                        return false;
+        }
+
+        return true;
+}
+
+void
+tbbr_free(struct tbbr *t)
+{
+        size_t i;
+
+        if (!t)
+                return;
+
+        for (i = 0; i < TBBR_NKEYS; i++)
+                if (t->keys[i]) EVP_PKEY_free(t->keys[i]);
+        for (i = 0; i < TBBR_NCERTS; i++)
+                if (t->der[i]) OPENSSL_free(t->der[i]);
+        memset(t, 0, sizeof(*t));
+}
+
+/* Create the certificates for the images of fip, and set them in it.
+ * They stay owned by t, which must outlive the FIP write.
+ * Keys are read from key_dir when there, and new ones written to it.
+ * Incrementally, keys that are in neither are taken from the
+ * certificates of the FIP, and the certificates that still hold are
+ * left in it as they are.
+ */
+int
+tbbr_create(struct tbbr *t, struct fip *fip, EVP_PKEY *rot,
+            const char *key_dir, bool incremental, unsigned int jobs)
+{
+        X509 *old[TBBR_NCERTS] = { NULL };
+        struct fip_entry *e;
+        const uint8_t *p;
+        int i, k, ret = -1;
+
+        memset(t, 0, sizeof(*t));
+        if (!EVP_PKEY_up_ref(rot)) {
+                return -1;
+        }
+        t->keys[TBBR_ROT_KEY] = rot;
+        t->priv[TBBR_ROT_KEY] = true;
+        for (i = 0; incremental && i < TBBR_NCERTS; i++) {
+                if (!(e = fip_find(fip, tbbr_certs[i].name)))
+                        continue;
+                p = e->data;
+                /* One that does not parse is made again. */
+                old[i] = d2i_X509(NULL, &p, e->size);
+        }
+        for (k = TBBR_ROT_KEY + 1; k < TBBR_NKEYS; k++) {
+                if (key_dir && tbbr_load_key(t, key_dir, k))
+                        goto out;
+                if (!t->keys[k] && (i = tbbr_key_cert(k)) >= 0 && old[i])
+                        t->keys[k] = tbbr_ext_key(old[i], tbbr_key_oids[k]);
+                if (!t->keys[k] && tbbr_renew_key(t, k))
+                        goto out;
+        }
+        if (tbbr_hash_images(t, fip, jobs)) {
+                goto out;
+        }
+        /* Key certificates come before the ones signed with the keys they
+         * carry. Going backwards, a certificate made again with a new key
+         * is seen before the one carrying that key is checked.
+         */
+        for (i = TBBR_NCERTS - 1; i >= 0; i--) {
+                k = tbbr_certs[i].key;
+                if (old[i] && tbbr_cert_holds(t, old[i], i)) {
+                        t->kept[i] = true;
+                        continue;
+                }
+                if (!t->priv[k] && tbbr_renew_key(t, k))
+                        goto out;
+                if (tbbr_make_cert(t, i) ||
+                    fip_set(fip, tbbr_certs[i].name, t->der[i],
+                            t->der_len[i]))
+                        goto out;
+        }
+        for (k = TBBR_ROT_KEY + 1; key_dir && k < TBBR_NKEYS; k++) {
+                if (t->fresh[k] && tbbr_save_key(t, key_dir, k))
+                        goto out;
+        }
+        ret = 0;
+
+ out:
+        for (i = 0; i < TBBR_NCERTS; i++)
+                if (old[i]) X509_free(old[i]);
+        if (ret)
+                tbbr_free(t);
+        return ret;
+}
+
+struct tbbr_verify_job {
+        struct tbbr_hash_job hash;
+        const struct fip_entry *c[TBBR_NCERTS];
+        X509 *x[TBBR_NCERTS];
+        bool self_signed[TBBR_NCERTS];
+};
+
+/* Jobs are the images, then the certificates. */
+static int
+tbbr_verify_run(void *arg, void *wctx, size_t job)
+{
+        struct tbbr_verify_job *vj = arg;
+        const struct fip_entry *e;
+        const uint8_t *p;
+        X509 *x;
+
+        if (job < TBBR_NIMAGES)
+                return tbbr_hash_run(&vj->hash, wctx, job);
+        job -= TBBR_NIMAGES;
+        if (!(e = vj->c[job]))
+                return 0;
+        p = e->data;
+        if (!(x = d2i_X509(NULL, &p, e->size)))
+                return 0;
+        vj->x[job] = x;
+        vj->self_signed[job] = X509_verify(x, X509_get0_pubkey(x)) == 1;
+
+        return 0;
+}
+
+static const struct pool_ops tbbr_verify_ops = {
+        .run = tbbr_verify_run,
+};
+
+/* Check one certificate against its signing key, the key rot or a
+ * certificate closer to it carries, and the hashes of the images
+ * that are in the FIP.
+ */
+static int
+tbbr_verify_cert(const struct tbbr_verify_job *vj, EVP_PKEY *rot,
+                 enum tbbr_cert id)
+{
+        const char *name = tbbr_certs[id].name;
+        uint8_t md[SHA256_HASH_SIZE];
+        EVP_PKEY *key;
+        size_t i;
+        int k, ret = 0;
+
+        if (!vj->c[id]) {
+                fprintf(stderr, "FIP has no %s.\n", name);
+                return -1;
+        }
+        if (!vj->x[id]) {
+                fprintf(stderr, "%s: Invalid certificate.\n", name);
+                return -1;
+        }
+        if (!vj->self_signed[id]) {
+                fprintf(stderr, "%s: Invalid signature.\n", name);
+                ret = -1;
+        }
+        k = tbbr_certs[id].key;
+        if (k == TBBR_ROT_KEY) {
+                key = rot;
+                if (EVP_PKEY_up_ref(key) != 1)
+                        key = NULL;
+        } else {
+                i = tbbr_key_cert(k);
+                key = vj->x[i] ? tbbr_ext_key(vj->x[i], tbbr_key_oids[k]) :
+                      NULL;
+        }
+        if (!key || EVP_PKEY_cmp(X509_get0_pubkey(vj->x[id]), key) != 1) {
+                fprintf(stderr, "%s: Not signed with the key of %s.\n", name,
+                        k == TBBR_ROT_KEY ? "the ROT" :
+                        tbbr_certs[tbbr_key_cert(k)].name);
+                ret = -1;
+        }
+        if (key) EVP_PKEY_free(key);
+        for (i = 0; i < TBBR_MAX_EXTS && (k = tbbr_certs[id].images[i]) >= 0;
+             i++) {
+                if (!vj->hash.e[k])
+                        continue;
+                if (tbbr_ext_hash(vj->x[id], tbbr_images[k].oid, md) ||
+                    memcmp(md, vj->hash.t->md[k], SHA256_HASH_SIZE)) {
+                        fprintf(stderr, "%s: %s hash mismatch.\n", name,
+                                tbbr_images[k].name);
+                        ret = -1;
+                }
+        }
+
+        return ret;
+}
+
+/* Verify the certificates of fip against the ROT key, and the images
+ * of fip against the certificates. Every failure is reported.
+ * Images the FIP does not have are not checked, BL2 loads none.
+ */
+int
+tbbr_verify(struct fip *fip, EVP_PKEY *rot, unsigned int jobs)
+{
+        struct tbbr_verify_job vj = { 0 };
+        struct tbbr t = { 0 };
+        size_t i;
+        int ret = 0;
+
+        vj.hash.t = &t;
+        for (i = 0; i < TBBR_NIMAGES; i++) {
+                vj.hash.e[i] = fip_find(fip, tbbr_images[i].name);
+                if (!vj.hash.e[i] && tbbr_images[i].absent == TBBR_REQUIRED) {
+                        fprintf(stderr, "FIP has no %s.\n",
+                                tbbr_images[i].name);
+                        ret = -1;
+                }
+        }
+        for (i = 0; i < TBBR_NCERTS; i++)
+                vj.c[i] = fip_find(fip, tbbr_certs[i].name);
+        if (pool_run(TBBR_NIMAGES + TBBR_NCERTS, jobs, &tbbr_verify_ops,
+                     &vj)) {
+                fprintf(stderr, "Unable to verify FIP.\n");
+                ret = -1;
+                goto out;
+        }
+        for (i = 0; i < TBBR_NCERTS; i++)
+                if (tbbr_verify_cert(&vj, rot, i))
+                        ret = -1;
+
+ out:
+        for (i = 0; i < TBBR_NCERTS; i++)
+                if (vj.x[i]) X509_free(vj.x[i]);
+        return ret;
+}
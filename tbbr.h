@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: GPL-2.0+ OR BSD-3-Clause
+/*
+ * Copyright (C) 2022, Christian Melki
+ *
+ * TF-A Trusted Board Boot (TBBR) certificates of a FIP.
+ */
+
+#ifndef TBBR_H
+#define TBBR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <openssl/evp.h>
+
+#include "fip.h"
+#include "sha256.h"
+
+enum tbbr_key {
+        TBBR_ROT_KEY,
+        TBBR_TRUSTED_WORLD_KEY,
+        TBBR_NON_TRUSTED_WORLD_KEY,
+        TBBR_TOS_FW_CONTENT_KEY,
+        TBBR_NT_FW_CONTENT_KEY,
+        TBBR_NKEYS
+};
+
+enum tbbr_image {
+        TBBR_TB_FW,
+        TBBR_TB_FW_CONFIG,
+        TBBR_HW_CONFIG,
+        TBBR_FW_CONFIG,
+        TBBR_TOS_FW,
+        TBBR_TOS_FW_EXTRA1,
+        TBBR_TOS_FW_EXTRA2,
+        TBBR_TOS_FW_CONFIG,
+        TBBR_NT_FW,
+        TBBR_NT_FW_CONFIG,
+        TBBR_NIMAGES
+};
+
+enum tbbr_cert {
+        TBBR_TRUSTED_KEY_CERT,
+        TBBR_TB_FW_CERT,
+        TBBR_TOS_FW_KEY_CERT,
+        TBBR_TOS_FW_CERT,
+        TBBR_NT_FW_KEY_CERT,
+        TBBR_NT_FW_CERT,
+        TBBR_NCERTS
+};
+
+struct tbbr {
+        /* The ROT key is the callers, the others are loaded or generated. */
+        EVP_PKEY *keys[TBBR_NKEYS];
+        /* Keys only known from a certificate of the FIP are public. */
+        bool priv[TBBR_NKEYS];
+        /* Generated in this run. */
+        bool fresh[TBBR_NKEYS];
+        uint8_t md[TBBR_NIMAGES][SHA256_HASH_SIZE];
+        /* DER certificates, as set in the FIP. */
+        uint8_t *der[TBBR_NCERTS];
+        int der_len[TBBR_NCERTS];
+        /* Certificates of the FIP that still hold, left as they are. */
+        bool kept[TBBR_NCERTS];
+};
+
+int tbbr_create(struct tbbr *t, struct fip *fip, EVP_PKEY *rot,
+                const char *key_dir, bool incremental, unsigned int jobs);
+void tbbr_free(struct tbbr *t);
+int tbbr_verify(struct fip *fip, EVP_PKEY *rot, unsigned int jobs);
+
+#endif /* TBBR_H */
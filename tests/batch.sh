@@ -0,0 +1,28 @@
+#!/bin/bash
+# Batch mode: one key load for a list of images, from a file or from
+# stdin, NUL separated or not. A missing image fails the run.
+
+. ${srcdir:-.}/tests/common.sh
+
+make_key ${TEST_DIR}/key
+for I in 1 2 3 4 5 6 7 8; do
+    make_image ${TEST_DIR}/img.stm32 $((I * 3))K ${I}
+    mv ${TEST_DIR}/img.stm32 "${TEST_DIR}/img ${I}.stm32"
+    echo "${TEST_DIR}/img ${I}.stm32" >> ${TEST_DIR}/list.txt
+done
+
+${STM32MP1SIGN} --image-list ${TEST_DIR}/list.txt --key ${TEST_DIR}/key.pem \
+		--password ${TEST_PWD} --sign || fail "batch signing failed"
+for I in 1 2 3 4 5 6 7 8; do
+    ${STM32MP1SIGN} --image "${TEST_DIR}/img ${I}.stm32" \
+		    --key ${TEST_DIR}/key.pub --verify || \
+	fail "img ${I} does not verify"
+done
+tr '\n' '\0' < ${TEST_DIR}/list.txt | \
+    ${STM32MP1SIGN} --image-list - --null --key ${TEST_DIR}/key.pub \
+		    --verify || fail "batch verification from stdin failed"
+
+echo "${TEST_DIR}/missing.stm32" >> ${TEST_DIR}/list.txt
+${STM32MP1SIGN} --image-list ${TEST_DIR}/list.txt --key ${TEST_DIR}/key.pub \
+		--verify 2> /dev/null && fail "missing image not reported"
+exit 0
@@ -0,0 +1,43 @@
+#!/bin/bash
+# --cache keeps random and deterministic signatures apart. A cached
+# random signature is never handed out for a --deterministic run, for
+# the same file or for another one with the same content. A cache open
+# to others is refused.
+
+. ${srcdir:-.}/tests/common.sh
+
+make_key ${TEST_DIR}/key
+make_image ${TEST_DIR}/a.stm32 64K
+cp ${TEST_DIR}/a.stm32 ${TEST_DIR}/b.stm32
+cp ${TEST_DIR}/a.stm32 ${TEST_DIR}/ref.stm32
+
+# sign image [flags...]
+sign()
+{
+    IMAGE=$1
+    shift
+    ${STM32MP1SIGN} --image ${TEST_DIR}/${IMAGE} --key ${TEST_DIR}/key.pem \
+		    --password ${TEST_PWD} --sign "$@" || \
+	fail "${IMAGE} $* signing failed"
+}
+
+sign ref.stm32 --deterministic
+sign a.stm32 --cache ${TEST_DIR}/cache.db
+cmp -s ${TEST_DIR}/a.stm32 ${TEST_DIR}/ref.stm32 && \
+    fail "random signature is deterministic"
+# Same content as a, by digest.
+sign b.stm32 --deterministic --cache ${TEST_DIR}/cache.db
+cmp ${TEST_DIR}/b.stm32 ${TEST_DIR}/ref.stm32 || \
+    fail "cached random signature used for another image"
+# The very file signed above, by stat.
+sign a.stm32 --deterministic --cache ${TEST_DIR}/cache.db
+cmp ${TEST_DIR}/a.stm32 ${TEST_DIR}/ref.stm32 || \
+    fail "cached random signature kept"
+${STM32MP1SIGN} --image ${TEST_DIR}/a.stm32 --key ${TEST_DIR}/key.pub \
+		--verify --cache ${TEST_DIR}/cache.db || fail "verify failed"
+# Only a cache private to the user is used.
+chmod 0664 ${TEST_DIR}/cache.db
+${STM32MP1SIGN} --image ${TEST_DIR}/a.stm32 --key ${TEST_DIR}/key.pub \
+		--verify --cache ${TEST_DIR}/cache.db 2> /dev/null && \
+    fail "group writable cache used"
+exit 0
@@ -0,0 +1,64 @@
+#!/bin/bash
+# Re-signing with --checkpoint resumes from the sidecar midstates and
+# must give the same signed image as hashing the whole payload.
+
+. ${srcdir:-.}/tests/common.sh
+
+# sign image flags...
+sign()
+{
+    IMAGE=$1
+    shift
+    ${STM32MP1SIGN} --image ${TEST_DIR}/${IMAGE} --key ${TEST_DIR}/key.pem \
+		    --password ${TEST_PWD} --sign --deterministic "$@" || \
+	fail "signing ${IMAGE} failed"
+}
+
+# swap image offset offset. Keeps the payload checksum.
+swap()
+{
+    X=$(dd if=$1 bs=1 skip=$2 count=1 2> /dev/null | od -An -tx1 | tr -d ' ')
+    Y=$(dd if=$1 bs=1 skip=$3 count=1 2> /dev/null | od -An -tx1 | tr -d ' ')
+    printf "\x${Y}" | dd of=$1 bs=1 seek=$2 conv=notrunc 2> /dev/null
+    printf "\x${X}" | dd of=$1 bs=1 seek=$3 conv=notrunc 2> /dev/null
+}
+
+make_key ${TEST_DIR}/key
+make_image ${TEST_DIR}/a.stm32 3M
+sign a.stm32 --checkpoint 1
+[ -s ${TEST_DIR}/a.stm32.sha256ck ] || fail "no checkpoint file"
+
+for OFFSET in 2621440 300000 1048832; do
+    cp ${TEST_DIR}/a.stm32 ${TEST_DIR}/before.stm32
+    swap ${TEST_DIR}/a.stm32 ${OFFSET} $((OFFSET + 7))
+    cmp -s ${TEST_DIR}/a.stm32 ${TEST_DIR}/before.stm32 && \
+	fail "payload at ${OFFSET} not changed"
+    cp ${TEST_DIR}/a.stm32 ${TEST_DIR}/ref.stm32
+    sign a.stm32 --checkpoint 1
+    sign ref.stm32
+    cmp ${TEST_DIR}/a.stm32 ${TEST_DIR}/ref.stm32 || \
+	fail "resumed signature differs after a change at ${OFFSET}"
+done
+
+# An unchanged image resumes from the last checkpoint.
+sign a.stm32 --checkpoint 1
+cmp ${TEST_DIR}/a.stm32 ${TEST_DIR}/ref.stm32 || \
+    fail "resumed signature differs on an unchanged image"
+${STM32MP1SIGN} --image ${TEST_DIR}/a.stm32 --key ${TEST_DIR}/key.pub \
+		--verify || fail "resumed signature does not verify"
+
+# A tampered sidecar, or one with a loose mode, is ignored. The image
+# is hashed in full and still gets the reference signature.
+CK=${TEST_DIR}/a.stm32.sha256ck
+printf "\xff\xff\xff\xff" | dd of=${CK} bs=1 seek=236 conv=notrunc 2> /dev/null
+sign a.stm32 --checkpoint 1 2> ${TEST_DIR}/tampered.err
+grep -q "bad MAC" ${TEST_DIR}/tampered.err || fail "tampered sidecar used"
+cmp ${TEST_DIR}/a.stm32 ${TEST_DIR}/ref.stm32 || \
+    fail "signature differs after a tampered sidecar"
+[ $(stat -c %a ${CK}) = 600 ] || fail "sidecar not rewritten with mode 0600"
+chmod 0644 ${CK}
+sign a.stm32 --checkpoint 1 2> ${TEST_DIR}/mode.err
+grep -q "mode 0600" ${TEST_DIR}/mode.err || fail "sidecar with mode 0644 used"
+cmp ${TEST_DIR}/a.stm32 ${TEST_DIR}/ref.stm32 || \
+    fail "signature differs after a sidecar with mode 0644"
+exit 0
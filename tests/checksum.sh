@@ -0,0 +1,35 @@
+#!/bin/bash
+# Signing fills in the payload checksum from the hash pass, mapped or
+# streamed, and verification checks it. It is not covered by the
+# signature.
+
+. ${srcdir:-.}/tests/common.sh
+
+# Header bytes 68 to 71, image_checksum.
+checksum()
+{
+    od -An -tx1 -j 68 -N 4 $1
+}
+
+make_key ${TEST_DIR}/key
+make_image ${TEST_DIR}/ref.stm32 1M
+for MODE in map stream; do
+    FLAGS=""
+    [ ${MODE} = stream ] && FLAGS="--stream"
+    cp ${TEST_DIR}/ref.stm32 ${TEST_DIR}/${MODE}.stm32
+    printf '\0\0\0\0' | dd of=${TEST_DIR}/${MODE}.stm32 bs=1 seek=68 \
+			   conv=notrunc 2> /dev/null
+    ${STM32MP1SIGN} --image ${TEST_DIR}/${MODE}.stm32 --key ${TEST_DIR}/key.pem \
+		    --password ${TEST_PWD} --sign ${FLAGS} || \
+	fail "${MODE} signing failed"
+    [ "$(checksum ${TEST_DIR}/${MODE}.stm32)" = \
+      "$(checksum ${TEST_DIR}/ref.stm32)" ] || fail "${MODE} checksum wrong"
+    ${STM32MP1SIGN} --image ${TEST_DIR}/${MODE}.stm32 \
+		    --key ${TEST_DIR}/key.pub --verify ${FLAGS} || \
+	fail "${MODE} verification failed"
+done
+
+printf '\1' | dd of=${TEST_DIR}/map.stm32 bs=1 seek=68 conv=notrunc 2> /dev/null
+${STM32MP1SIGN} --image ${TEST_DIR}/map.stm32 --key ${TEST_DIR}/key.pub \
+		--verify 2> /dev/null && fail "bad checksum accepted"
+exit 0
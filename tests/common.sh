@@ -0,0 +1,57 @@
+# Shared setup of the regression tests, sourced by each of them.
+# Every test gets a scratch directory, removed afterwards.
+#
+# Environment:
+# STM32MP1SIGN  : stm32mp1sign binary.
+# STM32MKIMAGE  : stm32mkimage binary.
+# SHA256BENCH   : sha256bench binary.
+
+STM32MP1SIGN=${STM32MP1SIGN:-./stm32mp1sign}
+STM32MKIMAGE=${STM32MKIMAGE:-./stm32mkimage}
+TEST_PWD="test"
+
+# Exit status 77 is a skip to the automake test driver.
+command -v openssl > /dev/null 2>&1 || exit 77
+
+TEST_DIR=$(mktemp -d)
+trap "rm -rf ${TEST_DIR}" EXIT
+
+fail()
+{
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+# Encrypted private key $1.pem and public key $1.pub, curve $2.
+make_key()
+{
+    openssl ecparam -name ${2:-prime256v1} -genkey -noout | \
+	openssl ec -aes256 -passout pass:${TEST_PWD} -out $1.pem \
+		> /dev/null 2>&1 && \
+    openssl ec -in $1.pem -passin pass:${TEST_PWD} -pubout -out $1.pub \
+	    > /dev/null 2>&1 || fail "openssl: $1 key generation failed"
+}
+
+# Unsigned image $1 of size $2, payload seed $3.
+make_image()
+{
+    ${STM32MKIMAGE} --output $1 --size $2 --seed ${3:-1} || \
+	fail "stm32mkimage: $1 failed"
+}
+
+# FIP $1 with the constituents sign.sh wants, random payloads.
+make_fip()
+{
+    local FIP=$1 ADD="" NAME
+
+    # ToC header, name and serial, no flags, then the null entry.
+    { printf '\x01\x00\x64\xaa\x01\x00\x00\x00'; head -c 24 /dev/zero
+      printf '\x38'; head -c 23 /dev/zero; } > ${FIP}.empty
+    for NAME in fw-config hw-config nt-fw tos-fw tos-fw-extra1 tos-fw-extra2; do
+	head -c $((RANDOM % 4096 + 64)) /dev/urandom > ${FIP}.${NAME}
+	ADD="${ADD} --fip-add ${NAME}=${FIP}.${NAME}"
+    done
+    ${STM32MP1SIGN} --fip ${FIP}.empty ${ADD} --fip-output ${FIP} || \
+	fail "stm32mp1sign: $1 FIP failed"
+    rm -f ${FIP}.*
+}
@@ -0,0 +1,37 @@
+#!/bin/bash
+# Detached signing round trip: emit the digests, sign them without the
+# images and import the signatures. --stats must stay out of a manifest
+# written to stdout.
+
+. ${srcdir:-.}/tests/common.sh
+
+make_key ${TEST_DIR}/key
+for I in 1 2 3; do
+    make_image ${TEST_DIR}/img${I}.stm32 64K ${I}
+done
+
+${STM32MP1SIGN} --image ${TEST_DIR}/img1.stm32 --image ${TEST_DIR}/img2.stm32 \
+		--image ${TEST_DIR}/img3.stm32 --key ${TEST_DIR}/key.pub \
+		--emit-digest - --stats > ${TEST_DIR}/digests.txt \
+		2> ${TEST_DIR}/emit.stats || fail "emitting digests failed"
+grep -q "op=emit " ${TEST_DIR}/emit.stats || fail "emit stats missing"
+
+${STM32MP1SIGN} --sign-digests ${TEST_DIR}/digests.txt \
+		--key ${TEST_DIR}/key.pem --password ${TEST_PWD} --stats \
+		> ${TEST_DIR}/signatures.txt 2> ${TEST_DIR}/sign.stats || \
+    fail "signing digests failed"
+grep -q "op=sign-digests " ${TEST_DIR}/sign.stats || \
+    fail "sign-digests stats missing"
+[ $(wc -l < ${TEST_DIR}/signatures.txt) -eq 3 ] || \
+    fail "signature manifest is not one line per image"
+
+${STM32MP1SIGN} --import-signature ${TEST_DIR}/signatures.txt \
+		--key ${TEST_DIR}/key.pub --stats > ${TEST_DIR}/import.stats || \
+    fail "importing signatures failed"
+grep -q "op=import " ${TEST_DIR}/import.stats || fail "import stats missing"
+for I in 1 2 3; do
+    ${STM32MP1SIGN} --image ${TEST_DIR}/img${I}.stm32 \
+		    --key ${TEST_DIR}/key.pub --verify || \
+	fail "img${I} does not verify"
+done
+exit 0
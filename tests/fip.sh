@@ -0,0 +1,73 @@
+#!/bin/bash
+# TBBR chain of trust of a FIP: signed, verified against the ROT key
+# hash, rejected when tampered with, and kept byte for byte by an
+# incremental run with the same keys.
+
+. ${srcdir:-.}/tests/common.sh
+
+make_key ${TEST_DIR}/rot
+make_image ${TEST_DIR}/fsbl.stm32 64K
+make_fip ${TEST_DIR}/fip.bin
+mkdir ${TEST_DIR}/keys
+# The OTP hash is the sha256 of the raw X and Y of the ROT key.
+OTP=$(openssl ec -pubin -in ${TEST_DIR}/rot.pub -outform DER 2> /dev/null | \
+	  tail -c 64 | sha256sum | cut -d ' ' -f 1)
+
+# sign fip output [flags...]
+sign()
+{
+    FIP=$1
+    OUT=$2
+    shift 2
+    ${STM32MP1SIGN} --key ${TEST_DIR}/rot.pem --password ${TEST_PWD} --sign \
+		    --fip ${TEST_DIR}/${FIP} --fip-output ${TEST_DIR}/${OUT} \
+		    --fip-keys ${TEST_DIR}/keys "$@" || \
+	fail "${FIP} $* signing failed"
+}
+
+# verify_chain fip otp-hash
+verify_chain()
+{
+    ${STM32MP1SIGN} --image ${TEST_DIR}/fsbl.stm32 --fip ${TEST_DIR}/$1 \
+		    --key ${TEST_DIR}/rot.pub --verify-chain --otp-hash $2
+}
+
+# unpack fip dir
+unpack()
+{
+    mkdir ${TEST_DIR}/$2
+    ${STM32MP1SIGN} --fip ${TEST_DIR}/$1 --fip-unpack ${TEST_DIR}/$2 || \
+	fail "$1 unpacking failed"
+}
+
+sign fip.bin signed.bin --image ${TEST_DIR}/fsbl.stm32
+verify_chain signed.bin ${OTP} || fail "chain of trust does not verify"
+verify_chain signed.bin $(printf '%064d' 0) 2> /dev/null && \
+    fail "wrong OTP hash accepted"
+
+head -c 100 /dev/urandom > ${TEST_DIR}/nt-fw.new
+${STM32MP1SIGN} --fip ${TEST_DIR}/signed.bin \
+		--fip-add nt-fw=${TEST_DIR}/nt-fw.new \
+		--fip-output ${TEST_DIR}/tampered.bin || fail "nt-fw swap failed"
+verify_chain tampered.bin ${OTP} 2> ${TEST_DIR}/tampered.log && \
+    fail "tampered nt-fw accepted"
+grep -q "nt-fw hash mismatch" ${TEST_DIR}/tampered.log || \
+    fail "tampered nt-fw not reported"
+
+sign signed.bin same.bin --fip-incremental
+cmp ${TEST_DIR}/signed.bin ${TEST_DIR}/same.bin || \
+    fail "incremental run changed an unchanged FIP"
+
+# A new nt-fw only needs a new nt-fw-cert.
+sign tampered.bin resigned.bin --fip-incremental
+verify_chain resigned.bin ${OTP} || fail "re-signed FIP does not verify"
+unpack signed.bin a
+unpack resigned.bin b
+for CERT in nt-fw-key-cert tb-fw-cert tos-fw-cert tos-fw-key-cert \
+	    trusted-key-cert; do
+    cmp ${TEST_DIR}/a/${CERT}.bin ${TEST_DIR}/b/${CERT}.bin || \
+	fail "${CERT} made again"
+done
+cmp -s ${TEST_DIR}/a/nt-fw-cert.bin ${TEST_DIR}/b/nt-fw-cert.bin && \
+    fail "nt-fw-cert kept"
+exit 0
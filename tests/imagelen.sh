@@ -0,0 +1,26 @@
+#!/bin/bash
+# --image-length hashes the header and image_length bytes of payload
+# only, like the boot ROM. Padding after it may change, an
+# image_length past the end of the file is an error.
+
+. ${srcdir:-.}/tests/common.sh
+
+make_key ${TEST_DIR}/key
+make_image ${TEST_DIR}/a.stm32 64K
+head -c 4096 /dev/urandom >> ${TEST_DIR}/a.stm32
+
+${STM32MP1SIGN} --image ${TEST_DIR}/a.stm32 --key ${TEST_DIR}/key.pem \
+		--password ${TEST_PWD} --sign --image-length || \
+    fail "signing failed"
+head -c 4096 /dev/urandom | dd of=${TEST_DIR}/a.stm32 bs=1 \
+			       seek=$((256 + 65536)) conv=notrunc 2> /dev/null
+${STM32MP1SIGN} --image ${TEST_DIR}/a.stm32 --key ${TEST_DIR}/key.pub \
+		--verify --image-length || fail "padding change not ignored"
+${STM32MP1SIGN} --image ${TEST_DIR}/a.stm32 --key ${TEST_DIR}/key.pub \
+		--verify 2> /dev/null && fail "whole file verified"
+
+truncate -s $((256 + 65535)) ${TEST_DIR}/a.stm32
+${STM32MP1SIGN} --image ${TEST_DIR}/a.stm32 --key ${TEST_DIR}/key.pem \
+		--password ${TEST_PWD} --sign --image-length 2> /dev/null && \
+    fail "image_length past the end of the file accepted"
+exit 0
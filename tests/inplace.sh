@@ -0,0 +1,18 @@
+#!/bin/bash
+# Signing in place only writes the 256 byte header. The payload and the
+# inode are left as they are.
+
+. ${srcdir:-.}/tests/common.sh
+
+make_key ${TEST_DIR}/key
+make_image ${TEST_DIR}/a.stm32 1M
+cp ${TEST_DIR}/a.stm32 ${TEST_DIR}/orig.stm32
+INODE=$(stat -c %i ${TEST_DIR}/a.stm32)
+
+${STM32MP1SIGN} --image ${TEST_DIR}/a.stm32 --key ${TEST_DIR}/key.pem \
+		--password ${TEST_PWD} --sign --sync || fail "signing failed"
+[ $(stat -c %i ${TEST_DIR}/a.stm32) -eq ${INODE} ] || fail "image replaced"
+cmp -i 256 ${TEST_DIR}/a.stm32 ${TEST_DIR}/orig.stm32 || fail "payload changed"
+cmp -s -n 256 ${TEST_DIR}/a.stm32 ${TEST_DIR}/orig.stm32 && \
+    fail "header not written"
+exit 0
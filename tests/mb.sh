@@ -0,0 +1,25 @@
+#!/bin/bash
+# Images hashed side by side in a batch sign the same as images hashed
+# one at a time, for sizes around the block and lane boundaries.
+
+. ${srcdir:-.}/tests/common.sh
+
+make_key ${TEST_DIR}/key
+mkdir ${TEST_DIR}/batch ${TEST_DIR}/single
+for SIZE in 1 55 56 63 64 65 119 120 128 1000 4096 4097 65536 100000 \
+	    1048576 1048577 3 17 250 333; do
+    make_image ${TEST_DIR}/batch/${SIZE}.stm32 ${SIZE} ${SIZE}
+    cp ${TEST_DIR}/batch/${SIZE}.stm32 ${TEST_DIR}/single/
+done
+
+${STM32MP1SIGN} --image-list <(ls ${TEST_DIR}/batch/*.stm32) --jobs 2 \
+		--key ${TEST_DIR}/key.pem --password ${TEST_PWD} --sign \
+		--deterministic || fail "batch signing failed"
+for IMAGE in ${TEST_DIR}/single/*.stm32; do
+    ${STM32MP1SIGN} --image ${IMAGE} --key ${TEST_DIR}/key.pem \
+		    --password ${TEST_PWD} --sign --deterministic || \
+	fail "${IMAGE} signing failed"
+    cmp ${IMAGE} ${TEST_DIR}/batch/$(basename ${IMAGE}) || \
+	fail "$(basename ${IMAGE}) signed differently in a batch"
+done
+exit 0
@@ -0,0 +1,20 @@
+#!/bin/bash
+# Every seed gives its own payload, the same seed the same one.
+
+. ${srcdir:-.}/tests/common.sh
+
+for SEED in 0 1 2 3; do
+    make_image ${TEST_DIR}/${SEED}.stm32 4K ${SEED}
+done
+make_image ${TEST_DIR}/again.stm32 4K 3
+
+cmp -s ${TEST_DIR}/3.stm32 ${TEST_DIR}/again.stm32 || \
+    fail "seed 3 is not reproducible"
+for A in 0 1 2 3; do
+    for B in 0 1 2 3; do
+	[ ${A} -lt ${B} ] || continue
+	cmp -s ${TEST_DIR}/${A}.stm32 ${TEST_DIR}/${B}.stm32 && \
+	    fail "seeds ${A} and ${B} give the same image"
+    done
+done
+exit 0
@@ -0,0 +1,36 @@
+#!/bin/bash
+# Numeric options take a whole number in range, nothing else.
+
+. ${srcdir:-.}/tests/common.sh
+
+make_key ${TEST_DIR}/key
+make_image ${TEST_DIR}/a.stm32 4K
+
+# bad_value option value...
+bad_value()
+{
+    OPTION=$1
+    shift
+    for VALUE in "$@"; do
+	${STM32MP1SIGN} --image ${TEST_DIR}/a.stm32 --key ${TEST_DIR}/key.pub \
+			--verify ${OPTION} ${VALUE} > /dev/null 2>&1 && \
+	    fail "${OPTION} ${VALUE} accepted"
+    done
+}
+
+bad_value --jobs 0 4x -1 "" 0x 1025 99999999999999999999
+bad_value --precompute 0 8x -1 16385 99999999999999999999
+bad_value --checkpoint 0 1M -1 4096 99999999999999999999
+bad_value --key-cache 0 15m -1 86401 99999999999999999999
+
+${STM32MP1SIGN} --image ${TEST_DIR}/a.stm32 --key ${TEST_DIR}/key.pem \
+		--password ${TEST_PWD} --sign --jobs 0x2 || fail "signing failed"
+${STM32MP1SIGN} --image ${TEST_DIR}/a.stm32 --key ${TEST_DIR}/key.pem \
+		--password ${TEST_PWD} --sign --precompute 16 || \
+    fail "signing with precomputed nonces failed"
+${STM32MP1SIGN} --image ${TEST_DIR}/a.stm32 --key ${TEST_DIR}/key.pem \
+		--password ${TEST_PWD} --sign --checkpoint 4095 || \
+    fail "signing with checkpoints failed"
+${STM32MP1SIGN} --image ${TEST_DIR}/a.stm32 --key ${TEST_DIR}/key.pub \
+		--verify --jobs 1024 || fail "--jobs 1024 rejected"
+exit 0
@@ -0,0 +1,27 @@
+#!/bin/bash
+# --output writes a signed copy, replacing any file there, and leaves
+# the input as it was. A copy that cannot be made leaves nothing behind.
+
+. ${srcdir:-.}/tests/common.sh
+
+make_key ${TEST_DIR}/key
+make_image ${TEST_DIR}/in.stm32 1M
+cp ${TEST_DIR}/in.stm32 ${TEST_DIR}/orig.stm32
+chmod 0640 ${TEST_DIR}/in.stm32
+echo stale > ${TEST_DIR}/out.stm32
+
+${STM32MP1SIGN} --image ${TEST_DIR}/in.stm32 --key ${TEST_DIR}/key.pem \
+		--password ${TEST_PWD} --sign \
+		--output ${TEST_DIR}/out.stm32 || fail "signing failed"
+cmp ${TEST_DIR}/in.stm32 ${TEST_DIR}/orig.stm32 || fail "input changed"
+${STM32MP1SIGN} --image ${TEST_DIR}/out.stm32 --key ${TEST_DIR}/key.pub \
+		--verify || fail "output does not verify"
+[ "$(stat -c %a ${TEST_DIR}/out.stm32)" = 640 ] || \
+    fail "output mode not kept"
+[ $(ls ${TEST_DIR} | wc -l) -eq 5 ] || fail "temporary files left over"
+
+${STM32MP1SIGN} --image ${TEST_DIR}/in.stm32 --key ${TEST_DIR}/key.pem \
+		--password ${TEST_PWD} --sign \
+		--output ${TEST_DIR}/missing/out.stm32 2> /dev/null && \
+    fail "output to a missing directory succeeded"
+exit 0
@@ -0,0 +1,31 @@
+#!/bin/bash
+# Verification only needs read access. An image on a read-only mount
+# verifies, signing it fails. The mount is made in a user namespace,
+# the test is skipped where there is none.
+
+. ${srcdir:-.}/tests/common.sh
+
+unshare -r -m true 2> /dev/null || exit 77
+
+make_key ${TEST_DIR}/key
+mkdir ${TEST_DIR}/ro
+make_image ${TEST_DIR}/ro/a.stm32 64K
+${STM32MP1SIGN} --image ${TEST_DIR}/ro/a.stm32 --key ${TEST_DIR}/key.pem \
+		--password ${TEST_PWD} --sign || fail "signing failed"
+
+export STM32MP1SIGN TEST_DIR TEST_PWD
+unshare -r -m bash -c '
+    mount --bind -o ro ${TEST_DIR}/ro ${TEST_DIR}/ro || exit 2
+    ${STM32MP1SIGN} --image ${TEST_DIR}/ro/a.stm32 \
+		    --key ${TEST_DIR}/key.pub --verify || exit 3
+    ${STM32MP1SIGN} --image ${TEST_DIR}/ro/a.stm32 \
+		    --key ${TEST_DIR}/key.pem --password ${TEST_PWD} \
+		    --sign 2> /dev/null && exit 4
+    exit 0'
+case $? in
+    0) ;;
+    2) exit 77 ;;
+    3) fail "read-only image does not verify" ;;
+    *) fail "read-only image signed" ;;
+esac
+exit 0
@@ -0,0 +1,49 @@
+#!/bin/bash
+# Daemon round trip. Several clients sign at once, by fd and by digest,
+# and the daemon stops cleanly on SIGTERM.
+
+. ${srcdir:-.}/tests/common.sh
+
+SOCK=${TEST_DIR}/sock
+make_key ${TEST_DIR}/key
+for I in 1 2 3 4 5 6 7 8; do
+    make_image ${TEST_DIR}/${I}.stm32 64K ${I}
+done
+
+${STM32MP1SIGN} --serve ${SOCK} --key ${TEST_DIR}/key.pem \
+		--password ${TEST_PWD} --jobs 4 &
+SERVE_PID=$!
+for I in $(seq 1 50); do
+    [ -S ${SOCK} ] && break
+    sleep 0.1
+done
+[ -S ${SOCK} ] || fail "daemon did not start"
+
+${STM32MP1SIGN} --connect ${SOCK} --sign --jobs 4 \
+		--image ${TEST_DIR}/1.stm32 --image ${TEST_DIR}/2.stm32 \
+		--image ${TEST_DIR}/3.stm32 --image ${TEST_DIR}/4.stm32 &
+FD_PID=$!
+${STM32MP1SIGN} --connect ${SOCK} --sign --jobs 4 --digest-only \
+		--image ${TEST_DIR}/5.stm32 --image ${TEST_DIR}/6.stm32 \
+		--image ${TEST_DIR}/7.stm32 --image ${TEST_DIR}/8.stm32 || \
+    fail "digest signing through the daemon failed"
+wait ${FD_PID} || fail "fd signing through the daemon failed"
+
+${STM32MP1SIGN} --key ${TEST_DIR}/key.pub --verify --image-list - <<-EOF2 || \
+	fail "daemon signatures do not verify"
+	${TEST_DIR}/1.stm32
+	${TEST_DIR}/2.stm32
+	${TEST_DIR}/3.stm32
+	${TEST_DIR}/4.stm32
+	${TEST_DIR}/5.stm32
+	${TEST_DIR}/6.stm32
+	${TEST_DIR}/7.stm32
+	${TEST_DIR}/8.stm32
+EOF2
+${STM32MP1SIGN} --connect ${SOCK} --verify --image ${TEST_DIR}/1.stm32 || \
+    fail "verification through the daemon failed"
+
+kill -TERM ${SERVE_PID}
+wait ${SERVE_PID} || fail "daemon did not stop cleanly"
+[ -e ${SOCK} ] && fail "daemon left its socket behind"
+exit 0
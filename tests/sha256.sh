@@ -0,0 +1,15 @@
+#!/bin/bash
+# sha256bench with its default sizes. Every kernel the CPU can run is
+# checked against OpenSSL first.
+
+. ${srcdir:-.}/tests/common.sh
+
+SHA256BENCH=${SHA256BENCH:-./sha256bench}
+
+${SHA256BENCH} > ${TEST_DIR}/bench.txt || fail "sha256bench failed"
+grep -q "^impl=openssl size=1048576 " ${TEST_DIR}/bench.txt || \
+    fail "sha256bench did not run the default sizes"
+# AVX2 is only timed, never picked on its own.
+grep -q "^# default=avx2 " ${TEST_DIR}/bench.txt && \
+    fail "avx2 kernel picked by default"
+exit 0
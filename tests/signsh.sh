@@ -0,0 +1,35 @@
+#!/bin/bash
+# sign.sh signs the FSBL and the FIP into its output directory, with
+# the cert_create names for the certs, and fails on a bad password.
+
+. ${srcdir:-.}/tests/common.sh
+
+SIGN_SH=${srcdir:-.}/sign.sh
+PATH=$(cd $(dirname ${STM32MP1SIGN}) && pwd):${PATH}
+
+make_key ${TEST_DIR}/rot
+make_image ${TEST_DIR}/fsbl.stm32 64K
+make_fip ${TEST_DIR}/fip.bin
+cp ${TEST_DIR}/fsbl.stm32 ${TEST_DIR}/fsbl.orig
+
+bash ${SIGN_SH} --rot-key ${TEST_DIR}/rot.pem --rot-key-pwd ${TEST_PWD} \
+     --fsbl ${TEST_DIR}/fsbl.stm32 --fip ${TEST_DIR}/fip.bin \
+     --outdir ${TEST_DIR}/out > ${TEST_DIR}/sign.log 2>&1 || \
+    fail "sign.sh failed: $(tail -1 ${TEST_DIR}/sign.log)"
+for CERT in nt-fw-cert nt-fw-key-cert tb-fw-cert tos-fw-cert \
+	    tos-fw-key-cert trusted-key-cert; do
+    [ -f ${TEST_DIR}/out/${CERT}.crt ] || fail "${CERT}.crt missing"
+    [ -f ${TEST_DIR}/out/${CERT}.bin ] && fail "${CERT}.bin left over"
+done
+[ -f ${TEST_DIR}/out/fip_Signed.bin ] || fail "signed FIP missing"
+cmp -s ${TEST_DIR}/fsbl.stm32 ${TEST_DIR}/fsbl.orig || fail "input FSBL changed"
+${STM32MP1SIGN} --image ${TEST_DIR}/out/fsbl.stm32 --key ${TEST_DIR}/rot.pub \
+		--verify || fail "signed FSBL does not verify"
+
+bash ${SIGN_SH} --rot-key ${TEST_DIR}/rot.pem --rot-key-pwd wrong \
+     --fsbl ${TEST_DIR}/fsbl.stm32 --fip ${TEST_DIR}/fip.bin \
+     --outdir ${TEST_DIR}/bad > ${TEST_DIR}/bad.log 2>&1 && \
+    fail "sign.sh succeeded with a wrong password"
+grep -q "signing failed" ${TEST_DIR}/bad.log || \
+    fail "sign.sh did not report the failure"
+exit 0
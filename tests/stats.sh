@@ -0,0 +1,31 @@
+#!/bin/bash
+# --stats prints one line of key=value pairs, --stats=json one flat JSON
+# object, with the image count and the per image latencies of the run.
+
+. ${srcdir:-.}/tests/common.sh
+
+make_key ${TEST_DIR}/key
+for I in 1 2 3; do
+    make_image ${TEST_DIR}/${I}.stm32 8K ${I}
+done
+
+${STM32MP1SIGN} --image ${TEST_DIR}/1.stm32 --image ${TEST_DIR}/2.stm32 \
+		--image ${TEST_DIR}/3.stm32 --key ${TEST_DIR}/key.pem \
+		--password ${TEST_PWD} --sign --stats=json \
+		> ${TEST_DIR}/sign.json || fail "signing failed"
+[ $(wc -l < ${TEST_DIR}/sign.json) -eq 1 ] || fail "JSON is not one line"
+grep -q '^{"op": "sign", .*}$' ${TEST_DIR}/sign.json || \
+    fail "JSON is not an object"
+for FIELD in '"images": 3,' '"cache_hits": 0,' '"hash_ns": [0-9]*,' \
+	     '"image_p50_ns": [1-9][0-9]*,' '"image_max_ns": [1-9][0-9]*,' \
+	     '"max_rss_kb": [1-9][0-9]*}'; do
+    grep -q "${FIELD}" ${TEST_DIR}/sign.json || fail "JSON misses ${FIELD}"
+done
+
+${STM32MP1SIGN} --image ${TEST_DIR}/1.stm32 --key ${TEST_DIR}/key.pub \
+		--verify --stats > ${TEST_DIR}/verify.txt || \
+    fail "verification failed"
+[ $(wc -l < ${TEST_DIR}/verify.txt) -eq 1 ] || fail "stats are not one line"
+grep -q '^op=verify .*images=1 .*image_p50_ns=[1-9]' ${TEST_DIR}/verify.txt || \
+    fail "key=value stats wrong"
+exit 0
@@ -0,0 +1,22 @@
+#!/bin/bash
+# Streamed hashing signs the same as the mapped image, across several
+# reader chunks, and a streamed verify agrees.
+
+. ${srcdir:-.}/tests/common.sh
+
+make_key ${TEST_DIR}/key
+make_image ${TEST_DIR}/map.stm32 3M
+cp ${TEST_DIR}/map.stm32 ${TEST_DIR}/stream.stm32
+
+for MODE in map stream; do
+    FLAGS="--deterministic"
+    [ ${MODE} = stream ] && FLAGS="${FLAGS} --stream"
+    ${STM32MP1SIGN} --image ${TEST_DIR}/${MODE}.stm32 \
+		    --key ${TEST_DIR}/key.pem --password ${TEST_PWD} \
+		    --sign ${FLAGS} || fail "${MODE} signing failed"
+done
+cmp ${TEST_DIR}/map.stm32 ${TEST_DIR}/stream.stm32 || \
+    fail "streamed and mapped signatures differ"
+${STM32MP1SIGN} --image ${TEST_DIR}/stream.stm32 --key ${TEST_DIR}/key.pub \
+		--verify --stream || fail "streamed verification failed"
+exit 0